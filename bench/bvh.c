@@ -0,0 +1,162 @@
+/* See LICENSE for license details. */
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "culling.h"
+#include "bvh.h"
+
+/*
+ * compares BVH frustum and ray queries against testing every box, over
+ * synthetic scenes of small boxes scattered through a cube, and times
+ * refitting the BVH after a few of them moved.
+ */
+
+#define WORLD 1000.0f
+#define QUERIES 200
+#define MOVED 100
+
+static float
+frand(float min, float max)
+{
+	return min + (max - min) * rand() / (float) RAND_MAX;
+}
+
+static double
+seconds(clock_t start)
+{
+	return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void
+bench(size_t n)
+{
+	vec3 *mins = malloc(n * sizeof(vec3));
+	vec3 *maxs = malloc(n * sizeof(vec3));
+	unsigned char *visible = malloc(n);
+	unsigned int *indices = malloc(n * sizeof(unsigned int));
+	struct boxes boxes = { 0 };
+	struct bvh bvh = { 0 };
+	mat4 identity;
+
+	glm_mat4_identity(identity);
+	for (size_t i = 0; i < n; i++) {
+		vec3 center = { frand(0, WORLD), frand(0, WORLD), frand(0, WORLD) };
+		vec3 extent = { frand(0.5f, 4.0f), frand(0.5f, 4.0f), frand(0.5f, 4.0f) };
+		glm_vec3_sub(center, extent, mins[i]);
+		glm_vec3_add(center, extent, maxs[i]);
+		push_box(&boxes, identity, mins[i], maxs[i]);
+	}
+
+	clock_t start = clock();
+	build_bvh(&bvh, mins, maxs, n);
+	double build = seconds(start);
+
+	mat4 projection;
+	glm_perspective(PI / 4, 4.0f / 3.0f, 0.05f, 128.0f, projection);
+
+	struct frustum frustums[QUERIES];
+	vec3 origins[QUERIES], dirs[QUERIES];
+	for (int q = 0; q < QUERIES; q++) {
+		vec3 target, up = { 0.0f, 1.0f, 0.0f };
+		mat4 view, view_projection;
+		glm_vec3_copy((vec3) { frand(0, WORLD), frand(0, WORLD), frand(0, WORLD) }, origins[q]);
+		glm_vec3_copy((vec3) { frand(-1, 1), frand(-1, 1), frand(-1, 1) }, dirs[q]);
+		glm_normalize(dirs[q]);
+		glm_vec3_add(origins[q], dirs[q], target);
+		glm_lookat(origins[q], target, up, view);
+		glm_mat4_mul(projection, view, view_projection);
+		extract_frustum(view_projection, &frustums[q]);
+	}
+
+	size_t linear_visible = 0, bvh_visible = 0;
+	start = clock();
+	for (int q = 0; q < QUERIES; q++)
+		linear_visible += cull_boxes(&frustums[q], &boxes, visible);
+	double linear_cull = seconds(start) / QUERIES;
+
+	start = clock();
+	for (int q = 0; q < QUERIES; q++)
+		bvh_visible += cull_bvh(&bvh, &frustums[q], indices);
+	double bvh_cull = seconds(start) / QUERIES;
+
+	int linear_hits = 0, bvh_hits = 0;
+	start = clock();
+	for (int q = 0; q < QUERIES; q++) {
+		vec3 inv_dir;
+		float nearest = FLT_MAX;
+		for (int a = 0; a < 3; a++)
+			inv_dir[a] = 1.0f / dirs[q][a];
+		for (size_t i = 0; i < n; i++) {
+			float t_min = 0.0f, t_max = nearest;
+			for (int a = 0; a < 3; a++) {
+				float t0 = (mins[i][a] - origins[q][a]) * inv_dir[a];
+				float t1 = (maxs[i][a] - origins[q][a]) * inv_dir[a];
+				t_min = fmaxf(t_min, fminf(t0, t1));
+				t_max = fminf(t_max, fmaxf(t0, t1));
+			}
+			if (t_min <= t_max)
+				nearest = t_min;
+		}
+		linear_hits += nearest != FLT_MAX;
+	}
+	double linear_ray = seconds(start) / QUERIES;
+
+	start = clock();
+	for (int q = 0; q < QUERIES; q++) {
+		float t;
+		bvh_hits += raycast_bvh(&bvh, origins[q], dirs[q], FLT_MAX, &t) >= 0;
+	}
+	double bvh_ray = seconds(start) / QUERIES;
+
+	start = clock();
+	for (int m = 0; m < MOVED; m++) {
+		unsigned int p = rand() % n;
+		vec3 offset = { frand(-4, 4), frand(-4, 4), frand(-4, 4) }, min, max;
+		glm_vec3_add(mins[p], offset, min);
+		glm_vec3_add(maxs[p], offset, max);
+		refit_bvh(&bvh, p, min, max);
+	}
+	double refit = seconds(start);
+
+	printf(
+		"%7zu boxes, %6zu nodes, build %8.3f ms, refit %d %8.4f ms | "
+		"frustum %8.4f ms linear %8.4f ms bvh (%zu/%zu visible) | "
+		"ray %8.4f ms linear %8.4f ms bvh (%d/%d hits)\n",
+		n, bvh.n_nodes, build * 1000.0, MOVED, refit * 1000.0,
+		linear_cull * 1000.0, bvh_cull * 1000.0,
+		bvh_visible / QUERIES, linear_visible / QUERIES,
+		linear_ray * 1000.0, bvh_ray * 1000.0,
+		bvh_hits, linear_hits
+	);
+
+	free_bvh(&bvh);
+	free(boxes.cx);
+	free(boxes.cy);
+	free(boxes.cz);
+	free(boxes.ex);
+	free(boxes.ey);
+	free(boxes.ez);
+	free(mins);
+	free(maxs);
+	free(visible);
+	free(indices);
+}
+
+int
+main(void)
+{
+	srand(1);
+	bench(10000);
+	bench(30000);
+	bench(100000);
+	return 0;
+}
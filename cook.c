@@ -0,0 +1,377 @@
+/* See LICENSE for license details. */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "models.h"
+#include "pack.h"
+
+/*
+ * cook - converts a glTF model and its textures to a pack the engine maps
+ * and uploads without parsing anything. vertices are stored in the format
+ * the loader would pick, textures as BC1 (opaque) or BC3 mip chains, and
+ * meshes get their levels of detail simplified and their indices
+ * optimized once here.
+ */
+
+static void
+usage(void)
+{
+	errlog("usage: cook [-f] model.gltf model" PACK_EXTENSION);
+	errlog("  -f  keep float vertices instead of quantizing them");
+	exit(1);
+}
+
+static uint16_t
+to_565(const int color[3])
+{
+	return (color[0] * 31 + 127) / 255 << 11 |
+		(color[1] * 63 + 127) / 255 << 5 |
+		(color[2] * 31 + 127) / 255;
+}
+
+static void
+from_565(uint16_t c, int color[3])
+{
+	int r = c >> 11 & 31, g = c >> 5 & 63, b = c & 31;
+	color[0] = r << 3 | r >> 2;
+	color[1] = g << 2 | g >> 4;
+	color[2] = b << 3 | b >> 2;
+}
+
+/*
+ * BC1 color block. the endpoints are the extremes of the block along its
+ * principal axis, found with a few power iterations on the covariance.
+ */
+static void
+encode_color_block(unsigned char block[16][4], unsigned char out[8])
+{
+	float mean[3] = { 0 };
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 3; c++)
+			mean[c] += block[i][c] / 16.0f;
+
+	float cov[6] = { 0 };
+	for (int i = 0; i < 16; i++) {
+		float r = block[i][0] - mean[0], g = block[i][1] - mean[1], b = block[i][2] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+
+	float axis[3] = { 0.9f, 1.0f, 0.7f };
+	for (int it = 0; it < 4; it++) {
+		float x = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+		float y = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+		float z = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+		float m = fmaxf(fabsf(x), fmaxf(fabsf(y), fabsf(z)));
+		if (m < 1e-6f)
+			break;
+		axis[0] = x / m; axis[1] = y / m; axis[2] = z / m;
+	}
+
+	int lo = 0, hi = 0;
+	float min_dot = 0.0f, max_dot = 0.0f;
+	for (int i = 0; i < 16; i++) {
+		float dot = block[i][0] * axis[0] + block[i][1] * axis[1] + block[i][2] * axis[2];
+		if (i == 0 || dot < min_dot) {
+			min_dot = dot;
+			lo = i;
+		}
+		if (i == 0 || dot > max_dot) {
+			max_dot = dot;
+			hi = i;
+		}
+	}
+
+	int max_color[3] = { block[hi][0], block[hi][1], block[hi][2] };
+	int min_color[3] = { block[lo][0], block[lo][1], block[lo][2] };
+	uint16_t c0 = to_565(max_color), c1 = to_565(min_color);
+	if (c0 < c1) {
+		uint16_t swap = c0;
+		c0 = c1;
+		c1 = swap;
+	}
+
+	/* c0 > c1 selects the four color mode, equal endpoints need no indices */
+	uint32_t indices = 0;
+	if (c0 != c1) {
+		int palette[4][3];
+		from_565(c0, palette[0]);
+		from_565(c1, palette[1]);
+		for (int c = 0; c < 3; c++) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+
+		for (int i = 0; i < 16; i++) {
+			int best = 0, best_error = -1;
+			for (int p = 0; p < 4; p++) {
+				int error = 0;
+				for (int c = 0; c < 3; c++) {
+					int d = block[i][c] - palette[p][c];
+					error += d * d;
+				}
+				if (best_error < 0 || error < best_error) {
+					best = p;
+					best_error = error;
+				}
+			}
+			indices |= (uint32_t) best << (2 * i);
+		}
+	}
+
+	out[0] = c0 & 0xff;
+	out[1] = c0 >> 8;
+	out[2] = c1 & 0xff;
+	out[3] = c1 >> 8;
+	for (int i = 0; i < 4; i++)
+		out[4 + i] = indices >> (8 * i) & 0xff;
+}
+
+/* BC3 alpha block, interpolating eight values between the extremes */
+static void
+encode_alpha_block(unsigned char block[16][4], unsigned char out[8])
+{
+	int a0 = 0, a1 = 255;
+	for (int i = 0; i < 16; i++) {
+		if (block[i][3] > a0)
+			a0 = block[i][3];
+		if (block[i][3] < a1)
+			a1 = block[i][3];
+	}
+
+	uint64_t indices = 0;
+	if (a0 != a1) {
+		int palette[8] = { a0, a1 };
+		for (int p = 1; p < 7; p++)
+			palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			for (int p = 1; p < 8; p++) {
+				if (abs(block[i][3] - palette[p]) < abs(block[i][3] - palette[best]))
+					best = p;
+			}
+			indices |= (uint64_t) best << (3 * i);
+		}
+	}
+
+	out[0] = a0;
+	out[1] = a1;
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = indices >> (8 * i) & 0xff;
+}
+
+/* compresses a RGBA mip level, edge pixels fill the blocks past its size */
+static size_t
+compress_level(const unsigned char *pixels, int width, int height, int alpha,
+		unsigned char *out)
+{
+	size_t size = 0;
+
+	for (int by = 0; by < height; by += 4) {
+		for (int bx = 0; bx < width; bx += 4) {
+			unsigned char block[16][4];
+			for (int y = 0; y < 4; y++) {
+				for (int x = 0; x < 4; x++) {
+					int px = bx + x < width ? bx + x : width - 1;
+					int py = by + y < height ? by + y : height - 1;
+					memcpy(block[y * 4 + x], pixels + ((size_t) py * width + px) * 4, 4);
+				}
+			}
+
+			if (alpha) {
+				encode_alpha_block(block, out + size);
+				size += 8;
+			}
+			encode_color_block(block, out + size);
+			size += 8;
+		}
+	}
+	return size;
+}
+
+static void
+compress_image(const struct image *image, struct pack_texture *texture, unsigned char **data)
+{
+	int alpha = 0;
+	for (size_t i = 3; i < (size_t) image->width * image->height * 4; i += 4) {
+		if (image->pixels[i] != 255) {
+			alpha = 1;
+			break;
+		}
+	}
+
+	texture->format = alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	texture->width = image->width;
+	texture->height = image->height;
+	texture->levels = image->levels;
+
+	size_t block_size = alpha ? 16 : 8;
+	size_t size = 0;
+	for (int level = 0; level < image->levels; level++) {
+		size_t blocks_x = (mip_size(image->width, level) + 3) / 4;
+		size_t blocks_y = (mip_size(image->height, level) + 3) / 4;
+		size += blocks_x * blocks_y * block_size;
+	}
+
+	*data = malloc(size);
+	if (*data == NULL) {
+		errlog("couldn't compress a %dx%d texture.", image->width, image->height);
+		exit(1);
+	}
+
+	texture->size = 0;
+	for (int level = 0; level < image->levels; level++) {
+		texture->offsets[level] = texture->size;
+		texture->size += compress_level(image->pixels + image->offsets[level],
+			mip_size(image->width, level), mip_size(image->height, level),
+			alpha, *data + texture->size);
+	}
+}
+
+/* writes data at the next PACK_ALIGN boundary and returns its offset */
+static uint64_t
+write_blob(FILE *file, uint64_t *position, const void *data, size_t size)
+{
+	static const unsigned char zeros[PACK_ALIGN];
+
+	size_t padding = (PACK_ALIGN - *position % PACK_ALIGN) % PACK_ALIGN;
+	uint64_t offset = *position + padding;
+
+	if (fwrite(zeros, 1, padding, file) != padding ||
+	    fwrite(data, 1, size, file) != size) {
+		errlog("couldn't write the pack.");
+		exit(1);
+	}
+	*position = offset + size;
+	return offset;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int flags = LOAD_QUANTIZE | LOAD_LODS;
+
+	if (argc == 4 && strcmp(argv[1], "-f") == 0) {
+		flags &= ~LOAD_QUANTIZE;
+		argv++;
+		argc--;
+	}
+	if (argc != 3 || is_pack(argv[1]))
+		usage();
+
+	struct staged_model staged;
+	stage_model(&staged, argv[1], flags);
+	struct model *model = &staged.model;
+
+	struct pack_mesh *meshes = calloc(model->n_meshes, sizeof(struct pack_mesh));
+	struct pack_texture *textures = calloc(model->n_meshes, sizeof(struct pack_texture));
+	const struct image **images = calloc(model->n_meshes, sizeof(struct image *));
+	if (meshes == NULL || textures == NULL || images == NULL) {
+		errlog("couldn't cook the %s model.", argv[1]);
+		exit(1);
+	}
+
+	struct pack_header header = { { 0 } };
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.version = PACK_VERSION;
+	header.n_meshes = model->n_meshes;
+
+	/*
+	 * only the first mesh using a texture decodes it, the others share
+	 * its key and get the same texture in the pack.
+	 */
+	for (size_t i = 0; i < model->n_meshes; i++) {
+		const struct staged_mesh *staged_mesh = &staged.meshes[i];
+		meshes[i].texture = -1;
+
+		if (staged_mesh->image.pixels != NULL) {
+			meshes[i].texture = header.n_textures;
+			images[header.n_textures++] = &staged_mesh->image;
+			continue;
+		}
+		for (size_t j = 0; j < i && staged_mesh->texture_key != 0; j++) {
+			if (staged.meshes[j].texture_key == staged_mesh->texture_key) {
+				meshes[i].texture = meshes[j].texture;
+				break;
+			}
+		}
+	}
+
+	FILE *file = fopen(argv[2], "wb");
+	if (file == NULL) {
+		errlog("couldn't create the %s pack.", argv[2]);
+		exit(1);
+	}
+
+	/* the tables are written last, once the blob offsets are known */
+	header.meshes = sizeof(struct pack_header);
+	header.textures = header.meshes + header.n_meshes * sizeof(struct pack_mesh);
+	uint64_t position = header.textures + header.n_textures * sizeof(struct pack_texture);
+	if (fseek(file, position, SEEK_SET) != 0) {
+		errlog("couldn't write the %s pack.", argv[2]);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < model->n_meshes; i++) {
+		const struct mesh *mesh = &model->meshes[i];
+		const struct staged_mesh *staged_mesh = &staged.meshes[i];
+		struct pack_mesh *pack_mesh = &meshes[i];
+
+		pack_mesh->vertices = write_blob(file, &position, staged_mesh->vertices,
+			mesh->n_vertices * vertex_sizes[mesh->format]);
+		pack_mesh->indices = write_blob(file, &position, staged_mesh->indices,
+			mesh->n_indices * index_sizes[mesh->index_type]);
+		pack_mesh->n_vertices = mesh->n_vertices;
+		pack_mesh->n_indices = mesh->n_indices;
+		pack_mesh->format = mesh->format;
+		pack_mesh->index_type = mesh->index_type;
+		pack_mesh->culling = mesh->culling;
+		pack_mesh->alpha_mode = mesh->alpha_mode;
+		pack_mesh->min_filter = staged_mesh->min_filter;
+		pack_mesh->mag_filter = staged_mesh->mag_filter;
+		pack_mesh->wrap_s = staged_mesh->wrap_s;
+		pack_mesh->wrap_t = staged_mesh->wrap_t;
+		memcpy(pack_mesh->min, mesh->min, sizeof(vec3));
+		memcpy(pack_mesh->max, mesh->max, sizeof(vec3));
+		memcpy(pack_mesh->center, mesh->center, sizeof(vec3));
+		pack_mesh->radius = mesh->radius;
+		pack_mesh->n_lods = mesh->n_lods;
+		for (int l = 0; l < mesh->n_lods; l++) {
+			pack_mesh->lod_offsets[l] = mesh->lods[l].offset;
+			pack_mesh->lod_indices[l] = mesh->lods[l].n_indices;
+			pack_mesh->lod_errors[l] = mesh->lods[l].error;
+		}
+	}
+
+	for (uint32_t t = 0; t < header.n_textures; t++) {
+		unsigned char *data;
+		compress_image(images[t], &textures[t], &data);
+		textures[t].data = write_blob(file, &position, data, textures[t].size);
+		free(data);
+	}
+
+	header.size = position;
+	rewind(file);
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+	    fwrite(meshes, sizeof(struct pack_mesh), header.n_meshes, file) != header.n_meshes ||
+	    fwrite(textures, sizeof(struct pack_texture), header.n_textures, file) != header.n_textures ||
+	    fclose(file) != 0) {
+		errlog("couldn't write the %s pack.", argv[2]);
+		exit(1);
+	}
+
+	printf("%s: %u meshes, %u textures, %llu bytes\n", argv[2],
+		header.n_meshes, header.n_textures, (unsigned long long) header.size);
+	return 0;
+}
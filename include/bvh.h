@@ -0,0 +1,34 @@
+/* See LICENSE for license details. */
+
+/*
+ * 32 byte node. inner nodes have count 0 and their children at first and
+ * first + 1, leaves hold count primitives starting at indices[first].
+ */
+struct bvh_node {
+	vec3 min;
+	unsigned int first;
+	vec3 max;
+	unsigned int count;
+};
+
+struct bvh {
+	struct bvh_node *nodes;
+	size_t n_nodes;
+	unsigned int *indices;	/* primitives in leaf order */
+	unsigned int *parents;	/* parent of every node */
+	unsigned int *leaves;	/* leaf holding every primitive */
+	vec3 *mins, *maxs;	/* world space box of every primitive */
+	size_t n_primitives;
+};
+
+void build_bvh(struct bvh *bvh, vec3 *mins, vec3 *maxs, size_t n);
+
+void free_bvh(struct bvh *bvh);
+
+void refit_bvh(struct bvh *bvh, unsigned int primitive, vec3 min, vec3 max);
+
+size_t cull_bvh(const struct bvh *bvh, const struct frustum *frustum, unsigned int *visible);
+
+int raycast_bvh(const struct bvh *bvh, vec3 origin, vec3 dir, float max_t, float *t);
+
+int occluded_bvh(const struct bvh *bvh, vec3 from, vec3 to);
@@ -0,0 +1,67 @@
+/* See LICENSE for license details. */
+
+/* VRAM the cache keeps unreferenced resources around in */
+#define CACHE_BUDGET ((size_t) 512 << 20)
+
+enum {
+	CACHE_TEXTURE,
+	CACHE_MODEL,
+	CACHE_PROGRAM,
+	CACHE_TYPES
+};
+
+/*
+ * GPU resources by key, a hash of their canonical path or their content.
+ * entries nobody references stay around until evict_cache needs the room.
+ */
+struct cache_entry {
+	uint64_t key;		/* 0 for a free slot */
+	int type;
+	unsigned int refs;
+	size_t bytes;		/* of VRAM */
+	unsigned long last_use;
+	union {
+		GLuint texture;
+		struct program program;
+		struct model *model;
+	} value;
+};
+
+struct cache {
+	struct cache_entry *entries;
+	size_t n_entries, capacity;
+	size_t count[CACHE_TYPES];
+	size_t bytes[CACHE_TYPES];
+	unsigned long clock;
+	unsigned long hits, misses;
+};
+
+extern struct cache cache;
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+
+uint64_t path_key(int type, const char *path);
+
+uint64_t content_key(int type, const void *data, size_t size);
+
+GLuint acquire_texture(uint64_t key);
+
+void cache_texture(uint64_t key, GLuint texture, size_t bytes);
+
+void release_texture(uint64_t key);
+
+int acquire_model(uint64_t key, struct model *model);
+
+void cache_model(uint64_t key, struct model *model);
+
+void release_model(const struct model *model);
+
+int acquire_program(uint64_t key, struct program *program);
+
+void cache_program(uint64_t key, const struct program *program);
+
+void release_program(const struct program *program);
+
+size_t evict_cache(size_t budget);
+
+void print_cache_stats(void);
@@ -0,0 +1,21 @@
+/* See LICENSE for license details. */
+
+/* frustum planes, one array per coefficient: a * x + b * y + c * z + d >= 0 inside */
+struct frustum {
+	float a[6], b[6], c[6], d[6];
+};
+
+/* world space bounding boxes as centers and half extents, one array per component */
+struct boxes {
+	float *cx, *cy, *cz;
+	float *ex, *ey, *ez;
+	size_t n, capacity;
+};
+
+void extract_frustum(mat4 view_projection, struct frustum *frustum);
+
+void transform_box(mat4 model, vec3 min, vec3 max, vec3 world_min, vec3 world_max);
+
+void push_box(struct boxes *boxes, mat4 model, vec3 min, vec3 max);
+
+size_t cull_boxes(const struct frustum *frustum, const struct boxes *boxes, unsigned char *visible);
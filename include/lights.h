@@ -0,0 +1,38 @@
+/* See LICENSE for license details. */
+
+/* must match the CLUSTERS_* in shaders/entity.fs.glsl */
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+#define CLUSTERS (CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z)
+
+/* a light stops being binned where it adds less than this to a fragment */
+#define LIGHT_CUTOFF (1.0f / 256.0f)
+
+/*
+ * point lights binned into clusters, tiles of the screen split again into
+ * depth slices growing exponentially from the near to the far plane. each
+ * cluster gets a range of the light index list, so a fragment only loops
+ * over the lights that can reach it.
+ */
+struct light_grid {
+	GLuint lights, clusters, indices;	/* shader storage buffers */
+	size_t lights_size, indices_size;	/* of the buffers, in bytes */
+	struct pos_light_block *blocks;
+	int (*bounds)[6];			/* cluster range of each light */
+	size_t capacity;			/* of blocks and bounds */
+	GLuint ranges[CLUSTERS][2];		/* offset and count of each cluster */
+	GLuint *light_indices;
+	size_t n_indices, indices_capacity;
+};
+
+extern struct pos_light *pos_lights;
+extern size_t n_pos_lights;
+
+size_t add_pos_light(const struct pos_light *light);
+
+void create_light_grid(struct light_grid *grid);
+
+void update_light_grid(struct light_grid *grid);
+
+void print_light_stats(const struct light_grid *grid);
@@ -0,0 +1,39 @@
+/* See LICENSE for license details. */
+
+#define LOADER_THREADS 8
+/* staged models waiting for the GL thread, bounds the staging memory */
+#define LOADER_STAGED 4
+
+struct load_job {
+	char *path;
+	int flags;
+	uint64_t key;
+	struct model *model;
+	struct staged_model staged;
+	struct load_job *next;
+};
+
+/*
+ * loads models on worker threads. they parse, decode and pack everything
+ * into staging memory, the GL thread uploads it a mesh at a time.
+ */
+struct loader {
+	pthread_t threads[LOADER_THREADS];
+	size_t n_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a job was queued or uploaded, or the loader stops */
+	struct load_job *pending, *pending_tail;
+	struct load_job *staged, *staged_tail;
+	size_t n_staged;	/* jobs being staged or waiting for their upload */
+	struct load_job *uploading;	/* owned by the GL thread */
+	size_t n_jobs;			/* queued but not ready yet */
+	int stop;
+};
+
+void start_loader(struct loader *loader);
+
+void queue_load(struct loader *loader, struct model *model, const char *path, int flags);
+
+size_t update_loader(struct loader *loader, double budget);
+
+void stop_loader(struct loader *loader);
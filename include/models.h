@@ -7,24 +7,151 @@ struct vertex {
 	vec4 col;
 };
 
+/*
+ * compact vertex, positions are 16 bit unorm within the mesh bounds
+ * (folded back into the model matrix per instance), normals 10:10:10:2
+ * snorm, uvs half floats and colors 8 bit unorm. meshes without colors
+ * leave col out.
+ */
+struct packed_vertex {
+	GLushort pos[4];
+	GLuint nor;
+	GLushort uvs[2];
+	GLubyte col[4];
+};
+
+enum {
+	VERTEX_FLOAT,		/* struct vertex */
+	VERTEX_PACKED,		/* struct packed_vertex without col */
+	VERTEX_PACKED_COLOR,	/* struct packed_vertex */
+	VERTEX_FORMATS
+};
+
+/* index widths, meshes with fewer than 65536 vertices get 16 bit ones */
+enum {
+	INDEX_32,
+	INDEX_16,
+	INDEX_TYPES
+};
+
+/*
+ * from the glTF alphaMode. blending isn't supported, so blended materials
+ * are alpha tested too. only opaque meshes keep early depth testing.
+ */
+enum {
+	ALPHA_OPAQUE,
+	ALPHA_MASK,
+};
+
+/* load_model flags */
+enum {
+	LOAD_QUANTIZE = 1,
+	LOAD_KEEP_VERTICES = 2,	/* keep mesh->vertices, for collision or picking */
+	LOAD_LODS = 4,		/* simplify meshes into coarser levels of detail */
+};
+
+#define MAX_LODS 4
+
+/*
+ * a level of detail, a range of the mesh's indices over the same vertices.
+ * error is how far its surface may be from the full detail one, in model
+ * units, 0 for the first level.
+ */
+struct lod {
+	GLuint offset;		/* from the mesh's first index */
+	GLuint n_indices;
+	float error;
+};
+
 struct mesh {
-	struct vertex *vertices;
+	struct vertex *vertices;	/* NULL unless loaded with LOAD_KEEP_VERTICES */
 	size_t n_vertices;
-	size_t n_indices;
-	GLuint VAO;
-	GLuint VBO;
-	GLuint EBO;
+	size_t n_indices;		/* of every level */
+	GLint base_vertex;
+	GLuint first_index;		/* in the index buffer of its index type */
+	int format;
+	int index_type;
+	vec3 min, max;
+	vec3 center;
+	float radius;
 	GLuint diffuse;
+	uint64_t diffuse_key;	/* in the resource cache, 0 for none */
 	GLuint specular;
-	GLenum index_type;
+	GLuint sampler;
 	int culling;
+	int alpha_mode;
+	struct lod lods[MAX_LODS];	/* from full detail to coarsest */
+	int n_lods;
 };
 
 struct model {
 	struct mesh *meshes;
 	size_t n_meshes;
+	int ready;	/* every mesh is uploaded and can be drawn */
+	uint64_t key;	/* in the resource cache */
+};
+
+/* a mesh decoded on the CPU, waiting for its GL upload */
+struct staged_mesh {
+	void *vertices;		/* in the mesh's vertex format */
+	void *indices;		/* of every level, one after the other, in the mesh's index type */
+	int in_staging;		/* both are in the staging ring, not allocated */
+	size_t staging_offset;	/* of the vertices there, the indices follow */
+	uint64_t texture_key;	/* of the diffuse texture, 0 for none */
+	GLuint texture;		/* already cached, nothing to upload */
+	struct image image;	/* to upload, pixels are NULL when cached or shared */
+	GLint min_filter, mag_filter, wrap_s, wrap_t;
+};
+
+struct staged_model {
+	struct model model;
+	struct staged_mesh *meshes;
+	size_t n_uploaded;
+	void *map;		/* of a cooked pack the staged meshes point into */
+	size_t map_size;
+};
+
+/* unused ranges of a shared buffer below its end, sorted and never adjacent */
+struct free_ranges {
+	struct {
+		size_t start, n;
+	} *ranges;
+	size_t n_ranges, capacity;
+	size_t n_free;		/* in every range */
+};
+
+/*
+ * vertex buffer shared by every loaded mesh of a vertex format, with an
+ * index buffer, and a VAO drawing from both, for every index type. the
+ * ranges of evicted meshes are reused before the buffers grow.
+ */
+struct geometry {
+	GLuint VAO[INDEX_TYPES];
+	GLuint VBO;
+	GLuint EBO[INDEX_TYPES];
+	size_t n_vertices, vertices_capacity;
+	size_t n_indices[INDEX_TYPES], indices_capacity[INDEX_TYPES];
+	struct free_ranges free_vertices, free_indices[INDEX_TYPES];
 };
 
-struct model load_model(const char *path);
+extern struct geometry geometry[VERTEX_FORMATS];
+extern const size_t vertex_sizes[VERTEX_FORMATS];
+extern const size_t index_sizes[INDEX_TYPES];
+extern const GLenum index_gl_types[INDEX_TYPES];
+
+void geometry_alloc(int format, int index_type, size_t n_vertices, size_t n_indices,
+		GLint *base_vertex, GLuint *first_index);
+
+void geometry_free(const struct mesh *mesh);
+
+size_t geometry_bytes(size_t *capacity);
+
+int stage_texture(struct staged_model *staged, size_t mesh, uint64_t key);
+
+void stage_model(struct staged_model *staged, const char *path, int flags);
+
+size_t upload_staged_mesh(struct staged_model *staged);
+
+uint64_t model_key(const char *path, int flags);
 
-void render_model(const struct model model, const GLuint shader_program, mat4 model_matrix);
+struct model load_model(const char *path, int flags);
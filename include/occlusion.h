@@ -0,0 +1,36 @@
+/* See LICENSE for license details. */
+
+/* std430 layout of a box in shaders/occlusion.cs.glsl */
+struct occlusion_box {
+	vec3 center;
+	GLuint command;		/* the indirect command drawing the instance */
+	vec3 extent;
+	float pad;
+};
+
+/*
+ * GPU occlusion culling against a depth pyramid (Hi-Z) of the last frame.
+ * the instances that pass frustum culling on the CPU are tested again in a
+ * compute shader, which writes the survivors and their commands to buffers
+ * drawn from as is.
+ */
+struct occlusion {
+	struct program first_level, reduce, cull;
+	GLuint depth;			/* copy of the depth buffer */
+	GLuint pyramid;			/* R32F, farthest depth of every texel */
+	int width, height, levels;
+	mat4 view_projection;		/* of the frame the pyramid was built from */
+	int ready;			/* a pyramid was built */
+	GLuint boxes, instances, commands, counters;
+	size_t boxes_size, instances_size, commands_size, counters_size;
+};
+
+void create_occlusion(struct occlusion *occlusion);
+
+void build_depth_pyramid(struct occlusion *occlusion);
+
+void cull_occluded(struct occlusion *occlusion, GLuint instances,
+		const struct occlusion_box *boxes, size_t n_instances,
+		struct draw_command *commands, size_t n_commands);
+
+unsigned int read_occluded(const struct occlusion *occlusion);
@@ -0,0 +1,16 @@
+/* See LICENSE for license details. */
+
+/* entries of the FIFO post-transform cache ACMR and ATVR are measured with */
+#define MEASURED_CACHE 16
+
+size_t cache_misses(const GLuint *indices, size_t n_indices, size_t n_vertices);
+
+void optimize_vertex_cache(GLuint *indices, size_t n_indices, size_t n_vertices);
+
+void optimize_overdraw(GLuint *indices, size_t n_indices,
+		const void *positions, size_t stride, size_t n_vertices);
+
+size_t optimize_vertex_fetch(GLuint *remap, GLuint *indices, size_t n_indices, size_t n_vertices);
+
+void remap_vertices(void *dst, const void *src, size_t n_vertices, size_t vertex_size,
+		const GLuint *remap);
@@ -0,0 +1,60 @@
+/* See LICENSE for license details. */
+
+/*
+ * cooked model pack, written by cook and mapped as is by the engine:
+ *
+ *   header | mesh table | texture table | blobs
+ *
+ * every blob (vertices, indices, texture mip chains) starts on a
+ * PACK_ALIGN boundary. offsets are from the start of the file and
+ * everything is little endian.
+ */
+#define PACK_MAGIC "UEPACK\r\n"
+#define PACK_VERSION 4
+#define PACK_ALIGN 64
+#define PACK_EXTENSION ".pack"
+
+struct pack_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_meshes;
+	uint32_t n_textures;
+	uint32_t pad;
+	uint64_t meshes;	/* offset of the mesh table */
+	uint64_t textures;	/* offset of the texture table */
+	uint64_t size;		/* of the whole file */
+};
+
+struct pack_mesh {
+	uint64_t vertices;	/* in format, n_vertices * vertex_sizes[format] bytes */
+	uint64_t indices;	/* in index_type, every level of detail */
+	uint32_t n_vertices;
+	uint32_t n_indices;
+	int32_t format;
+	int32_t index_type;
+	int32_t texture;	/* in the texture table, -1 for none */
+	int32_t culling;
+	int32_t min_filter, mag_filter, wrap_s, wrap_t;
+	float min[3], max[3], center[3];
+	float radius;
+	int32_t alpha_mode;
+	uint32_t n_lods;
+	uint32_t lod_offsets[MAX_LODS];	/* in indices, from the first one */
+	uint32_t lod_indices[MAX_LODS];
+	float lod_errors[MAX_LODS];
+};
+
+struct pack_texture {
+	uint32_t format;	/* compressed GL format */
+	int32_t width, height;
+	int32_t levels;
+	uint64_t data;		/* the mip chain */
+	uint64_t size;
+	uint64_t offsets[MAX_MIPS];	/* of every level in the chain */
+};
+
+int is_pack(const char *path);
+
+void stage_pack(struct staged_model *staged, const char *path);
+
+void unmap_pack(struct staged_model *staged);
@@ -0,0 +1,52 @@
+/* See LICENSE for license details. */
+
+/*
+ * frame profiler, built in with -DPROFILE (see the Makefile). CPU scopes
+ * are timed on whatever thread they run, GPU scopes with GL_TIME_ELAPSED
+ * queries read back PROFILE_LATENCY frames later, so nothing waits on the
+ * GPU. every scope lands in a ring buffer exported as a Chrome trace, and
+ * its last PROFILE_SAMPLES durations are summarized as percentiles.
+ * without PROFILE the macros expand to nothing.
+ *
+ * scopes are named by an identifier, unique in the block they are in.
+ * GPU scopes can't nest, only one GL_TIME_ELAPSED query runs at a time.
+ */
+#define PROFILE_EVENTS 65536
+#define PROFILE_SAMPLES 256
+#define PROFILE_LATENCY 4
+#define PROFILE_GPU_SCOPES 16	/* per frame */
+#define PROFILE_SCOPES 64	/* distinct names */
+#define PROFILE_THREADS 8
+#define PROFILE_TRACE "trace.json"
+
+#ifdef PROFILE
+#define PROFILE_BEGIN(name) double profile_##name = profile_time()
+#define PROFILE_END(name) profile_cpu(#name, profile_##name)
+#define GPU_PROFILE_BEGIN(name) gpu_profile_begin(#name)
+#define GPU_PROFILE_END(name) gpu_profile_end()
+#define PROFILE_FRAME() profile_frame()
+#define PROFILE_PRINT() print_profile()
+#define PROFILE_EXPORT(path) export_trace(path)
+#else
+#define PROFILE_BEGIN(name)
+#define PROFILE_END(name)
+#define GPU_PROFILE_BEGIN(name)
+#define GPU_PROFILE_END(name)
+#define PROFILE_FRAME()
+#define PROFILE_PRINT()
+#define PROFILE_EXPORT(path)
+#endif
+
+double profile_time(void);
+
+void profile_cpu(const char *name, double start);
+
+void gpu_profile_begin(const char *name);
+
+void gpu_profile_end(void);
+
+void profile_frame(void);
+
+void print_profile(void);
+
+void export_trace(const char *path);
@@ -0,0 +1,130 @@
+/* See LICENSE for license details. */
+
+/*
+ * per-instance attribute locations, the model matrix takes four of them and
+ * the normal matrix three. they are fed from their own buffer binding.
+ */
+#define INSTANCE_MODEL 4
+#define INSTANCE_NORMAL 8
+
+/* vertex buffer bindings of the shared VAO */
+#define VERTEX_BINDING 0
+#define INSTANCE_BINDING 1
+
+struct instance {
+	mat4 model;
+	vec4 normal[3];
+};
+
+/* layout glMultiDrawElementsIndirect expects */
+struct draw_command {
+	GLuint count;
+	GLuint instance_count;
+	GLuint first_index;
+	GLint base_vertex;
+	GLuint base_instance;
+};
+
+/* consecutive commands sharing the same state, drawn with one call */
+struct batch {
+	const struct draw *draw;
+	size_t first_command;
+	size_t n_commands;
+};
+
+struct draw {
+	uint64_t key;
+	const struct program *program;
+	const struct mesh *mesh;
+	int lod;
+	size_t instance;
+	GLuint n_instances;
+	GLuint n_visible;
+	GLuint base_instance;
+	size_t command;		/* drawing it, once build_commands ran */
+	int in_frustum;		/* the scene BVH already culled its instances */
+};
+
+struct render_stats {
+	unsigned int draws;
+	unsigned int depth_draws;
+	unsigned int commands;
+	unsigned int instances;
+	unsigned int visible;
+	unsigned int culled;
+	unsigned int occluded;		/* only counted when stats are printed */
+	unsigned int triangles;		/* of the frustum visible instances */
+	unsigned int full_triangles;	/* they would have without levels of detail */
+	unsigned int format_switches;
+	unsigned int program_switches;
+	unsigned int texture_switches;
+	unsigned int sampler_switches;
+	unsigned int cull_switches;
+};
+
+struct scene_object {
+	const struct mesh *mesh;
+	const struct program *program;
+	mat4 model_matrix;
+};
+
+/* meshes that don't move, culled through a BVH before reaching the queue */
+struct scene {
+	struct scene_object *objects;
+	size_t n_objects, capacity;
+	struct bvh bvh;
+	unsigned int *visible;
+	unsigned char *lods;	/* the level every object was last drawn at */
+};
+
+struct render_queue {
+	struct draw *draws;
+	size_t n_draws;
+	size_t capacity;
+	struct instance *instances;
+	size_t n_instances;
+	size_t instances_capacity;
+	struct draw_command *commands;
+	size_t commands_capacity;
+	struct batch *batches;
+	size_t batches_capacity;
+	struct boxes boxes;
+	unsigned char *visible;
+	size_t scene_culled;	/* objects the scene BVH culled before they were queued */
+	size_t visible_capacity;
+	/* the visible instances in sorted order, as uploaded */
+	struct instance *uploads;
+	size_t uploads_capacity;
+	GLuint instance_buffer;
+	size_t instance_buffer_size;
+	GLuint command_buffer;
+	size_t command_buffer_size;
+	/* draws the depth pre-pass, none is done while it is NULL */
+	const struct program *depth_program;
+	/* culls what passed the frustum test on the GPU too, unless it is NULL */
+	struct occlusion *occlusion;
+	struct occlusion_box *occlusion_boxes;
+	size_t occlusion_boxes_capacity;
+	struct render_stats stats;
+};
+
+void setup_instance_attributes(void);
+
+void stream_buffer(GLenum target, GLuint *buffer, size_t *buffer_size, const void *data, size_t size);
+
+void queue_model(struct render_queue *queue, const struct model *model,
+		const struct program *program, mat4 model_matrix, unsigned char *lods);
+
+void queue_model_instances(struct render_queue *queue, const struct model *model,
+		const struct program *program, mat4 *model_matrices, unsigned char *lods, size_t n);
+
+void queue_scene(struct render_queue *queue, const struct scene *scene);
+
+void flush_render_queue(struct render_queue *queue);
+
+void add_static_model(struct scene *scene, const struct model *model,
+		const struct program *program, mat4 model_matrix);
+
+void build_scene(struct scene *scene);
+
+void print_render_stats(const struct render_stats stats);
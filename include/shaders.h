@@ -0,0 +1,94 @@
+/* See LICENSE for license details. */
+
+/* linked programs are cached here, by a hash of their sources and the driver */
+#define PROGRAM_CACHE "shaders/cache"
+#define PROGRAM_MAGIC 0x42504555	/* "UEPB" in little endian */
+/* shaders a program is built from at most */
+#define MAX_STAGES 2
+/* how deep #include "file" lines may nest */
+#define INCLUDE_DEPTH 8
+
+/* uniforms resolved once per program, see uniform_names in shaders.c */
+enum {
+	U_MATERIAL_DIFFUSE,
+	U_MATERIAL_SPECULAR,
+	U_MATERIAL_SHININESS,
+	U_VIEW_PROJECTION,
+	U_COUNT,
+	UNIFORMS
+};
+
+/* uniform block binding points, hardcoded with layout (binding = n) in the shaders */
+enum {
+	CAMERA_BLOCK,
+	LIGHTS_BLOCK,
+};
+
+/* shader storage binding points, hardcoded the same way */
+enum {
+	POS_LIGHTS_BUFFER,
+	CLUSTERS_BUFFER,
+	LIGHT_INDICES_BUFFER,
+	OCCLUSION_BOXES_BUFFER,
+	INSTANCES_BUFFER,
+	CULLED_INSTANCES_BUFFER,
+	CULLED_COMMANDS_BUFFER,
+	OCCLUSION_COUNTERS_BUFFER,
+};
+
+struct program {
+	GLuint ID;
+	GLint uniforms[UNIFORMS];
+	int finished;		/* see finish_program */
+	uint64_t key;		/* in the cache */
+	/* variant drawing ALPHA_MASK meshes, the program itself when NULL */
+	const struct program *alpha_tested;
+};
+
+/* std140 layouts of the camera and lights blocks, std430 of the point lights */
+struct camera_block {
+	mat4 view;
+	mat4 projection;
+	vec4 pos;
+};
+
+struct dir_light_block {
+	vec4 dir;
+	vec4 ambient;
+	vec4 diffuse;
+	vec4 specular;
+};
+
+struct pos_light_block {
+	vec4 pos;		/* w is the radius it is binned with */
+	vec4 ambient;
+	vec4 diffuse;
+	vec3 specular;
+	float linear;
+	float quadratic;
+	float pad[3];
+};
+
+struct lights_block {
+	struct dir_light_block dir_light;
+	vec4 cluster_depth;	/* scale and bias from log depth to slice */
+};
+
+struct uniform_buffers {
+	GLuint camera;
+	GLuint lights;
+};
+
+const GLuint create_shader(const char *path, const GLenum type, const char *defines);
+
+struct program create_shader_program(const GLuint vs, const GLuint fs);
+
+struct program load_program(const char *vs_path, const char *fs_path, const char *defines);
+
+struct program load_compute_program(const char *path, const char *defines);
+
+void finish_program(struct program *program);
+
+struct uniform_buffers create_uniform_buffers(void);
+
+void update_uniform_buffers(const struct uniform_buffers ubos);
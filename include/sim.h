@@ -0,0 +1,52 @@
+/* See LICENSE for license details. */
+
+/* simulation ticks a second, rendering interpolates between them */
+#define SIM_RATE 120
+#define SIM_STEP (1.0 / SIM_RATE)
+/* further behind than this, the simulation skips ticks to catch up */
+#define SIM_MAX_LAG 0.25
+
+struct camera_state {
+	vec3 pos;
+	float yaw, pitch;
+};
+
+/* the last two ticks, rendering shows the time between them */
+struct snapshot {
+	struct camera_state previous, current;
+	double time;		/* of the current tick, zero before the first */
+};
+
+/*
+ * runs the simulation on its own thread at a fixed step. ticks hand their
+ * snapshots to rendering through a triple buffer: the thread fills the
+ * back one and swaps it with the middle, rendering swaps the middle with
+ * the front one when it's newer. the lock only covers those swaps and the
+ * input, so neither side ever waits on the other's work.
+ */
+struct sim {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct snapshot snapshots[3];
+	int back, middle, front;
+	int fresh;		/* the middle is newer than the front */
+	/* gathered by the callbacks until the next tick */
+	int keys;
+	float look_x, look_y;	/* mouse movement in pixels */
+	int stop;
+	struct camera_state state;	/* owned by the thread */
+	float speed, sensitivity;	/* copied from the camera */
+	vec3 up;
+};
+
+extern struct sim sim;
+
+void start_sim(const struct camera *cam);
+
+void press_keys(int keys, int down);
+
+void look(float x, float y);
+
+void interpolate_camera(struct camera *cam, double time);
+
+void stop_sim(void);
@@ -0,0 +1,5 @@
+/* See LICENSE for license details. */
+
+size_t simplify(GLuint *dst, const GLuint *indices, size_t n_indices,
+		const void *positions, size_t stride, size_t n_vertices,
+		size_t target, float *error);
@@ -0,0 +1,38 @@
+/* See LICENSE for license details. */
+
+/* room loader threads stage meshes in, for the GL thread to copy to the shared buffers */
+#define STAGING_SIZE (64 << 20)
+#define STAGING_CHUNKS 1024
+#define STAGING_ALIGN 16
+
+/* a mesh's room in the ring, free again once the GPU finished copying it */
+struct staging_chunk {
+	size_t offset, size;	/* size counts the padding skipped before it */
+	GLsync fence;		/* NULL until the copy is issued */
+	int copied;
+};
+
+/*
+ * persistently mapped buffer the loader threads write meshes into, in the
+ * order they allocate them. chunks are freed in that order too, as their
+ * copies complete, so head and tail only grow; modulo STAGING_SIZE they
+ * are offsets in the buffer.
+ */
+struct staging {
+	GLuint buffer;
+	unsigned char *mapped;
+	pthread_mutex_t lock;
+	size_t head, tail;
+	struct staging_chunk chunks[STAGING_CHUNKS];
+	size_t first, n_chunks;
+};
+
+extern struct staging staging;
+
+void create_staging(void);
+
+void *staging_alloc(size_t size, size_t *offset);
+
+void staging_copied(size_t offset);
+
+void reclaim_staging(void);
@@ -0,0 +1,34 @@
+/* See LICENSE for license details. */
+
+/* the PBO ring, each segment holds at most a frame's worth of uploads */
+#define STREAM_SEGMENTS 3
+#define STREAM_SEGMENT_SIZE (8 << 20)
+/* levels up to this size are uploaded when the texture is created */
+#define STREAM_IMMEDIATE (64 * 64 * 4)
+
+/* a texture whose levels are still being uploaded, smallest first */
+struct texture_stream {
+	GLuint texture;
+	struct image image;
+	int level;	/* next level to upload */
+	int row;	/* rows of that level already uploaded */
+};
+
+struct streamer {
+	GLuint buffer;
+	unsigned char *mapped;		/* persistent mapping of the whole ring */
+	GLsync fences[STREAM_SEGMENTS];
+	int segment;
+	struct texture_stream *streams;
+	size_t n_streams, capacity;
+};
+
+extern struct streamer streamer;
+
+GLuint stream_texture(struct image *image);
+
+GLuint upload_texture(const struct image *image);
+
+void cancel_stream(GLuint texture);
+
+size_t update_streamer(size_t budget);
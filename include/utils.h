@@ -1,6 +1,12 @@
 /* See LICENSE for license details. */
 
 #define PI 3.14159265358979323846
+#define NEAR_PLANE 0.05f
+#define FAR_PLANE 128.0f
+#define MAX_MIPS 16
+
+/* size of a mip level along an axis */
+#define mip_size(size, level) ((size) >> (level) > 0 ? (size) >> (level) : 1)
 
 enum {
 	LEFT = 1,
@@ -40,8 +46,20 @@ struct camera {
 
 struct state {
 	struct camera cam;
-	int input;
-	float delta_time, last_frame;
+	int print_stats;
+	int depth_prepass;
+	int occlusion_culling;
+	int viewport_height;	/* kept by whoever sets the viewport */
+};
+
+/* image with its whole mip chain in one allocation */
+struct image {
+	unsigned char *pixels;
+	GLenum format;		/* GL_RGBA8 or a compressed format */
+	int width, height;
+	int levels;
+	size_t offsets[MAX_MIPS];
+	size_t size;		/* of the whole chain */
 };
 
 struct skybox {
@@ -50,24 +68,27 @@ struct skybox {
 };
 
 extern struct dir_light dir_light;
-extern struct pos_light pos_lights[];
 extern struct state game;
 
-GLFWwindow *initialize(void);
+GLFWwindow *initialize(int headless);
 
 GLchar *read_file(const char *path);
 
-const GLuint create_shader(const char *path, const GLenum type);
+const void *map_file(const char *path, size_t *size);
+
+void unmap_file(const void *map, size_t size);
 
-const GLuint create_shader_program(const GLuint vs, const GLuint fs);
+int load_image(const char *path, struct image *image);
+
+int load_image_from_memory(const unsigned char *buffer, size_t size, struct image *image);
 
 const GLuint create_texture(const char *path);
 
 const GLuint create_texture_from_memory(const unsigned char *buffer, size_t size);
 
-const GLuint create_cubemap(const char *paths[6]);
+const GLuint create_sampler(GLint min_filter, GLint mag_filter, GLint wrap_s, GLint wrap_t);
 
-void move_camera(void);
+const GLuint create_cubemap(const char *paths[6]);
 
 void errlog(const char *format, ...);
 
@@ -83,4 +104,4 @@ void frame_buffer_size_callback(GLFWwindow *window, int width, int height);
 
 struct skybox create_skybox(const char *paths[6]);
 
-void render_skybox(const struct skybox skybox, const GLuint shader_program);
+void render_skybox(const struct skybox skybox, const struct program program);
@@ -0,0 +1,6 @@
+/* must match struct camera_block in include/shaders.h */
+layout (std140, binding = 0) uniform camera {
+	mat4 u_view;
+	mat4 u_projection;
+	vec3 u_camera_position;
+};
@@ -0,0 +1,24 @@
+#version 460 core
+
+#ifdef ALPHA_TEST
+/* must match ALPHA_CUTOFF in shaders/entity.fs.glsl */
+#define ALPHA_CUTOFF 0.8f
+
+in vec2 f_texcoord;
+
+struct material {
+	sampler2D diffuse;
+};
+
+uniform material u_material;
+#endif
+
+void
+main()
+{
+#ifdef ALPHA_TEST
+	if (texture(u_material.diffuse, f_texcoord).a < ALPHA_CUTOFF) {
+		discard;
+	}
+#endif
+}
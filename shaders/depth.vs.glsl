@@ -0,0 +1,25 @@
+#version 460 core
+
+layout (location = 0) in vec3 position;
+layout (location = 2) in vec2 texcoord;
+layout (location = 4) in mat4 i_model;
+
+#include "camera.glsl"
+
+#ifdef ALPHA_TEST
+out vec2 f_texcoord;
+#endif
+
+/* computed exactly like the shading passes, which test depth with GL_EQUAL */
+invariant gl_Position;
+
+void
+main()
+{
+#ifdef ALPHA_TEST
+	f_texcoord = texcoord;
+#endif
+
+	vec4 world_position = i_model * vec4(position, 1.0f);
+	gl_Position = u_projection * (u_view * world_position);
+}
@@ -5,7 +5,10 @@ in vec3 f_fragment_position;
 in vec2 f_texcoord;
 in vec4 f_color;
 
-uniform vec3 u_camera_position;
+#include "camera.glsl"
+
+/* must match ALPHA_CUTOFF in shaders/depth.fs.glsl */
+#define ALPHA_CUTOFF 0.8f
 
 struct material {
 	sampler2D diffuse;
@@ -23,10 +26,8 @@ struct dir_light {
 	vec3 specular;
 };
 
-uniform dir_light u_dir_light;
-
 struct pos_light {
-	vec3 position;
+	vec4 position;	/* w is the radius it reaches */
 
 	vec3 ambient;
 	vec3 diffuse;
@@ -36,32 +37,73 @@ struct pos_light {
 	float quadratic;
 };
 
-#define POS_LIGHTS 4
-uniform pos_light u_pos_lights[POS_LIGHTS];
+/* must match the CLUSTERS_* in include/lights.h */
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+
+layout (std140, binding = 1) uniform lights {
+	dir_light u_dir_light;
+	vec4 u_cluster_depth;	/* scale and bias from log depth to slice */
+};
+
+layout (std430, binding = 0) readonly buffer pos_lights {
+	pos_light u_pos_lights[];
+};
+
+/* offset into u_light_indices and light count of each cluster */
+layout (std430, binding = 1) readonly buffer clusters {
+	uvec2 u_clusters[];
+};
+
+layout (std430, binding = 2) readonly buffer light_indices {
+	uint u_light_indices[];
+};
 
 out vec4 frag_color;
 
 vec4 dir_light_contrib(vec4 diffuse_tex, vec4 specular_tex, vec3 normal, vec3 view_dir);
 vec4 pos_light_contrib(vec4 diffuse_tex, vec4 specular_tex, vec3 normal, vec3 view_dir, pos_light u_pos_light);
+uint cluster();
 
 void
 main()
 {
 	vec4 diffuse_tex = texture(u_material.diffuse, f_texcoord);
-	if (diffuse_tex.a < 0.8f) {
+#ifdef ALPHA_TEST
+	/* a discard anywhere in the shader turns early depth testing off */
+	if (diffuse_tex.a < ALPHA_CUTOFF) {
 		discard;
 	}
+#endif
 	vec4 specular_tex = texture(u_material.specular, f_texcoord);
 	vec3 normal = normalize(f_normal);
 	vec3 view_dir = normalize(u_camera_position - f_fragment_position);
 
 	frag_color = vec4(0.0f);
 	frag_color += dir_light_contrib(diffuse_tex, specular_tex, normal, view_dir);
-	for (int i = 0; i < POS_LIGHTS; i++) {
-		frag_color += pos_light_contrib(diffuse_tex, specular_tex, normal, view_dir, u_pos_lights[i]);
+
+	uvec2 range = u_clusters[cluster()];
+	for (uint i = range.x; i < range.x + range.y; i++) {
+		pos_light light = u_pos_lights[u_light_indices[i]];
+		frag_color += pos_light_contrib(diffuse_tex, specular_tex, normal, view_dir, light);
 	}
 }
 
+/* the screen tile and exponential depth slice of the fragment, binned the same way on the CPU */
+uint
+cluster()
+{
+	vec4 view_position = u_view * vec4(f_fragment_position, 1.0f);
+	vec4 clip_position = u_projection * view_position;
+	vec2 tile = (clip_position.xy / clip_position.w * 0.5f + 0.5f) * vec2(CLUSTERS_X, CLUSTERS_Y);
+	float slice = log(-view_position.z) * u_cluster_depth.x + u_cluster_depth.y;
+
+	uvec3 id = uvec3(clamp(ivec3(floor(vec3(tile, slice))), ivec3(0),
+		ivec3(CLUSTERS_X - 1, CLUSTERS_Y - 1, CLUSTERS_Z - 1)));
+	return (id.z * CLUSTERS_Y + id.y) * CLUSTERS_X + id.x;
+}
+
 vec4
 dir_light_contrib(vec4 diffuse_tex, vec4 specular_tex, vec3 normal, vec3 view_dir)
 {
@@ -88,7 +130,7 @@ pos_light_contrib(vec4 diffuse_tex, vec4 specular_tex, vec3 normal, vec3 view_di
 	vec4 ambient = diffuse_tex * vec4(u_pos_light.ambient, 1.0f);
 
 	/* diffuse */
-	vec3 light_direction = normalize(u_pos_light.position - f_fragment_position);
+	vec3 light_direction = normalize(u_pos_light.position.xyz - f_fragment_position);
 	float diff = max(dot(normal, light_direction), 0.0f);
 	vec4 diffuse = diff * diffuse_tex * vec4(u_pos_light.diffuse, 1.0f);
 	
@@ -98,7 +140,7 @@ pos_light_contrib(vec4 diffuse_tex, vec4 specular_tex, vec3 normal, vec3 view_di
 	vec4 specular = spec * specular_tex * vec4(u_pos_light.specular, 1.0f);
 
 	/* distance attenuation */
-	float dist = length(u_pos_light.position - f_fragment_position);
+	float dist = length(u_pos_light.position.xyz - f_fragment_position);
 	float attenuation = 1.0f / (1.0f + u_pos_light.linear * dist + u_pos_light.quadratic * dist * dist);
 	ambient *= attenuation;
 	diffuse *= attenuation;
@@ -4,23 +4,27 @@ layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 layout (location = 2) in vec2 texcoord;
 layout (location = 3) in vec4 color;
+layout (location = 4) in mat4 i_model;
+layout (location = 8) in mat3 i_normal;
 
-uniform mat4 u_model;
-uniform mat3 u_normal;
-uniform mat4 u_transformation;
+#include "camera.glsl"
 
 out vec3 f_fragment_position;
 out vec3 f_normal;
 out vec2 f_texcoord;
 out vec4 f_color;
 
+/* the depth pre-pass computes it the same way, for the GL_EQUAL depth test */
+invariant gl_Position;
+
 void
 main()
 {
-	f_fragment_position = vec3(u_model * vec4(position, 1.0f));
-	f_normal = u_normal * normal;
+	vec4 world_position = i_model * vec4(position, 1.0f);
+	f_fragment_position = vec3(world_position);
+	f_normal = i_normal * normal;
 	f_texcoord = texcoord;
 	f_color = color;
 
-	gl_Position = u_transformation * vec4(position, 1.0f);
+	gl_Position = u_projection * (u_view * world_position);
 }
@@ -0,0 +1,44 @@
+#version 460 core
+
+/*
+ * builds a level of the depth pyramid, every texel holding the farthest
+ * depth under it. the first level is a copy of the depth buffer.
+ */
+layout (local_size_x = 8, local_size_y = 8) in;
+
+#ifdef FIRST_LEVEL
+uniform sampler2D u_depth;
+#else
+layout (r32f, binding = 0) readonly uniform image2D u_source;
+#endif
+layout (r32f, binding = 1) writeonly uniform image2D u_destination;
+
+void
+main()
+{
+	ivec2 size = imageSize(u_destination);
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(texel, size))) {
+		return;
+	}
+
+#ifdef FIRST_LEVEL
+	imageStore(u_destination, texel, vec4(texelFetch(u_depth, texel, 0).r));
+#else
+	/* the last texel of an odd row or column takes the one left over too */
+	ivec2 source_size = imageSize(u_source);
+	ivec2 last = ivec2(
+		texel.x == size.x - 1 && (source_size.x & 1) != 0 ? 2 : 1,
+		texel.y == size.y - 1 && (source_size.y & 1) != 0 ? 2 : 1
+	);
+
+	float depth = 0.0f;
+	for (int y = 0; y <= last.y; y++) {
+		for (int x = 0; x <= last.x; x++) {
+			ivec2 source = min(texel * 2 + ivec2(x, y), source_size - 1);
+			depth = max(depth, imageLoad(u_source, source).r);
+		}
+	}
+	imageStore(u_destination, texel, vec4(depth));
+#endif
+}
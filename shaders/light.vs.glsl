@@ -1,11 +1,16 @@
 #version 460 core
 
 layout (location = 0) in vec3 position;
+layout (location = 4) in mat4 i_model;
 
-uniform mat4 u_transformation;
+#include "camera.glsl"
+
+/* the depth pre-pass computes it the same way, for the GL_EQUAL depth test */
+invariant gl_Position;
 
 void
 main()
 {
-	gl_Position = u_transformation * vec4(position, 1.0f);
+	vec4 world_position = i_model * vec4(position, 1.0f);
+	gl_Position = u_projection * (u_view * world_position);
 }
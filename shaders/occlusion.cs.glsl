@@ -0,0 +1,123 @@
+#version 460 core
+
+/*
+ * tests the world box of every instance that passed frustum culling
+ * against the depth pyramid of the last frame, and copies the ones that
+ * may be visible to the front of their command's range, counting them.
+ */
+layout (local_size_x = 64) in;
+
+/* must match struct occlusion_box in include/occlusion.h */
+struct box {
+	vec3 center;
+	uint command;
+	vec3 extent;
+	float pad;
+};
+
+/* must match struct instance in include/render.h */
+struct instance {
+	mat4 model;
+	vec4 normal[3];
+};
+
+/* must match struct draw_command in include/render.h */
+struct draw_command {
+	uint count;
+	uint instance_count;
+	uint first_index;
+	int base_vertex;
+	uint base_instance;
+};
+
+layout (std430, binding = 3) readonly buffer boxes {
+	box u_boxes[];
+};
+
+layout (std430, binding = 4) readonly buffer instances {
+	instance u_instances[];
+};
+
+layout (std430, binding = 5) writeonly buffer culled_instances {
+	instance u_culled_instances[];
+};
+
+/* instance counts start at 0 */
+layout (std430, binding = 6) buffer culled_commands {
+	draw_command u_commands[];
+};
+
+layout (std430, binding = 7) buffer counters {
+	uint u_occluded;
+};
+
+/* of the frame the pyramid was built from */
+uniform mat4 u_view_projection;
+uniform sampler2D u_hiz;
+uniform uint u_count;
+
+bool
+occluded(box b)
+{
+	vec2 min_uv = vec2(1.0f), max_uv = vec2(0.0f);
+	float nearest = 1.0f;
+
+	for (int i = 0; i < 8; i++) {
+		vec3 corner = b.center + b.extent * vec3(
+			(i & 1) != 0 ? 1.0f : -1.0f,
+			(i & 2) != 0 ? 1.0f : -1.0f,
+			(i & 4) != 0 ? 1.0f : -1.0f
+		);
+		vec4 clip = u_view_projection * vec4(corner, 1.0f);
+		/* reaching behind the camera, it could cover anything */
+		if (clip.w <= 0.0f) {
+			return false;
+		}
+		vec3 ndc = clip.xyz / clip.w;
+		min_uv = min(min_uv, ndc.xy * 0.5f + 0.5f);
+		max_uv = max(max_uv, ndc.xy * 0.5f + 0.5f);
+		nearest = min(nearest, ndc.z * 0.5f + 0.5f);
+	}
+
+	/* off the last frame's screen, nothing is known about it */
+	if (any(lessThan(max_uv, vec2(0.0f))) || any(greaterThan(min_uv, vec2(1.0f)))) {
+		return false;
+	}
+
+	/* the level where the box spans at most 2 by 2 texels */
+	ivec2 size = textureSize(u_hiz, 0);
+	vec2 min_texel = clamp(min_uv, 0.0f, 1.0f) * vec2(size);
+	vec2 max_texel = clamp(max_uv, 0.0f, 1.0f) * vec2(size);
+	vec2 extent = max_texel - min_texel;
+	int level = int(ceil(log2(max(max(extent.x, extent.y), 1.0f))));
+	level = min(level, textureQueryLevels(u_hiz) - 1);
+
+	/* odd sizes fold their last texel into the one before, so clamp */
+	ivec2 level_size = textureSize(u_hiz, level);
+	ivec2 lo = min(ivec2(min_texel) >> level, level_size - 1);
+	ivec2 hi = min(ivec2(max_texel) >> level, level_size - 1);
+
+	float farthest = max(
+		max(texelFetch(u_hiz, lo, level).r, texelFetch(u_hiz, ivec2(hi.x, lo.y), level).r),
+		max(texelFetch(u_hiz, ivec2(lo.x, hi.y), level).r, texelFetch(u_hiz, hi, level).r)
+	);
+	return nearest > farthest;
+}
+
+void
+main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= u_count) {
+		return;
+	}
+
+	box b = u_boxes[i];
+	if (occluded(b)) {
+		atomicAdd(u_occluded, 1u);
+		return;
+	}
+
+	uint slot = atomicAdd(u_commands[b.command].instance_count, 1u);
+	u_culled_instances[u_commands[b.command].base_instance + slot] = u_instances[i];
+}
@@ -2,7 +2,7 @@
 
 layout (location = 0) in vec3 pos;
 
-uniform mat4 u_transformation;
+#include "camera.glsl"
 
 out vec3 f_texcoord;
 
@@ -10,6 +10,6 @@ void
 main()
 {
 	f_texcoord = pos;
-	gl_Position = u_transformation * vec4(pos, 1.0f);
+	gl_Position = u_projection * mat4(mat3(u_view)) * vec4(pos, 1.0f);
 	gl_Position = gl_Position.xyww;
 }
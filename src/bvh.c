@@ -0,0 +1,508 @@
+/* See LICENSE for license details. */
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "culling.h"
+#include "bvh.h"
+
+#define BVH_BINS 12
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_LEAF_SIZE 16
+#define BVH_STACK 64
+/*
+ * deeper nodes are split at their median, which adds at most 30 more
+ * levels for 2^32 primitives, so traversals stay within BVH_STACK.
+ */
+#define BVH_SAH_DEPTH 32
+
+static void *
+bvh_alloc(size_t n, size_t size)
+{
+	void *p = malloc(n * size);
+	if (p == NULL) {
+		errlog("couldn't allocate a BVH for %zu primitives.", n);
+		exit(1);
+	}
+	return p;
+}
+
+static float
+area(vec3 min, vec3 max)
+{
+	float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+	return x * y + y * z + z * x;
+}
+
+static void
+node_bounds(struct bvh *bvh, struct bvh_node *node)
+{
+	glm_vec3_copy((vec3) { FLT_MAX, FLT_MAX, FLT_MAX }, node->min);
+	glm_vec3_copy((vec3) { -FLT_MAX, -FLT_MAX, -FLT_MAX }, node->max);
+	for (unsigned int i = 0; i < node->count; i++) {
+		unsigned int p = bvh->indices[node->first + i];
+		glm_vec3_minv(node->min, bvh->mins[p], node->min);
+		glm_vec3_maxv(node->max, bvh->maxs[p], node->max);
+	}
+}
+
+/*
+ * picks the split plane of a node with the surface area heuristic over
+ * BVH_BINS bins per axis, returns its cost or FLT_MAX when the centroids
+ * can't be told apart.
+ */
+static float
+find_split(struct bvh *bvh, struct bvh_node *node, vec3 *centroids, int *axis, float *position)
+{
+	float best = FLT_MAX;
+
+	vec3 cmin = { FLT_MAX, FLT_MAX, FLT_MAX }, cmax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (unsigned int i = 0; i < node->count; i++) {
+		unsigned int p = bvh->indices[node->first + i];
+		glm_vec3_minv(cmin, centroids[p], cmin);
+		glm_vec3_maxv(cmax, centroids[p], cmax);
+	}
+
+	for (int a = 0; a < 3; a++) {
+		if (cmax[a] == cmin[a])
+			continue;
+
+		struct {
+			vec3 min, max;
+			unsigned int count;
+		} bins[BVH_BINS];
+		for (int b = 0; b < BVH_BINS; b++) {
+			glm_vec3_copy((vec3) { FLT_MAX, FLT_MAX, FLT_MAX }, bins[b].min);
+			glm_vec3_copy((vec3) { -FLT_MAX, -FLT_MAX, -FLT_MAX }, bins[b].max);
+			bins[b].count = 0;
+		}
+
+		float scale = BVH_BINS / (cmax[a] - cmin[a]);
+		for (unsigned int i = 0; i < node->count; i++) {
+			unsigned int p = bvh->indices[node->first + i];
+			int b = (centroids[p][a] - cmin[a]) * scale;
+			if (b > BVH_BINS - 1)
+				b = BVH_BINS - 1;
+			bins[b].count++;
+			glm_vec3_minv(bins[b].min, bvh->mins[p], bins[b].min);
+			glm_vec3_maxv(bins[b].max, bvh->maxs[p], bins[b].max);
+		}
+
+		/* sweep from both sides to get the cost of every split between bins */
+		float left_area[BVH_BINS - 1];
+		unsigned int left_count[BVH_BINS - 1];
+		vec3 min = { FLT_MAX, FLT_MAX, FLT_MAX }, max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		unsigned int count = 0;
+		for (int b = 0; b < BVH_BINS - 1; b++) {
+			count += bins[b].count;
+			glm_vec3_minv(min, bins[b].min, min);
+			glm_vec3_maxv(max, bins[b].max, max);
+			left_count[b] = count;
+			left_area[b] = count ? area(min, max) : 0.0f;
+		}
+
+		glm_vec3_copy((vec3) { FLT_MAX, FLT_MAX, FLT_MAX }, min);
+		glm_vec3_copy((vec3) { -FLT_MAX, -FLT_MAX, -FLT_MAX }, max);
+		count = 0;
+		for (int b = BVH_BINS - 1; b > 0; b--) {
+			count += bins[b].count;
+			glm_vec3_minv(min, bins[b].min, min);
+			glm_vec3_maxv(max, bins[b].max, max);
+
+			if (count == 0 || left_count[b - 1] == 0)
+				continue;
+
+			float cost = left_count[b - 1] * left_area[b - 1] + count * area(min, max);
+			if (cost < best) {
+				best = cost;
+				*axis = a;
+				*position = cmin[a] + b / scale;
+			}
+		}
+	}
+
+	return best;
+}
+
+/*
+ * moves the primitives of a node so the first half has the centroids
+ * lowest along the axis they spread the most on (Hoare's selection).
+ */
+static void
+select_median(struct bvh *bvh, struct bvh_node *node, vec3 *centroids)
+{
+	unsigned int *indices = bvh->indices + node->first;
+
+	vec3 cmin = { FLT_MAX, FLT_MAX, FLT_MAX }, cmax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (unsigned int i = 0; i < node->count; i++) {
+		glm_vec3_minv(cmin, centroids[indices[i]], cmin);
+		glm_vec3_maxv(cmax, centroids[indices[i]], cmax);
+	}
+	int axis = 0;
+	for (int a = 1; a < 3; a++) {
+		if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+			axis = a;
+	}
+
+	long lo = 0, hi = node->count - 1, k = node->count / 2;
+	while (lo < hi) {
+		float pivot = centroids[indices[(lo + hi) / 2]][axis];
+		long i = lo, j = hi;
+		while (i <= j) {
+			while (centroids[indices[i]][axis] < pivot)
+				i++;
+			while (centroids[indices[j]][axis] > pivot)
+				j--;
+			if (i <= j) {
+				unsigned int t = indices[i];
+				indices[i++] = indices[j];
+				indices[j--] = t;
+			}
+		}
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
+static void
+subdivide(struct bvh *bvh, unsigned int index, vec3 *centroids, int depth)
+{
+	struct bvh_node *node = &bvh->nodes[index];
+	node_bounds(bvh, node);
+
+	if (node->count <= BVH_LEAF_SIZE)
+		return;
+
+	unsigned int *indices = bvh->indices + node->first;
+	unsigned int mid;
+
+	int axis = 0;
+	float position = 0.0f;
+	float cost = depth < BVH_SAH_DEPTH ?
+		find_split(bvh, node, centroids, &axis, &position) : FLT_MAX;
+	float leaf_cost = node->count * area(node->min, node->max);
+
+	if (depth >= BVH_SAH_DEPTH) {
+		/* a skewed scene peeling off a few primitives a split got this deep */
+		select_median(bvh, node, centroids);
+		mid = node->count / 2;
+	}
+	else if (cost == FLT_MAX) {
+		/* every centroid is in the same spot, split the list in half */
+		if (node->count <= BVH_MAX_LEAF_SIZE)
+			return;
+		mid = node->count / 2;
+	}
+	else {
+		if (cost >= leaf_cost && node->count <= BVH_MAX_LEAF_SIZE)
+			return;
+
+		unsigned int i = 0, j = node->count;
+		while (i < j) {
+			if (centroids[indices[i]][axis] < position) {
+				i++;
+			}
+			else {
+				unsigned int t = indices[i];
+				indices[i] = indices[--j];
+				indices[j] = t;
+			}
+		}
+		mid = i;
+		if (mid == 0 || mid == node->count)
+			mid = node->count / 2;
+	}
+
+	unsigned int left = bvh->n_nodes;
+	bvh->n_nodes += 2;
+
+	bvh->nodes[left].first = node->first;
+	bvh->nodes[left].count = mid;
+	bvh->nodes[left + 1].first = node->first + mid;
+	bvh->nodes[left + 1].count = node->count - mid;
+	bvh->parents[left] = index;
+	bvh->parents[left + 1] = index;
+
+	node->first = left;
+	node->count = 0;
+
+	subdivide(bvh, left, centroids, depth + 1);
+	subdivide(bvh, left + 1, centroids, depth + 1);
+}
+
+/* builds a BVH over n world space boxes, copying them */
+void
+build_bvh(struct bvh *bvh, vec3 *mins, vec3 *maxs, size_t n)
+{
+	bvh->n_primitives = n;
+	bvh->n_nodes = 1;
+
+	size_t max_nodes = n > 0 ? 2 * n - 1 : 1;
+	bvh->nodes = bvh_alloc(max_nodes, sizeof(struct bvh_node));
+	bvh->parents = bvh_alloc(max_nodes, sizeof(unsigned int));
+	bvh->indices = bvh_alloc(n, sizeof(unsigned int));
+	bvh->leaves = bvh_alloc(n, sizeof(unsigned int));
+	bvh->mins = bvh_alloc(n, sizeof(vec3));
+	bvh->maxs = bvh_alloc(n, sizeof(vec3));
+	memcpy(bvh->mins, mins, n * sizeof(vec3));
+	memcpy(bvh->maxs, maxs, n * sizeof(vec3));
+
+	vec3 *centroids = bvh_alloc(n, sizeof(vec3));
+	for (size_t i = 0; i < n; i++) {
+		bvh->indices[i] = i;
+		glm_vec3_center(mins[i], maxs[i], centroids[i]);
+	}
+
+	bvh->nodes[0].first = 0;
+	bvh->nodes[0].count = n;
+	bvh->parents[0] = 0;
+	subdivide(bvh, 0, centroids, 0);
+	free(centroids);
+
+	for (size_t i = 0; i < bvh->n_nodes; i++) {
+		const struct bvh_node *node = &bvh->nodes[i];
+		for (unsigned int j = 0; j < node->count; j++)
+			bvh->leaves[bvh->indices[node->first + j]] = i;
+	}
+}
+
+void
+free_bvh(struct bvh *bvh)
+{
+	free(bvh->nodes);
+	free(bvh->parents);
+	free(bvh->indices);
+	free(bvh->leaves);
+	free(bvh->mins);
+	free(bvh->maxs);
+	memset(bvh, 0, sizeof(*bvh));
+}
+
+/*
+ * moves a primitive to a new box and fixes up the bounds of its leaf and
+ * ancestors, stopping as soon as a node's bounds don't change. the tree
+ * itself is kept, so it degrades if primitives move far from where it
+ * was built; rebuild it then.
+ */
+void
+refit_bvh(struct bvh *bvh, unsigned int primitive, vec3 min, vec3 max)
+{
+	glm_vec3_copy(min, bvh->mins[primitive]);
+	glm_vec3_copy(max, bvh->maxs[primitive]);
+
+	unsigned int index = bvh->leaves[primitive];
+	node_bounds(bvh, &bvh->nodes[index]);
+
+	while (index != 0) {
+		index = bvh->parents[index];
+		struct bvh_node *node = &bvh->nodes[index];
+		const struct bvh_node *left = &bvh->nodes[node->first];
+		const struct bvh_node *right = left + 1;
+
+		vec3 node_min, node_max;
+		glm_vec3_minv((float *) left->min, (float *) right->min, node_min);
+		glm_vec3_maxv((float *) left->max, (float *) right->max, node_max);
+		if (memcmp(node_min, node->min, sizeof(vec3)) == 0 &&
+		    memcmp(node_max, node->max, sizeof(vec3)) == 0)
+			break;
+
+		glm_vec3_copy(node_min, node->min);
+		glm_vec3_copy(node_max, node->max);
+	}
+}
+
+/*
+ * tests a box against the planes left in mask, clearing the planes the box
+ * is fully inside of. returns 0 if it's fully outside one of them.
+ */
+static int
+test_box(const struct frustum *frustum, const float *min, const float *max, int *mask)
+{
+	for (int p = 0; p < 6; p++) {
+		if (!(*mask & 1 << p))
+			continue;
+
+		float a = frustum->a[p], b = frustum->b[p], c = frustum->c[p], d = frustum->d[p];
+
+		/* farthest and nearest corners along the plane normal */
+		float far = a * (a > 0 ? max[0] : min[0]) + b * (b > 0 ? max[1] : min[1]) +
+			c * (c > 0 ? max[2] : min[2]) + d;
+		if (far < 0.0f)
+			return 0;
+
+		float near = a * (a > 0 ? min[0] : max[0]) + b * (b > 0 ? min[1] : max[1]) +
+			c * (c > 0 ? min[2] : max[2]) + d;
+		if (near >= 0.0f)
+			*mask &= ~(1 << p);
+	}
+	return 1;
+}
+
+/*
+ * writes the primitives whose box intersects the frustum to visible and
+ * returns how many there are. subtrees fully inside skip further tests.
+ */
+size_t
+cull_bvh(const struct bvh *bvh, const struct frustum *frustum, unsigned int *visible)
+{
+	size_t n = 0;
+
+	if (bvh->n_primitives == 0)
+		return 0;
+
+	struct {
+		unsigned int node;
+		int mask;
+	} stack[BVH_STACK];
+	int top = 0;
+
+	stack[top].node = 0;
+	stack[top++].mask = 0x3f;
+
+	while (top > 0) {
+		top--;
+		const struct bvh_node *node = &bvh->nodes[stack[top].node];
+		int mask = stack[top].mask;
+
+		if (mask && !test_box(frustum, node->min, node->max, &mask))
+			continue;
+
+		if (node->count == 0) {
+			if (top + 2 > BVH_STACK) {
+				errlog("the BVH is deeper than %d levels.", BVH_STACK);
+				exit(1);
+			}
+			stack[top].node = node->first;
+			stack[top++].mask = mask;
+			stack[top].node = node->first + 1;
+			stack[top++].mask = mask;
+			continue;
+		}
+
+		for (unsigned int i = 0; i < node->count; i++) {
+			unsigned int p = bvh->indices[node->first + i];
+			int primitive_mask = mask;
+			if (!primitive_mask ||
+			    test_box(frustum, bvh->mins[p], bvh->maxs[p], &primitive_mask))
+				visible[n++] = p;
+		}
+	}
+
+	return n;
+}
+
+/* slab test, returns the entry distance or FLT_MAX on a miss */
+static float
+intersect_box(const float *min, const float *max, vec3 origin, vec3 inv_dir, float max_t)
+{
+	float t_min = 0.0f, t_max = max_t;
+	for (int a = 0; a < 3; a++) {
+		float t0 = (min[a] - origin[a]) * inv_dir[a];
+		float t1 = (max[a] - origin[a]) * inv_dir[a];
+		if (t0 > t1) {
+			float t = t0;
+			t0 = t1;
+			t1 = t;
+		}
+		t_min = t0 > t_min ? t0 : t_min;
+		t_max = t1 < t_max ? t1 : t_max;
+		if (t_min > t_max)
+			return FLT_MAX;
+	}
+	return t_min;
+}
+
+/*
+ * returns the primitive whose box the ray from origin along dir enters
+ * first within max_t, storing the distance in t, or -1 if there's none.
+ * with any set it stops at the first hit instead, which is all a line of
+ * sight test needs.
+ */
+static int
+traverse_ray(const struct bvh *bvh, vec3 origin, vec3 dir, float max_t, float *t, int any)
+{
+	int hit = -1;
+
+	if (bvh->n_primitives == 0)
+		return -1;
+
+	vec3 inv_dir;
+	for (int a = 0; a < 3; a++)
+		inv_dir[a] = 1.0f / dir[a];
+
+	unsigned int stack[BVH_STACK];
+	int top = 0;
+	stack[top++] = 0;
+	*t = max_t;
+
+	while (top > 0) {
+		const struct bvh_node *node = &bvh->nodes[stack[--top]];
+
+		if (node->count > 0) {
+			for (unsigned int i = 0; i < node->count; i++) {
+				unsigned int p = bvh->indices[node->first + i];
+				float d = intersect_box(bvh->mins[p], bvh->maxs[p], origin, inv_dir, *t);
+				if (d != FLT_MAX && (hit < 0 || d < *t)) {
+					*t = d;
+					hit = p;
+					if (any)
+						return hit;
+				}
+			}
+			continue;
+		}
+
+		/* visit the nearer child first so farther ones get pruned */
+		const struct bvh_node *left = &bvh->nodes[node->first];
+		const struct bvh_node *right = left + 1;
+		float dl = intersect_box(left->min, left->max, origin, inv_dir, *t);
+		float dr = intersect_box(right->min, right->max, origin, inv_dir, *t);
+
+		if (top + 2 > BVH_STACK) {
+			errlog("the BVH is deeper than %d levels.", BVH_STACK);
+			exit(1);
+		}
+		if (dl <= dr) {
+			if (dr != FLT_MAX)
+				stack[top++] = node->first + 1;
+			if (dl != FLT_MAX)
+				stack[top++] = node->first;
+		}
+		else {
+			if (dl != FLT_MAX)
+				stack[top++] = node->first;
+			stack[top++] = node->first + 1;
+		}
+	}
+
+	return hit;
+}
+
+/* picking, tests boxes only; the caller refines the hit against triangles if it needs to */
+int
+raycast_bvh(const struct bvh *bvh, vec3 origin, vec3 dir, float max_t, float *t)
+{
+	return traverse_ray(bvh, origin, dir, max_t, t, 0);
+}
+
+/* returns whether any box lies between from and to */
+int
+occluded_bvh(const struct bvh *bvh, vec3 from, vec3 to)
+{
+	vec3 dir;
+	float t;
+	glm_vec3_sub(to, from, dir);
+	return traverse_ray(bvh, from, dir, 1.0f, &t, 1) >= 0;
+}
@@ -0,0 +1,375 @@
+/* See LICENSE for license details. */
+#define _XOPEN_SOURCE 700
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "streamer.h"
+#include "models.h"
+#include "cache.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+struct cache cache;
+
+/* loader threads look textures up while the GL thread adds them */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *type_names[CACHE_TYPES] = {
+	[CACHE_TEXTURE] = "textures",
+	[CACHE_MODEL]   = "models",
+	[CACHE_PROGRAM] = "programs",
+};
+
+/* FNV-1a, continuing from hash */
+uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/* key of a resource loaded from a file, the same for every way to spell its path */
+uint64_t
+path_key(int type, const char *path)
+{
+	unsigned char type_byte = type;
+	uint64_t hash = hash_bytes(FNV_OFFSET, &type_byte, 1);
+
+	char *canonical = realpath(path, NULL);
+	if (canonical != NULL) {
+		hash = hash_bytes(hash, canonical, strlen(canonical));
+		free(canonical);
+	}
+	else {
+		hash = hash_bytes(hash, path, strlen(path));
+	}
+	return hash ? hash : 1;
+}
+
+/* key of a resource identified by its bytes, like an image embedded in a model */
+uint64_t
+content_key(int type, const void *data, size_t size)
+{
+	unsigned char type_byte = type;
+	uint64_t hash = hash_bytes(hash_bytes(FNV_OFFSET, &type_byte, 1), data, size);
+	return hash ? hash : 1;
+}
+
+static struct cache_entry *
+find(uint64_t key)
+{
+	if (cache.capacity == 0)
+		return NULL;
+
+	for (size_t i = key & (cache.capacity - 1); ; i = (i + 1) & (cache.capacity - 1)) {
+		if (cache.entries[i].key == key)
+			return &cache.entries[i];
+		if (cache.entries[i].key == 0)
+			return NULL;
+	}
+}
+
+static struct cache_entry *
+insert(uint64_t key, int type, size_t bytes)
+{
+	/* linear probing, kept under 3/4 full */
+	if ((cache.n_entries + 1) * 4 > cache.capacity * 3) {
+		size_t capacity = cache.capacity ? cache.capacity * 2 : 64;
+		struct cache_entry *entries = calloc(capacity, sizeof(struct cache_entry));
+		if (entries == NULL) {
+			errlog("couldn't grow the resource cache to %zu entries.", capacity);
+			exit(1);
+		}
+
+		for (size_t i = 0; i < cache.capacity; i++) {
+			if (cache.entries[i].key == 0)
+				continue;
+			size_t j = cache.entries[i].key & (capacity - 1);
+			while (entries[j].key != 0)
+				j = (j + 1) & (capacity - 1);
+			entries[j] = cache.entries[i];
+		}
+		free(cache.entries);
+		cache.entries = entries;
+		cache.capacity = capacity;
+	}
+
+	size_t i = key & (cache.capacity - 1);
+	while (cache.entries[i].key != 0)
+		i = (i + 1) & (cache.capacity - 1);
+
+	struct cache_entry *entry = &cache.entries[i];
+	memset(entry, 0, sizeof(struct cache_entry));
+	entry->key = key;
+	entry->type = type;
+	entry->refs = 1;
+	entry->bytes = bytes;
+	entry->last_use = cache.clock++;
+
+	cache.n_entries++;
+	cache.count[type]++;
+	cache.bytes[type] += bytes;
+	return entry;
+}
+
+/* removes an entry, shifting back the ones probed past it */
+static void
+erase(struct cache_entry *entry)
+{
+	cache.n_entries--;
+	cache.count[entry->type]--;
+	cache.bytes[entry->type] -= entry->bytes;
+
+	size_t mask = cache.capacity - 1;
+	size_t hole = entry - cache.entries;
+	cache.entries[hole].key = 0;
+
+	for (size_t i = (hole + 1) & mask; cache.entries[i].key != 0; i = (i + 1) & mask) {
+		size_t home = cache.entries[i].key & mask;
+		/* the entry can move to the hole if its home isn't between them */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			cache.entries[hole] = cache.entries[i];
+			cache.entries[i].key = 0;
+			hole = i;
+		}
+	}
+}
+
+static struct cache_entry *
+acquire(uint64_t key, int type)
+{
+	struct cache_entry *entry = find(key);
+	if (entry == NULL || entry->type != type) {
+		cache.misses++;
+		return NULL;
+	}
+	entry->refs++;
+	entry->last_use = cache.clock++;
+	cache.hits++;
+	return entry;
+}
+
+static void
+release(uint64_t key)
+{
+	struct cache_entry *entry = find(key);
+	if (entry != NULL && entry->refs > 0)
+		entry->refs--;
+}
+
+/* returns the texture with a new reference, 0 when it isn't cached */
+GLuint
+acquire_texture(uint64_t key)
+{
+	pthread_mutex_lock(&lock);
+	struct cache_entry *entry = acquire(key, CACHE_TEXTURE);
+	GLuint texture = entry ? entry->value.texture : 0;
+	pthread_mutex_unlock(&lock);
+	return texture;
+}
+
+/* adds a texture the caller holds a reference to */
+void
+cache_texture(uint64_t key, GLuint texture, size_t bytes)
+{
+	pthread_mutex_lock(&lock);
+	insert(key, CACHE_TEXTURE, bytes)->value.texture = texture;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+release_texture(uint64_t key)
+{
+	pthread_mutex_lock(&lock);
+	release(key);
+	pthread_mutex_unlock(&lock);
+}
+
+/* copies the cached model with a new reference, 0 when it isn't cached */
+int
+acquire_model(uint64_t key, struct model *model)
+{
+	pthread_mutex_lock(&lock);
+	struct cache_entry *entry = acquire(key, CACHE_MODEL);
+	if (entry != NULL)
+		*model = *entry->value.model;
+	pthread_mutex_unlock(&lock);
+	return entry != NULL;
+}
+
+/*
+ * adds a model the caller holds a reference to. when the same model was
+ * loaded twice at once, the copy loaded last is dropped for the cached one.
+ */
+void
+cache_model(uint64_t key, struct model *model)
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < model->n_meshes; i++) {
+		const struct mesh *mesh = &model->meshes[i];
+		bytes += mesh->n_vertices * vertex_sizes[mesh->format] +
+			mesh->n_indices * index_sizes[mesh->index_type];
+	}
+	model->key = key;
+
+	pthread_mutex_lock(&lock);
+	struct cache_entry *entry = find(key);
+	if (entry != NULL && entry->type == CACHE_MODEL) {
+		entry->refs++;
+		for (size_t i = 0; i < model->n_meshes; i++)
+			release(model->meshes[i].diffuse_key);
+		free(model->meshes);
+		*model = *entry->value.model;
+	}
+	else {
+		struct model *copy = malloc(sizeof(struct model));
+		if (copy == NULL) {
+			errlog("couldn't cache a model.");
+			exit(1);
+		}
+		*copy = *model;
+		insert(key, CACHE_MODEL, bytes)->value.model = copy;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void
+release_model(const struct model *model)
+{
+	pthread_mutex_lock(&lock);
+	release(model->key);
+	pthread_mutex_unlock(&lock);
+}
+
+int
+acquire_program(uint64_t key, struct program *program)
+{
+	pthread_mutex_lock(&lock);
+	struct cache_entry *entry = acquire(key, CACHE_PROGRAM);
+	if (entry != NULL)
+		*program = entry->value.program;
+	pthread_mutex_unlock(&lock);
+	return entry != NULL;
+}
+
+void
+cache_program(uint64_t key, const struct program *program)
+{
+	pthread_mutex_lock(&lock);
+	insert(key, CACHE_PROGRAM, 0)->value.program = *program;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+release_program(const struct program *program)
+{
+	pthread_mutex_lock(&lock);
+	release(program->key);
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+destroy(struct cache_entry *entry)
+{
+	switch (entry->type) {
+	case CACHE_TEXTURE:
+		cancel_stream(entry->value.texture);
+		glDeleteTextures(1, &entry->value.texture);
+		break;
+	case CACHE_PROGRAM:
+		glDeleteProgram(entry->value.program.ID);
+		break;
+	case CACHE_MODEL: {
+		/* the next meshes uploaded reuse the model's ranges */
+		struct model *model = entry->value.model;
+		for (size_t i = 0; i < model->n_meshes; i++) {
+			geometry_free(&model->meshes[i]);
+			release(model->meshes[i].diffuse_key);
+			free(model->meshes[i].vertices);
+		}
+		free(model->meshes);
+		free(model);
+		break;
+	}
+	}
+	erase(entry);
+}
+
+static size_t
+total_bytes(void)
+{
+	size_t bytes = 0;
+	for (int type = 0; type < CACHE_TYPES; type++)
+		bytes += cache.bytes[type];
+	return bytes;
+}
+
+static void
+evict_type(int type, size_t budget)
+{
+	while (budget == 0 || total_bytes() > budget) {
+		struct cache_entry *oldest = NULL;
+		for (size_t i = 0; i < cache.capacity; i++) {
+			struct cache_entry *entry = &cache.entries[i];
+			if (entry->key != 0 && entry->refs == 0 && entry->type == type &&
+			    (oldest == NULL || entry->last_use < oldest->last_use))
+				oldest = entry;
+		}
+		if (oldest == NULL)
+			return;
+		destroy(oldest);
+	}
+}
+
+/*
+ * destroys unreferenced resources, least recently used first, until the
+ * cache holds at most budget bytes or only referenced ones are left.
+ * models go before textures, as evicting one releases its textures. a
+ * budget of 0 destroys everything unreferenced, programs too, which take
+ * no room otherwise. returns the bytes left.
+ */
+size_t
+evict_cache(size_t budget)
+{
+	pthread_mutex_lock(&lock);
+	evict_type(CACHE_MODEL, budget);
+	evict_type(CACHE_TEXTURE, budget);
+	if (budget == 0)
+		evict_type(CACHE_PROGRAM, budget);
+	size_t bytes = total_bytes();
+	pthread_mutex_unlock(&lock);
+	return bytes;
+}
+
+void
+print_cache_stats(void)
+{
+	pthread_mutex_lock(&lock);
+	for (int type = 0; type < CACHE_TYPES; type++) {
+		printf("%zu %s (%.1f MiB), ", cache.count[type], type_names[type],
+			cache.bytes[type] / (1024.0 * 1024.0));
+	}
+	printf("%lu hits and %lu misses\n", cache.hits, cache.misses);
+
+	/* models are counted by the ranges they use, the buffers are as big as they ever got */
+	size_t capacity;
+	size_t used = geometry_bytes(&capacity);
+	printf("geometry buffers %.1f MiB used of %.1f MiB\n",
+		used / (1024.0 * 1024.0), capacity / (1024.0 * 1024.0));
+	pthread_mutex_unlock(&lock);
+}
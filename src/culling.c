@@ -0,0 +1,128 @@
+/* See LICENSE for license details. */
+#include <math.h>
+#include <stdlib.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "culling.h"
+
+void
+extract_frustum(mat4 view_projection, struct frustum *frustum)
+{
+	vec4 planes[6];
+	glm_frustum_planes(view_projection, planes);
+
+	for (int i = 0; i < 6; i++) {
+		frustum->a[i] = planes[i][0];
+		frustum->b[i] = planes[i][1];
+		frustum->c[i] = planes[i][2];
+		frustum->d[i] = planes[i][3];
+	}
+}
+
+static float *
+grow_array(float *array, size_t capacity)
+{
+	array = realloc(array, capacity * sizeof(float));
+	if (array == NULL) {
+		errlog("couldn't grow the culling boxes to %zu elements.", capacity);
+		exit(1);
+	}
+	return array;
+}
+
+/*
+ * center and half extents of the world space box enclosing the model space
+ * box min, max transformed by model (Arvo's method, the half extents along
+ * each world axis are the absolute rotated half extents).
+ */
+static void
+world_box(mat4 model, vec3 min, vec3 max, vec3 world_center, vec3 world_extent)
+{
+	vec3 center, extent;
+	for (int i = 0; i < 3; i++) {
+		center[i] = (min[i] + max[i]) * 0.5f;
+		extent[i] = (max[i] - min[i]) * 0.5f;
+	}
+
+	for (int i = 0; i < 3; i++) {
+		world_center[i] = model[3][i];
+		world_extent[i] = 0.0f;
+		for (int j = 0; j < 3; j++) {
+			world_center[i] += model[j][i] * center[j];
+			world_extent[i] += fabsf(model[j][i]) * extent[j];
+		}
+	}
+}
+
+void
+transform_box(mat4 model, vec3 min, vec3 max, vec3 world_min, vec3 world_max)
+{
+	vec3 center, extent;
+	world_box(model, min, max, center, extent);
+	glm_vec3_sub(center, extent, world_min);
+	glm_vec3_add(center, extent, world_max);
+}
+
+/* appends the world space box of min, max transformed by model */
+void
+push_box(struct boxes *boxes, mat4 model, vec3 min, vec3 max)
+{
+	if (boxes->n == boxes->capacity) {
+		boxes->capacity = boxes->capacity ? boxes->capacity * 2 : 256;
+		boxes->cx = grow_array(boxes->cx, boxes->capacity);
+		boxes->cy = grow_array(boxes->cy, boxes->capacity);
+		boxes->cz = grow_array(boxes->cz, boxes->capacity);
+		boxes->ex = grow_array(boxes->ex, boxes->capacity);
+		boxes->ey = grow_array(boxes->ey, boxes->capacity);
+		boxes->ez = grow_array(boxes->ez, boxes->capacity);
+	}
+
+	vec3 world_center, world_extent;
+	world_box(model, min, max, world_center, world_extent);
+
+	size_t n = boxes->n++;
+	boxes->cx[n] = world_center[0];
+	boxes->cy[n] = world_center[1];
+	boxes->cz[n] = world_center[2];
+	boxes->ex[n] = world_extent[0];
+	boxes->ey[n] = world_extent[1];
+	boxes->ez[n] = world_extent[2];
+}
+
+/*
+ * sets visible[i] for every box that isn't fully outside one of the planes
+ * and returns how many are. the loops go plane by plane over all boxes with
+ * no branches, so the compiler can run the inner one 4 or 8 boxes wide.
+ */
+size_t
+cull_boxes(const struct frustum *frustum, const struct boxes *boxes, unsigned char *visible)
+{
+	size_t n = boxes->n;
+
+	for (size_t i = 0; i < n; i++)
+		visible[i] = 1;
+
+	for (int p = 0; p < 6; p++) {
+		const float a = frustum->a[p], b = frustum->b[p];
+		const float c = frustum->c[p], d = frustum->d[p];
+		const float abs_a = fabsf(a), abs_b = fabsf(b), abs_c = fabsf(c);
+
+		for (size_t i = 0; i < n; i++) {
+			float distance = a * boxes->cx[i] + b * boxes->cy[i] + c * boxes->cz[i] + d;
+			float radius = abs_a * boxes->ex[i] + abs_b * boxes->ey[i] + abs_c * boxes->ez[i];
+			visible[i] &= distance + radius >= 0.0f;
+		}
+	}
+
+	size_t n_visible = 0;
+	for (size_t i = 0; i < n; i++)
+		n_visible += visible[i];
+
+	return n_visible;
+}
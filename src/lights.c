@@ -0,0 +1,272 @@
+/* See LICENSE for license details. */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "lights.h"
+
+struct pos_light *pos_lights;
+size_t n_pos_lights;
+
+static size_t pos_lights_capacity;
+
+/* the index of the new light, pos_lights may move */
+size_t
+add_pos_light(const struct pos_light *light)
+{
+	if (n_pos_lights == pos_lights_capacity) {
+		size_t capacity = pos_lights_capacity ? pos_lights_capacity * 2 : 16;
+		struct pos_light *lights = realloc(pos_lights, capacity * sizeof(struct pos_light));
+		if (lights == NULL) {
+			errlog("couldn't add more than %zu point lights.", n_pos_lights);
+			exit(1);
+		}
+		pos_lights = lights;
+		pos_lights_capacity = capacity;
+	}
+	pos_lights[n_pos_lights] = *light;
+	return n_pos_lights++;
+}
+
+/*
+ * distance at which the brightest channel of the light is attenuated
+ * under LIGHT_CUTOFF, solving 1 + linear d + quadratic d^2 = i / cutoff.
+ */
+static float
+light_radius(const struct pos_light *light)
+{
+	float intensity = 0.0f;
+	for (int i = 0; i < 3; i++) {
+		intensity = fmaxf(intensity, light->ambient[i]);
+		intensity = fmaxf(intensity, light->diffuse[i]);
+		intensity = fmaxf(intensity, light->specular[i]);
+	}
+
+	float c = 1.0f - intensity / LIGHT_CUTOFF;
+	if (c >= 0.0f)
+		return 0.0f;
+	if (light->quadratic > 0.0f) {
+		return (-light->linear + sqrtf(light->linear * light->linear -
+			4.0f * light->quadratic * c)) / (2.0f * light->quadratic);
+	}
+	if (light->linear > 0.0f)
+		return -c / light->linear;
+	return FAR_PLANE;
+}
+
+/* the depth slice of a view space distance, see the cluster depth in update_uniform_buffers */
+static int
+depth_slice(float depth)
+{
+	int slice = logf(depth / NEAR_PLANE) / logf(FAR_PLANE / NEAR_PLANE) * CLUSTERS_Z;
+	return slice < 0 ? 0 : slice >= CLUSTERS_Z ? CLUSTERS_Z - 1 : slice;
+}
+
+static int
+tile(float ndc, int tiles)
+{
+	int t = floorf((ndc * 0.5f + 0.5f) * tiles);
+	return t < 0 ? 0 : t >= tiles ? tiles - 1 : t;
+}
+
+/*
+ * the clusters a light's sphere overlaps, conservatively through the
+ * screen bounds of its view space box. 0 when it is off screen.
+ */
+static int
+light_bounds(const vec3 center, float radius, int bounds[6])
+{
+	float depth = -center[2];
+	if (radius <= 0.0f || depth + radius < NEAR_PLANE || depth - radius > FAR_PLANE)
+		return 0;
+
+	bounds[4] = depth_slice(fmaxf(depth - radius, NEAR_PLANE));
+	bounds[5] = depth_slice(fminf(depth + radius, FAR_PLANE));
+
+	/* a box reaching behind the near plane can cover any part of the screen */
+	if (depth - radius <= NEAR_PLANE) {
+		bounds[0] = 0;
+		bounds[1] = CLUSTERS_X - 1;
+		bounds[2] = 0;
+		bounds[3] = CLUSTERS_Y - 1;
+		return 1;
+	}
+
+	vec2 min = { 1.0f, 1.0f }, max = { -1.0f, -1.0f };
+	for (int i = 0; i < 8; i++) {
+		vec4 corner = {
+			center[0] + (i & 1 ? radius : -radius),
+			center[1] + (i & 2 ? radius : -radius),
+			center[2] + (i & 4 ? radius : -radius),
+			1.0f
+		};
+		vec4 clip;
+		glm_mat4_mulv(game.cam.projection, corner, clip);
+		for (int axis = 0; axis < 2; axis++) {
+			min[axis] = fminf(min[axis], clip[axis] / clip[3]);
+			max[axis] = fmaxf(max[axis], clip[axis] / clip[3]);
+		}
+	}
+	if (min[0] > 1.0f || max[0] < -1.0f || min[1] > 1.0f || max[1] < -1.0f)
+		return 0;
+
+	bounds[0] = tile(min[0], CLUSTERS_X);
+	bounds[1] = tile(max[0], CLUSTERS_X);
+	bounds[2] = tile(min[1], CLUSTERS_Y);
+	bounds[3] = tile(max[1], CLUSTERS_Y);
+	return 1;
+}
+
+static GLuint
+cluster_index(int x, int y, int z)
+{
+	return (z * CLUSTERS_Y + y) * CLUSTERS_X + x;
+}
+
+/* resizes a storage buffer to fit size bytes before uploading them, orphaning the old storage */
+static void
+upload_storage(GLuint buffer, size_t *buffer_size, const void *data, size_t size)
+{
+	while (*buffer_size < size)
+		*buffer_size *= 2;
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, *buffer_size, NULL, GL_STREAM_DRAW);
+	if (size > 0)
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+}
+
+void
+create_light_grid(struct light_grid *grid)
+{
+	memset(grid, 0, sizeof(struct light_grid));
+
+	grid->lights_size = 64 * sizeof(struct pos_light_block);
+	grid->indices_size = CLUSTERS * sizeof(GLuint);
+
+	glGenBuffers(1, &grid->lights);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid->lights);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, grid->lights_size, NULL, GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, POS_LIGHTS_BUFFER, grid->lights);
+
+	glGenBuffers(1, &grid->clusters);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid->clusters);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(grid->ranges), NULL, GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTERS_BUFFER, grid->clusters);
+
+	glGenBuffers(1, &grid->indices);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid->indices);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, grid->indices_size, NULL, GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_INDICES_BUFFER, grid->indices);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+/*
+ * bins every point light into the clusters of the current view and
+ * uploads the lights, the range of each cluster and the index list.
+ * counts first, so the index list is filled with each cluster contiguous.
+ */
+void
+update_light_grid(struct light_grid *grid)
+{
+	if (n_pos_lights > grid->capacity) {
+		size_t capacity = grid->capacity ? grid->capacity : 64;
+		while (capacity < n_pos_lights)
+			capacity *= 2;
+		grid->blocks = realloc(grid->blocks, capacity * sizeof(struct pos_light_block));
+		grid->bounds = realloc(grid->bounds, capacity * sizeof(*grid->bounds));
+		if (grid->blocks == NULL || grid->bounds == NULL) {
+			errlog("couldn't bin %zu point lights.", n_pos_lights);
+			exit(1);
+		}
+		grid->capacity = capacity;
+	}
+
+	memset(grid->ranges, 0, sizeof(grid->ranges));
+
+	for (size_t i = 0; i < n_pos_lights; i++) {
+		struct pos_light *light = &pos_lights[i];
+		struct pos_light_block *block = &grid->blocks[i];
+		float radius = light_radius(light);
+
+		glm_vec4(light->pos,     radius, block->pos);
+		glm_vec4(light->ambient, 0.0f,   block->ambient);
+		glm_vec4(light->diffuse, 0.0f,   block->diffuse);
+		glm_vec3_copy(light->specular, block->specular);
+		block->linear = light->linear;
+		block->quadratic = light->quadratic;
+
+		vec3 center;
+		glm_mat4_mulv3(game.cam.view, light->pos, 1.0f, center);
+		int *bounds = grid->bounds[i];
+		if (!light_bounds(center, radius, bounds)) {
+			/* an empty range, so the second pass skips it too */
+			bounds[4] = 0;
+			bounds[5] = -1;
+			continue;
+		}
+
+		for (int z = bounds[4]; z <= bounds[5]; z++)
+		for (int y = bounds[2]; y <= bounds[3]; y++)
+		for (int x = bounds[0]; x <= bounds[1]; x++)
+			grid->ranges[cluster_index(x, y, z)][1]++;
+	}
+
+	grid->n_indices = 0;
+	for (size_t c = 0; c < CLUSTERS; c++) {
+		grid->ranges[c][0] = grid->n_indices;
+		grid->n_indices += grid->ranges[c][1];
+		grid->ranges[c][1] = 0;
+	}
+
+	if (grid->n_indices > grid->indices_capacity) {
+		size_t capacity = grid->indices_capacity ? grid->indices_capacity : CLUSTERS;
+		while (capacity < grid->n_indices)
+			capacity *= 2;
+		grid->light_indices = realloc(grid->light_indices, capacity * sizeof(GLuint));
+		if (grid->light_indices == NULL) {
+			errlog("couldn't bin %zu light indices.", grid->n_indices);
+			exit(1);
+		}
+		grid->indices_capacity = capacity;
+	}
+
+	for (size_t i = 0; i < n_pos_lights; i++) {
+		const int *bounds = grid->bounds[i];
+		for (int z = bounds[4]; z <= bounds[5]; z++)
+		for (int y = bounds[2]; y <= bounds[3]; y++)
+		for (int x = bounds[0]; x <= bounds[1]; x++) {
+			GLuint *range = grid->ranges[cluster_index(x, y, z)];
+			grid->light_indices[range[0] + range[1]++] = i;
+		}
+	}
+
+	upload_storage(grid->lights, &grid->lights_size, grid->blocks,
+		n_pos_lights * sizeof(struct pos_light_block));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid->clusters);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(grid->ranges), grid->ranges);
+	upload_storage(grid->indices, &grid->indices_size, grid->light_indices,
+		grid->n_indices * sizeof(GLuint));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void
+print_light_stats(const struct light_grid *grid)
+{
+	GLuint max = 0;
+	for (size_t c = 0; c < CLUSTERS; c++)
+		if (grid->ranges[c][1] > max)
+			max = grid->ranges[c][1];
+
+	printf("%zu point lights, %zu binned in %d clusters (%.1f on average, %u at most)\n",
+		n_pos_lights, grid->n_indices, CLUSTERS, (double) grid->n_indices / CLUSTERS, max);
+}
@@ -0,0 +1,183 @@
+/* See LICENSE for license details. */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "staging.h"
+#include "models.h"
+#include "cache.h"
+#include "loader.h"
+
+static void
+push_job(struct load_job **head, struct load_job **tail, struct load_job *job)
+{
+	job->next = NULL;
+	if (*tail != NULL)
+		(*tail)->next = job;
+	else
+		*head = job;
+	*tail = job;
+}
+
+static struct load_job *
+pop_job(struct load_job **head, struct load_job **tail)
+{
+	struct load_job *job = *head;
+	if (job != NULL) {
+		*head = job->next;
+		if (*head == NULL)
+			*tail = NULL;
+	}
+	return job;
+}
+
+/*
+ * takes pending jobs while fewer than LOADER_STAGED models sit in staging
+ * memory, and stages them outside the lock.
+ */
+static void *
+work(void *arg)
+{
+	struct loader *loader = arg;
+
+	pthread_mutex_lock(&loader->lock);
+	for (;;) {
+		while (!loader->stop &&
+		       (loader->pending == NULL || loader->n_staged >= LOADER_STAGED))
+			pthread_cond_wait(&loader->work, &loader->lock);
+		if (loader->stop)
+			break;
+
+		struct load_job *job = pop_job(&loader->pending, &loader->pending_tail);
+		loader->n_staged++;
+		pthread_mutex_unlock(&loader->lock);
+
+		stage_model(&job->staged, job->path, job->flags);
+
+		pthread_mutex_lock(&loader->lock);
+		push_job(&loader->staged, &loader->staged_tail, job);
+	}
+	pthread_mutex_unlock(&loader->lock);
+
+	return NULL;
+}
+
+/* starts a worker per core, leaving one for the GL thread */
+void
+start_loader(struct loader *loader)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (staging.buffer == 0)
+		create_staging();
+
+	memset(loader, 0, sizeof(struct loader));
+	loader->n_threads = cores > 1 ? cores - 1 : 1;
+	if (loader->n_threads > LOADER_THREADS)
+		loader->n_threads = LOADER_THREADS;
+
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->work, NULL);
+
+	for (size_t i = 0; i < loader->n_threads; i++) {
+		if (pthread_create(&loader->threads[i], NULL, work, loader) != 0) {
+			errlog("couldn't start loader thread #%zu.", i);
+			exit(1);
+		}
+	}
+}
+
+/* model isn't ready until update_loader has uploaded it, unless it is cached */
+void
+queue_load(struct loader *loader, struct model *model, const char *path, int flags)
+{
+	uint64_t key = model_key(path, flags);
+	if (acquire_model(key, model))
+		return;
+
+	struct load_job *job = calloc(1, sizeof(struct load_job));
+	char *job_path = malloc(strlen(path) + 1);
+	if (job == NULL || job_path == NULL) {
+		errlog("couldn't queue the %s model for loading.", path);
+		exit(1);
+	}
+	strcpy(job_path, path);
+
+	job->path = job_path;
+	job->flags = flags;
+	job->key = key;
+	job->model = model;
+	model->ready = 0;
+	loader->n_jobs++;
+
+	pthread_mutex_lock(&loader->lock);
+	push_job(&loader->pending, &loader->pending_tail, job);
+	pthread_cond_signal(&loader->work);
+	pthread_mutex_unlock(&loader->lock);
+}
+
+/*
+ * uploads staged meshes on the GL thread for up to budget seconds, always
+ * at least one when there is one, and returns how many queued models
+ * aren't ready yet.
+ */
+size_t
+update_loader(struct loader *loader, double budget)
+{
+	double start = glfwGetTime();
+
+	reclaim_staging();
+	do {
+		if (loader->uploading == NULL) {
+			pthread_mutex_lock(&loader->lock);
+			loader->uploading = pop_job(&loader->staged, &loader->staged_tail);
+			if (loader->uploading != NULL) {
+				loader->n_staged--;
+				pthread_cond_signal(&loader->work);
+			}
+			pthread_mutex_unlock(&loader->lock);
+
+			if (loader->uploading == NULL)
+				break;
+		}
+
+		struct load_job *job = loader->uploading;
+		if (upload_staged_mesh(&job->staged) == 0) {
+			cache_model(job->key, &job->staged.model);
+			*job->model = job->staged.model;
+			/* makes room for what comes in from what was released */
+			evict_cache(CACHE_BUDGET);
+			loader->uploading = NULL;
+			loader->n_jobs--;
+			free(job->path);
+			free(job);
+		}
+	} while (glfwGetTime() - start < budget);
+
+	return loader->n_jobs;
+}
+
+/* stops the workers once they finish the model they are staging */
+void
+stop_loader(struct loader *loader)
+{
+	pthread_mutex_lock(&loader->lock);
+	loader->stop = 1;
+	pthread_cond_broadcast(&loader->work);
+	pthread_mutex_unlock(&loader->lock);
+
+	for (size_t i = 0; i < loader->n_threads; i++)
+		pthread_join(loader->threads[i], NULL);
+
+	pthread_mutex_destroy(&loader->lock);
+	pthread_cond_destroy(&loader->work);
+}
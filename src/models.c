@@ -1,5 +1,11 @@
 /* See LICENSE for license details. */
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define CGLTF_IMPLEMENTATION
 #include <cgltf.h>
@@ -9,65 +15,788 @@
 #include <GLFW/glfw3.h>
 #include <SOIL2/SOIL2.h>
 
+#include "shaders.h"
 #include "utils.h"
+#include "streamer.h"
+#include "staging.h"
 #include "models.h"
+#include "pack.h"
+#include "cache.h"
+#include "simplify.h"
+#include "optimize.h"
+#include "culling.h"
+#include "bvh.h"
+#include "render.h"
+#include "profiler.h"
+
+/* there are only 6 * 2 * 3 * 3 valid glTF filter and wrap combinations */
+#define MAX_SAMPLERS 108
+
+/* initial size of the shared vertex and index buffers */
+#define GEOMETRY_VERTICES (1 << 16)
+#define GEOMETRY_INDICES (1 << 18)
+/* for meshes without a material */
+#define ERROR_TEXTURE "img/err.bmp"
+/* meshes with fewer triangles aren't worth simplifying further */
+#define LOD_MIN_TRIANGLES 256
+/* a level that keeps more of the previous level's triangles is dropped */
+#define LOD_MAX_RATIO 0.75f
 
 extern struct state game;
 
-GLuint
-cgltf_load_texture(const cgltf_texture *tex, const char *path)
+struct geometry geometry[VERTEX_FORMATS];
+
+const size_t vertex_sizes[VERTEX_FORMATS] = {
+	[VERTEX_FLOAT]        = sizeof(struct vertex),
+	[VERTEX_PACKED]       = offsetof(struct packed_vertex, col),
+	[VERTEX_PACKED_COLOR] = sizeof(struct packed_vertex),
+};
+
+const size_t index_sizes[INDEX_TYPES] = {
+	[INDEX_32] = sizeof(GLuint),
+	[INDEX_16] = sizeof(GLushort),
+};
+
+const GLenum index_gl_types[INDEX_TYPES] = {
+	[INDEX_32] = GL_UNSIGNED_INT,
+	[INDEX_16] = GL_UNSIGNED_SHORT,
+};
+
+static struct {
+	GLint min_filter, mag_filter, wrap_s, wrap_t;
+	GLuint ID;
+} samplers[MAX_SAMPLERS];
+static size_t n_samplers;
+
+static int
+valid_filter(GLint filter, int mipmaps)
 {
-	if (tex == NULL) return 0;
+	switch (filter) {
+	case GL_NEAREST:
+	case GL_LINEAR:
+		return 1;
+	case GL_NEAREST_MIPMAP_NEAREST:
+	case GL_LINEAR_MIPMAP_NEAREST:
+	case GL_NEAREST_MIPMAP_LINEAR:
+	case GL_LINEAR_MIPMAP_LINEAR:
+		return mipmaps;
+	}
+	return 0;
+}
 
-	cgltf_image *image = tex->image;
+static int
+valid_wrap(GLint wrap)
+{
+	return wrap == GL_REPEAT || wrap == GL_MIRRORED_REPEAT || wrap == GL_CLAMP_TO_EDGE;
+}
+
+/*
+ * resolves the modes of a glTF sampler for a staged mesh. unset or invalid
+ * modes fall back to the glTF defaults (repeat, trilinear filtering).
+ */
+static void
+cgltf_sampler_modes(const cgltf_sampler *sampler, struct staged_mesh *staged)
+{
+	staged->min_filter = GL_LINEAR_MIPMAP_LINEAR;
+	staged->mag_filter = GL_LINEAR;
+	staged->wrap_s = GL_REPEAT;
+	staged->wrap_t = GL_REPEAT;
+
+	if (sampler != NULL) {
+		if (valid_filter(sampler->min_filter, 1))
+			staged->min_filter = sampler->min_filter;
+		if (valid_filter(sampler->mag_filter, 0))
+			staged->mag_filter = sampler->mag_filter;
+		if (valid_wrap(sampler->wrap_s))
+			staged->wrap_s = sampler->wrap_s;
+		if (valid_wrap(sampler->wrap_t))
+			staged->wrap_t = sampler->wrap_t;
+	}
+}
 
-	if (image == NULL) return 0;
+/*
+ * returns a sampler object with the modes of a staged mesh, reusing the
+ * one created for an earlier texture with the same modes.
+ */
+static GLuint
+load_sampler(const struct staged_mesh *staged)
+{
+	for (size_t i = 0; i < n_samplers; i++) {
+		if (samplers[i].min_filter == staged->min_filter &&
+		    samplers[i].mag_filter == staged->mag_filter &&
+		    samplers[i].wrap_s == staged->wrap_s &&
+		    samplers[i].wrap_t == staged->wrap_t)
+			return samplers[i].ID;
+	}
+
+	samplers[n_samplers].min_filter = staged->min_filter;
+	samplers[n_samplers].mag_filter = staged->mag_filter;
+	samplers[n_samplers].wrap_s = staged->wrap_s;
+	samplers[n_samplers].wrap_t = staged->wrap_t;
+	samplers[n_samplers].ID = create_sampler(staged->min_filter, staged->mag_filter,
+		staged->wrap_s, staged->wrap_t);
+
+	return samplers[n_samplers++].ID;
+}
+
+/*
+ * looks the texture of a staged mesh up before it gets decoded: a cached
+ * one is acquired, and one an earlier mesh of the model decodes is shared
+ * through the cache at upload. returns whether it still needs decoding.
+ */
+int
+stage_texture(struct staged_model *staged, size_t mesh, uint64_t key)
+{
+	struct staged_mesh *staged_mesh = &staged->meshes[mesh];
+
+	staged_mesh->texture_key = key;
+	staged_mesh->texture = acquire_texture(key);
+	if (staged_mesh->texture != 0)
+		return 0;
+
+	for (size_t i = 0; i < mesh; i++) {
+		if (staged->meshes[i].texture_key == key)
+			return 0;
+	}
+	return 1;
+}
 
+/*
+ * decodes the image of a glTF texture and its mips, either from the file
+ * its uri points to, relative to the model, or from its buffer view.
+ */
+static void
+cgltf_load_image(const cgltf_texture *tex, const char *path,
+		struct staged_model *staged, size_t mesh)
+{
+	if (tex == NULL || tex->image == NULL) return;
+
+	cgltf_image *image = tex->image;
 	cgltf_buffer_view *image_view = image->buffer_view;
+	struct image *pixels = &staged->meshes[mesh].image;
+	int decoded = 1;
 
 	if (image->uri != NULL) {
+		const char *dir = strrchr(path, '/');
+		size_t dir_length = dir ? dir - path + 1 : 0;
 
-		char *dir = strrchr(path, '/') + 1;
-		size_t dir_length = dir - path;
+		char *fullpath = malloc(dir_length + strlen(image->uri) + 1);
+		if (fullpath == NULL) {
+			errlog("failed to load the %s image of the %s model.", image->uri, path);
+			exit(1);
+		}
+		memcpy(fullpath, path, dir_length);
+		strcpy(fullpath + dir_length, image->uri);
 
-		char *uri = image->uri;
-		size_t uri_length = strlen(uri);
+		if (stage_texture(staged, mesh, path_key(CACHE_TEXTURE, fullpath)))
+			decoded = load_image(fullpath, pixels);
+		free(fullpath);
+	}
+	else if (image_view != NULL) {
+		const cgltf_buffer *buffer = image_view->buffer;
+		if (buffer->data == NULL || image_view->offset > buffer->size ||
+		    image_view->size > buffer->size - image_view->offset) {
+			errlog("an image of the %s model is out of its buffer.", path);
+			return;
+		}
+		const unsigned char *data = (const unsigned char *) buffer->data + image_view->offset;
 
-		size_t size = dir_length + uri_length;
-		char *fullpath = malloc(size);
-		fullpath[size - 1] = '\0';
+		if (stage_texture(staged, mesh, content_key(CACHE_TEXTURE, data, image_view->size)))
+			decoded = load_image_from_memory(data, image_view->size, pixels);
+	}
 
-		strncpy(fullpath, path, dir_length);
-		strcpy(fullpath + dir_length, uri);
+	if (!decoded)
+		errlog("failed to decode an image of the %s model: %s", path, SOIL_last_result());
+}
 
-		return create_texture(fullpath);
+/*
+ * the texture of a staged mesh, from the cache or uploaded and added to it.
+ * cooked images are compressed already and uploaded whole, decoded ones
+ * are streamed.
+ */
+static GLuint
+upload_staged_texture(const struct staged_model *staged, struct staged_mesh *staged_mesh)
+{
+	struct image *image = &staged_mesh->image;
+
+	if (staged_mesh->texture_key == 0)
+		return 0;
+	if (staged_mesh->texture != 0)
+		return staged_mesh->texture;
+
+	/* shared with an earlier mesh, or loaded by another model meanwhile */
+	GLuint texture = acquire_texture(staged_mesh->texture_key);
+	if (texture != 0) {
+		if (staged->map == NULL)
+			free(image->pixels);
+		return texture;
 	}
-	else if (image_view != NULL) {
+	if (image->pixels == NULL)
+		return 0;
 
-		cgltf_buffer *image_buffer = image_view->buffer;
-		unsigned char *image_buffer_cpy = malloc(image_view->size);
+	size_t bytes = image->size;
+	texture = staged->map != NULL ? upload_texture(image) : stream_texture(image);
+	cache_texture(staged_mesh->texture_key, texture, bytes);
+	return texture;
+}
 
-		size_t n = image_view->offset;
-		int stride = image_view->stride ? image_view->stride : 1;
+static void
+create_geometry(int format)
+{
+	struct geometry *g = &geometry[format];
+
+	glGenBuffers(1, &g->VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, g->VBO);
+	glBufferData(GL_ARRAY_BUFFER, GEOMETRY_VERTICES * vertex_sizes[format], NULL, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	g->vertices_capacity = GEOMETRY_VERTICES;
+
+	for (int type = 0; type < INDEX_TYPES; type++) {
+		glGenVertexArrays(1, &g->VAO[type]);
+		glBindVertexArray(g->VAO[type]);
+
+		glGenBuffers(1, &g->EBO[type]);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g->EBO[type]);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, GEOMETRY_INDICES * index_sizes[type], NULL, GL_STATIC_DRAW);
+		g->indices_capacity[type] = GEOMETRY_INDICES;
+
+		if (format == VERTEX_FLOAT) {
+			glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, offsetof(struct vertex, pos));
+			glVertexAttribFormat(1, 3, GL_FLOAT, GL_FALSE, offsetof(struct vertex, nor));
+			glVertexAttribFormat(2, 2, GL_FLOAT, GL_FALSE, offsetof(struct vertex, uvs));
+			glVertexAttribFormat(3, 4, GL_FLOAT, GL_FALSE, offsetof(struct vertex, col));
+		}
+		else {
+			glVertexAttribFormat(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(struct packed_vertex, pos));
+			glVertexAttribFormat(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, offsetof(struct packed_vertex, nor));
+			glVertexAttribFormat(2, 2, GL_HALF_FLOAT, GL_FALSE, offsetof(struct packed_vertex, uvs));
+			glVertexAttribFormat(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(struct packed_vertex, col));
+		}
 
-		for (size_t i = 0; i < image_view->size; i++) {
-			image_buffer_cpy[i] = ((unsigned char *) image_buffer->data)[n];
-			n += stride;
+		for (int i = 0; i < 4; i++) {
+			glVertexAttribBinding(i, VERTEX_BINDING);
 		}
+		glEnableVertexAttribArray(0); /* position */
+		glEnableVertexAttribArray(1); /* normal */
+		glEnableVertexAttribArray(2); /* textcoord */
+		/* without the array the shader gets the current attribute value, (0, 0, 0, 1) */
+		if (format != VERTEX_PACKED)
+			glEnableVertexAttribArray(3); /* color */
+
+		glBindVertexBuffer(VERTEX_BINDING, g->VBO, 0, vertex_sizes[format]);
+
+		setup_instance_attributes();
+	}
+
+	glBindVertexArray(0);
+}
+
+/* reallocates buffer with a new size, keeping the first used bytes */
+static GLuint
+grow_buffer(GLuint buffer, size_t used, size_t size)
+{
+	GLuint grown;
+	glGenBuffers(1, &grown);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+	glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STATIC_DRAW);
+
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glDeleteBuffers(1, &buffer);
+	return grown;
+}
+
+static void
+remove_range(struct free_ranges *free_ranges, size_t i)
+{
+	memmove(&free_ranges->ranges[i], &free_ranges->ranges[i + 1],
+		(free_ranges->n_ranges - i - 1) * sizeof(free_ranges->ranges[0]));
+	free_ranges->n_ranges--;
+}
 
-		return create_texture_from_memory(image_buffer_cpy, n);
+/* takes n elements from the first free range big enough, returns 0 if there is none */
+static int
+take_range(struct free_ranges *free_ranges, size_t n, size_t *start)
+{
+	for (size_t i = 0; i < free_ranges->n_ranges; i++) {
+		if (free_ranges->ranges[i].n < n)
+			continue;
+
+		*start = free_ranges->ranges[i].start;
+		free_ranges->ranges[i].start += n;
+		free_ranges->ranges[i].n -= n;
+		free_ranges->n_free -= n;
+		if (free_ranges->ranges[i].n == 0)
+			remove_range(free_ranges, i);
+		return 1;
 	}
 	return 0;
 }
 
-struct model
-load_model(const char *path)
+/*
+ * gives back n elements from start of a buffer used up to *used, merging
+ * them with their neighbours. what ends up at the end lowers *used instead.
+ */
+static void
+give_range(struct free_ranges *free_ranges, size_t *used, size_t start, size_t n)
+{
+	if (n == 0)
+		return;
+
+	size_t i = 0;
+	while (i < free_ranges->n_ranges && free_ranges->ranges[i].start < start)
+		i++;
+
+	if (free_ranges->n_ranges == free_ranges->capacity) {
+		size_t capacity = free_ranges->capacity ? free_ranges->capacity * 2 : 16;
+		void *ranges = realloc(free_ranges->ranges, capacity * sizeof(free_ranges->ranges[0]));
+		if (ranges == NULL) {
+			errlog("couldn't keep track of more than %zu free ranges.", free_ranges->n_ranges);
+			exit(1);
+		}
+		free_ranges->ranges = ranges;
+		free_ranges->capacity = capacity;
+	}
+	memmove(&free_ranges->ranges[i + 1], &free_ranges->ranges[i],
+		(free_ranges->n_ranges - i) * sizeof(free_ranges->ranges[0]));
+	free_ranges->ranges[i].start = start;
+	free_ranges->ranges[i].n = n;
+	free_ranges->n_ranges++;
+	free_ranges->n_free += n;
+
+	if (i + 1 < free_ranges->n_ranges &&
+	    start + n == free_ranges->ranges[i + 1].start) {
+		free_ranges->ranges[i].n += free_ranges->ranges[i + 1].n;
+		remove_range(free_ranges, i + 1);
+	}
+	if (i > 0 && free_ranges->ranges[i - 1].start + free_ranges->ranges[i - 1].n == start) {
+		free_ranges->ranges[i - 1].n += free_ranges->ranges[i].n;
+		remove_range(free_ranges, i);
+	}
+
+	size_t last = free_ranges->n_ranges - 1;
+	if (free_ranges->ranges[last].start + free_ranges->ranges[last].n == *used) {
+		*used = free_ranges->ranges[last].start;
+		free_ranges->n_free -= free_ranges->ranges[last].n;
+		free_ranges->n_ranges--;
+	}
+}
+
+/*
+ * reserves room for a mesh in the shared buffers, returning where its
+ * vertices and indices start. ranges given back by geometry_free are
+ * reused first, the buffers double in size when full.
+ */
+void
+geometry_alloc(int format, int index_type, size_t n_vertices, size_t n_indices,
+		GLint *base_vertex, GLuint *first_index)
+{
+	struct geometry *g = &geometry[format];
+
+	if (g->VBO == 0)
+		create_geometry(format);
+
+	size_t start;
+	if (take_range(&g->free_vertices, n_vertices, &start)) {
+		*base_vertex = start;
+	}
+	else {
+		size_t capacity = g->vertices_capacity;
+		while (capacity < g->n_vertices + n_vertices)
+			capacity *= 2;
+		if (capacity != g->vertices_capacity) {
+			g->VBO = grow_buffer(g->VBO,
+				g->n_vertices * vertex_sizes[format],
+				capacity * vertex_sizes[format]);
+			g->vertices_capacity = capacity;
+			for (int type = 0; type < INDEX_TYPES; type++) {
+				glBindVertexArray(g->VAO[type]);
+				glBindVertexBuffer(VERTEX_BINDING, g->VBO, 0, vertex_sizes[format]);
+			}
+			glBindVertexArray(0);
+		}
+		*base_vertex = g->n_vertices;
+		g->n_vertices += n_vertices;
+	}
+
+	if (take_range(&g->free_indices[index_type], n_indices, &start)) {
+		*first_index = start;
+	}
+	else {
+		size_t capacity = g->indices_capacity[index_type];
+		while (capacity < g->n_indices[index_type] + n_indices)
+			capacity *= 2;
+		if (capacity != g->indices_capacity[index_type]) {
+			g->EBO[index_type] = grow_buffer(g->EBO[index_type],
+				g->n_indices[index_type] * index_sizes[index_type],
+				capacity * index_sizes[index_type]);
+			g->indices_capacity[index_type] = capacity;
+			glBindVertexArray(g->VAO[index_type]);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g->EBO[index_type]);
+			glBindVertexArray(0);
+		}
+		*first_index = g->n_indices[index_type];
+		g->n_indices[index_type] += n_indices;
+	}
+}
+
+/* gives the ranges of an uploaded mesh back to the shared buffers */
+void
+geometry_free(const struct mesh *mesh)
+{
+	struct geometry *g = &geometry[mesh->format];
+
+	give_range(&g->free_vertices, &g->n_vertices, mesh->base_vertex, mesh->n_vertices);
+	give_range(&g->free_indices[mesh->index_type], &g->n_indices[mesh->index_type],
+		mesh->first_index, mesh->n_indices);
+}
+
+/* bytes of the shared buffers meshes use, and of the buffers themselves in capacity */
+size_t
+geometry_bytes(size_t *capacity)
+{
+	size_t used = 0;
+
+	*capacity = 0;
+	for (int format = 0; format < VERTEX_FORMATS; format++) {
+		const struct geometry *g = &geometry[format];
+		used += (g->n_vertices - g->free_vertices.n_free) * vertex_sizes[format];
+		*capacity += g->vertices_capacity * vertex_sizes[format];
+		for (int type = 0; type < INDEX_TYPES; type++) {
+			used += (g->n_indices[type] - g->free_indices[type].n_free) * index_sizes[type];
+			*capacity += g->indices_capacity[type] * index_sizes[type];
+		}
+	}
+	return used;
+}
+
+/* IEEE 754 half float, rounded to nearest */
+static GLushort
+float_to_half(float f)
+{
+	union {
+		float f;
+		uint32_t u;
+	} v = { f };
+
+	uint32_t sign = (v.u >> 16) & 0x8000;
+	int32_t exponent = ((v.u >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = v.u & 0x7fffff;
+
+	if (((v.u >> 23) & 0xff) == 0xff)
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0); /* inf or nan */
+	if (exponent >= 31)
+		return sign | 0x7c00;
+	if (exponent <= 0) {
+		if (exponent < -10)
+			return sign;
+		/* subnormal */
+		mantissa |= 0x800000;
+		uint32_t shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return sign | half;
+	}
+
+	uint32_t half = sign | exponent << 10 | mantissa >> 13;
+	if (mantissa & 0x1000)
+		half++; /* may carry into the exponent, which is still correct */
+	return half;
+}
+
+static GLint
+snorm10(float f)
+{
+	f = f < -1.0f ? -1.0f : f > 1.0f ? 1.0f : f;
+	return (GLint) lroundf(f * 511.0f) & 0x3ff;
+}
+
+static GLubyte
+unorm8(float f)
+{
+	f = f < 0.0f ? 0.0f : f > 1.0f ? 1.0f : f;
+	return lroundf(f * 255.0f);
+}
+
+/* the glTF attributes a mesh's vertices are read from */
+struct vertex_source {
+	const char *pos, *nor, *uvs, *col;
+	size_t pos_stride, nor_stride, uvs_stride, col_stride;
+};
+
+static void
+read_vertex(const struct vertex_source *src, size_t vi, struct vertex *vertex)
 {
+	memcpy(vertex->pos, src->pos + src->pos_stride * vi, sizeof(vec3));
+
+	if (src->nor != NULL)
+		memcpy(vertex->nor, src->nor + src->nor_stride * vi, sizeof(vec3));
+	else
+		glm_vec3_zero(vertex->nor);
+	if (src->uvs != NULL)
+		memcpy(vertex->uvs, src->uvs + src->uvs_stride * vi, sizeof(vec2));
+	else
+		vertex->uvs[0] = vertex->uvs[1] = 0.0f;
+	if (src->col != NULL)
+		memcpy(vertex->col, src->col + src->col_stride * vi, sizeof(vec4));
+	else
+		glm_vec4_zero(vertex->col);
+}
+
+static void
+pack_vertex(const struct vertex *vertex, const vec3 min, const vec3 scale,
+		struct packed_vertex *packed)
+{
+	for (int i = 0; i < 3; i++) {
+		float q = (vertex->pos[i] - min[i]) * scale[i];
+		packed->pos[i] = q < 0.0f ? 0 : q > 65535.0f ? 65535 : lroundf(q);
+	}
+	packed->pos[3] = 0;
+	packed->nor = snorm10(vertex->nor[0]) |
+		snorm10(vertex->nor[1]) << 10 |
+		snorm10(vertex->nor[2]) << 20;
+	packed->uvs[0] = float_to_half(vertex->uvs[0]);
+	packed->uvs[1] = float_to_half(vertex->uvs[1]);
+	for (int i = 0; i < 4; i++)
+		packed->col[i] = unorm8(vertex->col[i]);
+}
+
+/*
+ * interleaves the vertices of a mesh into dst, converting them to the
+ * mesh's format on the way, and keeps a float copy in mesh->vertices when
+ * keep is set.
+ */
+static void
+write_vertices(struct mesh *mesh, const struct vertex_source *src,
+		unsigned char *dst, int keep)
+{
+	size_t stride = vertex_sizes[mesh->format];
+
+	vec3 scale;
+	for (int i = 0; i < 3; i++) {
+		float extent = mesh->max[i] - mesh->min[i];
+		scale[i] = extent > 0.0f ? 65535.0f / extent : 0.0f;
+	}
+
+	if (keep) {
+		mesh->vertices = calloc(mesh->n_vertices, sizeof(struct vertex));
+		if (mesh->vertices == NULL) {
+			errlog("couldn't keep %zu vertices in memory.", mesh->n_vertices);
+			exit(1);
+		}
+	}
+
+	for (size_t vi = 0; vi < mesh->n_vertices; vi++) {
+		struct vertex vertex;
+		read_vertex(src, vi, &vertex);
+
+		if (mesh->format == VERTEX_FLOAT) {
+			memcpy(dst + vi * stride, &vertex, stride);
+		}
+		else {
+			struct packed_vertex packed;
+			pack_vertex(&vertex, mesh->min, scale, &packed);
+			memcpy(dst + vi * stride, &packed, stride);
+		}
+
+		if (keep)
+			mesh->vertices[vi] = vertex;
+	}
+}
+
+/*
+ * model space bounding box and sphere of a mesh. the box comes from the
+ * position accessor when the exporter filled in its min and max.
+ */
+static void
+compute_bounds(struct mesh *mesh, const struct vertex_source *src,
+		const cgltf_accessor *positions)
+{
+	vec3 pos;
+
+	if (positions->has_min && positions->has_max) {
+		glm_vec3_copy((float *) positions->min, mesh->min);
+		glm_vec3_copy((float *) positions->max, mesh->max);
+	}
+	else {
+		memcpy(mesh->min, src->pos, sizeof(vec3));
+		memcpy(mesh->max, src->pos, sizeof(vec3));
+		for (size_t i = 1; i < mesh->n_vertices; i++) {
+			memcpy(pos, src->pos + src->pos_stride * i, sizeof(vec3));
+			glm_vec3_minv(mesh->min, pos, mesh->min);
+			glm_vec3_maxv(mesh->max, pos, mesh->max);
+		}
+	}
+
+	glm_vec3_center(mesh->min, mesh->max, mesh->center);
+
+	float radius2 = 0.0f;
+	for (size_t i = 0; i < mesh->n_vertices; i++) {
+		memcpy(pos, src->pos + src->pos_stride * i, sizeof(vec3));
+		float distance2 = glm_vec3_distance2(mesh->center, pos);
+		if (distance2 > radius2)
+			radius2 = distance2;
+	}
+	mesh->radius = sqrtf(radius2);
+}
+
+/*
+ * simplifies the staged indices of a mesh into coarser levels, each aiming
+ * at half the triangles of the level before, and appends them to the
+ * staged indices. stops once a level no longer saves enough.
+ */
+static void
+build_lods(struct mesh *mesh, struct staged_mesh *staged_mesh, const struct vertex_source *src)
+{
+	while (mesh->n_lods < MAX_LODS) {
+		const struct lod *previous = &mesh->lods[mesh->n_lods - 1];
+		if (previous->n_indices / 3 < LOD_MIN_TRIANGLES)
+			break;
+
+		GLuint *indices = realloc(staged_mesh->indices,
+			(mesh->n_indices + previous->n_indices) * sizeof(GLuint));
+		if (indices == NULL) {
+			errlog("couldn't simplify a %zu index mesh.", mesh->n_indices);
+			exit(1);
+		}
+		staged_mesh->indices = indices;
+
+		float error;
+		size_t n = simplify(indices + mesh->n_indices, indices + previous->offset,
+			previous->n_indices, src->pos, src->pos_stride, mesh->n_vertices,
+			previous->n_indices / 6 * 3, &error);
+		if (n > previous->n_indices * LOD_MAX_RATIO)
+			break;
+
+		struct lod *lod = &mesh->lods[mesh->n_lods++];
+		lod->offset = mesh->n_indices;
+		lod->n_indices = n;
+		/* simplified from the level before, so the errors add up */
+		lod->error = previous->error + error;
+		mesh->n_indices += n;
+	}
+}
+
+/*
+ * reorders the triangles of every level of a mesh for the vertex cache,
+ * then for overdraw, and its vertices in the order they are first used,
+ * dropping unused ones. the indices shrink to 16 bits when they fit. the
+ * reordered vertices and indices are written straight to the staging ring
+ * when it has room, for the GL thread to copy on the GPU. the ACMR and
+ * ATVR of the full detail level are reported before and after.
+ */
+static void
+optimize_mesh(struct mesh *mesh, struct staged_mesh *staged_mesh,
+		const struct vertex_source *src, const char *path, size_t index)
+{
+	GLuint *indices = staged_mesh->indices;
+	size_t n_triangles = mesh->lods[0].n_indices / 3;
+	if (n_triangles == 0)
+		return;
+
+	size_t misses_before = cache_misses(indices, mesh->lods[0].n_indices, mesh->n_vertices);
+	for (int l = 0; l < mesh->n_lods; l++) {
+		GLuint *lod = indices + mesh->lods[l].offset;
+		optimize_vertex_cache(lod, mesh->lods[l].n_indices, mesh->n_vertices);
+		optimize_overdraw(lod, mesh->lods[l].n_indices, src->pos, src->pos_stride,
+			mesh->n_vertices);
+	}
+	size_t misses_after = cache_misses(indices, mesh->lods[0].n_indices, mesh->n_vertices);
+
+	/* the coarser levels only use vertices of the first one, numbered first */
+	size_t vertex_size = vertex_sizes[mesh->format];
+	GLuint *remap = malloc(mesh->n_vertices * sizeof(GLuint));
+	if (remap == NULL) {
+		errlog("failed to optimize a mesh of the %s model.", path);
+		exit(1);
+	}
+	size_t n_vertices = optimize_vertex_fetch(remap, indices, mesh->n_indices, mesh->n_vertices);
+	mesh->index_type = n_vertices < 0x10000 ? INDEX_16 : INDEX_32;
+
+	size_t vertex_bytes = n_vertices * vertex_size;
+	size_t index_bytes = mesh->n_indices * index_sizes[mesh->index_type];
+	unsigned char *ring = staging_alloc(vertex_bytes + index_bytes, &staged_mesh->staging_offset);
+	staged_mesh->in_staging = ring != NULL;
+	void *vertices = ring ? ring : malloc(vertex_bytes);
+	void *narrow = ring ? ring + vertex_bytes : (void *) indices;
+	if (mesh->index_type == INDEX_16 && ring == NULL)
+		narrow = malloc(index_bytes);
+	if (vertices == NULL || narrow == NULL) {
+		errlog("failed to optimize a mesh of the %s model.", path);
+		exit(1);
+	}
+	remap_vertices(vertices, staged_mesh->vertices, mesh->n_vertices, vertex_size, remap);
+	free(staged_mesh->vertices);
+	staged_mesh->vertices = vertices;
+
+	if (mesh->vertices != NULL) {
+		struct vertex *kept = malloc(n_vertices * sizeof(struct vertex));
+		if (kept == NULL) {
+			errlog("failed to optimize a mesh of the %s model.", path);
+			exit(1);
+		}
+		remap_vertices(kept, mesh->vertices, mesh->n_vertices, sizeof(struct vertex), remap);
+		free(mesh->vertices);
+		mesh->vertices = kept;
+	}
+	free(remap);
+	mesh->n_vertices = n_vertices;
+
+	if (mesh->index_type == INDEX_16) {
+		for (size_t i = 0; i < mesh->n_indices; i++)
+			((GLushort *) narrow)[i] = indices[i];
+	}
+	else if (narrow != indices) {
+		memcpy(narrow, indices, index_bytes);
+	}
+	if (narrow != indices) {
+		free(indices);
+		staged_mesh->indices = narrow;
+	}
+
+	/* on stderr, stdout is left to what tools parse */
+	fprintf(stderr,
+		"%s: mesh %zu, %zu triangles, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, %d bit indices\n",
+		path, index, n_triangles,
+		(double) misses_before / n_triangles, (double) misses_after / n_triangles,
+		(double) misses_before / n_vertices, (double) misses_after / n_vertices,
+		mesh->index_type == INDEX_16 ? 16 : 32);
+}
+
+/*
+ * parses a model and decodes everything it needs on the CPU, without any
+ * GL calls, so it can run on a loader thread.
+ */
+void
+stage_model(struct staged_model *staged, const char *path, int flags)
+{
+	PROFILE_BEGIN(stage_model);
+	if (is_pack(path)) {
+		stage_pack(staged, path);
+		PROFILE_END(stage_model);
+		return;
+	}
+
 	struct model model = { 0 };
 
+	/*
+	 * parsed in place, so the binary chunk of a .glb, and the images
+	 * embedded in it, are read and decoded straight from the mapping.
+	 */
+	size_t file_size;
+	const void *file = map_file(path, &file_size);
+	if (file == NULL) {
+		errlog("failed to open the %s model.", path);
+		exit(1);
+	}
+
 	cgltf_options options = { 0 };
 	cgltf_data *data = NULL;
-	cgltf_result result = cgltf_parse_file(&options, path, &data);
+	cgltf_result result = cgltf_parse(&options, file, file_size, &data);
 	if (result != cgltf_result_success) {
 		errlog("failed to load the %s model.", path);
 		exit(1);
@@ -85,7 +814,8 @@ load_model(const char *path)
 
 	model.meshes = calloc(model.n_meshes, sizeof(struct mesh));
 	struct mesh *meshes = model.meshes;
-	if (meshes == NULL) {
+	staged->meshes = calloc(model.n_meshes, sizeof(struct staged_mesh));
+	if (meshes == NULL || staged->meshes == NULL) {
 		errlog("failed to load the %s model.", path);
 		exit(1);
 	}
@@ -94,13 +824,10 @@ load_model(const char *path)
 	for (size_t mi = 0; mi < data->meshes_count; mi++) {
 		for (size_t pi = 0; pi < data->meshes[mi].primitives_count; pi++) {
 			struct mesh *mesh = meshes + mesh_index;
+			struct staged_mesh *staged_mesh = staged->meshes + mesh_index;
 			cgltf_primitive primitive = data->meshes[mi].primitives[pi];
 
-			/* bind VAO */
-			glGenVertexArrays(1, &mesh->VAO);
-			glBindVertexArray(mesh->VAO);
-
-			/* load mesh indices */
+			/* check the mesh indices */
 			cgltf_accessor *indices_accessor = primitive.indices;
 			if (indices_accessor->type != cgltf_type_scalar) {
 				errlog(
@@ -110,41 +837,11 @@ load_model(const char *path)
 				exit(1);
 			}
 
-			switch (indices_accessor->component_type) {
-				case cgltf_component_type_r_16u:
-					mesh->index_type = GL_UNSIGNED_SHORT;
-					break;
-				case cgltf_component_type_r_32u:
-					mesh->index_type = GL_UNSIGNED_INT;
-					break;
-				default:
-					mesh->index_type = GL_UNSIGNED_BYTE;
-					break;
-			}
-
-			cgltf_buffer_view *indices_view = indices_accessor->buffer_view;
-			cgltf_buffer *indices_buffer = indices_view->buffer;
-
-			glGenBuffers(1, &mesh->EBO);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->EBO);
-			glBufferData(
-				GL_ELEMENT_ARRAY_BUFFER,
-				indices_view->size,
-				(char *) indices_buffer->data + indices_view->offset,
-				GL_STATIC_DRAW
-			);
-
 			mesh->n_indices = indices_accessor->count;
 
 			/* load buffers */
-			char *pos_buffer = NULL;
-			char *nor_buffer = NULL;
-			char *uvs_buffer = NULL;
-			char *col_buffer = NULL;
-			size_t pos_stride = 0;
-			size_t nor_stride = 0;
-			size_t uvs_stride = 0;
-			size_t col_stride = 0;
+			cgltf_accessor *pos_accessor = NULL;
+			struct vertex_source src = { 0 };
 
 			for (size_t ai = 0; ai < primitive.attributes_count; ai++) {
 				cgltf_attribute attribute = primitive.attributes[ai];
@@ -175,8 +872,9 @@ load_model(const char *path)
 						exit(1);
 					}
 
-					pos_buffer = (char *) attr_buffer->data + attr_view->offset;
-					pos_stride = attr_accessor->stride;
+					src.pos = (char *) attr_buffer->data + attr_view->offset + attr_accessor->offset;
+					src.pos_stride = attr_accessor->stride;
+					pos_accessor = attr_accessor;
 					mesh->n_vertices = attr_accessor->count;
 					break;
 				case cgltf_attribute_type_color:
@@ -189,8 +887,8 @@ load_model(const char *path)
 						exit(1);
 					}
 
-					col_buffer = (char *) attr_buffer->data + attr_view->offset;
-					col_stride = attr_accessor->stride;
+					src.col = (char *) attr_buffer->data + attr_view->offset + attr_accessor->offset;
+					src.col_stride = attr_accessor->stride;
 					break;
 				case cgltf_attribute_type_texcoord:
 					if (attr_accessor->type != cgltf_type_vec2) {
@@ -202,8 +900,8 @@ load_model(const char *path)
 						exit(1);
 					}
 
-					uvs_buffer = (char *) attr_buffer->data + attr_view->offset;
-					uvs_stride = attr_accessor->stride;
+					src.uvs = (char *) attr_buffer->data + attr_view->offset + attr_accessor->offset;
+					src.uvs_stride = attr_accessor->stride;
 					break;
 				case cgltf_attribute_type_normal:
 					if (attr_accessor->type != cgltf_type_vec3) {
@@ -215,8 +913,8 @@ load_model(const char *path)
 						exit(1);
 					}
 
-					nor_buffer = (char *) attr_buffer->data + attr_view->offset;
-					nor_stride = attr_accessor->stride;
+					src.nor = (char *) attr_buffer->data + attr_view->offset + attr_accessor->offset;
+					src.nor_stride = attr_accessor->stride;
 					break;
 				default:
 					errlog(
@@ -228,168 +926,192 @@ load_model(const char *path)
 				}
 			}
 
-			if (pos_buffer == NULL) {
+			if (src.pos == NULL) {
 				errlog("there are no positions for the vertices.");
 				exit(1);
 			}
 
-			mesh->vertices = calloc(mesh->n_vertices, sizeof(struct vertex));
-			for (size_t vi = 0; vi < mesh->n_vertices; vi++) {
-				struct vertex *vertex = &mesh->vertices[vi];
+			compute_bounds(mesh, &src, pos_accessor);
 
-				vertex->pos[0] = *((float *) (pos_buffer + pos_stride * vi));
-				vertex->pos[1] = *((float *) (pos_buffer + pos_stride * vi + sizeof(float)));
-				vertex->pos[2] = *((float *) (pos_buffer + pos_stride * vi + 2 * sizeof(float)));
-
-				if (nor_buffer != NULL) {
-					vertex->nor[0] = *((float *) (nor_buffer + nor_stride * vi));
-					vertex->nor[1] = *((float *) (nor_buffer + nor_stride * vi + sizeof(float)));
-					vertex->nor[2] = *((float *) (nor_buffer + nor_stride * vi + 2 * sizeof(float)));
-				}
-				if (uvs_buffer != NULL) {
-					vertex->uvs[0] = *((float *) (uvs_buffer + uvs_stride * vi));
-					vertex->uvs[1] = *((float *) (uvs_buffer + uvs_stride * vi + sizeof(float)));
-				}
-				if (col_buffer != NULL) {
-					vertex->col[0] = *((float *) (col_buffer + col_stride * vi));
-					vertex->col[1] = *((float *) (col_buffer + col_stride * vi + sizeof(float)));
-					vertex->col[2] = *((float *) (col_buffer + col_stride * vi + 2 * sizeof(float)));
-					vertex->col[3] = *((float *) (col_buffer + col_stride * vi + 3 * sizeof(float)));
-				}
+			if (flags & LOAD_QUANTIZE) {
+				mesh->format = src.col ? VERTEX_PACKED_COLOR : VERTEX_PACKED;
+			}
+			else {
+				mesh->format = VERTEX_FLOAT;
 			}
 
-			glGenBuffers(1, &mesh->VBO);
-			glBindBuffer(GL_ARRAY_BUFFER, mesh->VBO);
-			glBufferData(GL_ARRAY_BUFFER, mesh->n_vertices * sizeof(struct vertex), mesh->vertices, GL_STATIC_DRAW);
-
-			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
-			(void *) offsetof(struct vertex, pos));
-			glEnableVertexAttribArray(0); /* position */
+			size_t vertex_size = vertex_sizes[mesh->format];
+			staged_mesh->vertices = malloc(mesh->n_vertices * vertex_size);
+			GLuint *indices = malloc(mesh->n_indices * sizeof(GLuint));
+			if (staged_mesh->vertices == NULL || indices == NULL) {
+				errlog("failed to stage the geometry of the %s model.", path);
+				exit(1);
+			}
+			staged_mesh->indices = indices;
 
-			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
-			(void *) offsetof(struct vertex, nor));
-			glEnableVertexAttribArray(1); /* normal */
+			write_vertices(mesh, &src, staged_mesh->vertices, flags & LOAD_KEEP_VERTICES);
 
-			glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
-			(void *) offsetof(struct vertex, uvs));
-			glEnableVertexAttribArray(2); /* textcoord */
+			/* read as 32 bit whatever the model uses, optimize_mesh narrows them */
+			for (size_t ii = 0; ii < mesh->n_indices; ii++) {
+				indices[ii] = cgltf_accessor_read_index(indices_accessor, ii);
+			}
 
-			glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
-			(void *) offsetof(struct vertex, col));
-			glEnableVertexAttribArray(3); /* color */
+			mesh->lods[0].offset = 0;
+			mesh->lods[0].n_indices = mesh->n_indices;
+			mesh->lods[0].error = 0.0f;
+			mesh->n_lods = 1;
+			if (flags & LOAD_LODS)
+				build_lods(mesh, staged_mesh, &src);
+			optimize_mesh(mesh, staged_mesh, &src, path, mesh_index);
 
-			/* load diffuse and specular textures */
+			/* decode the diffuse texture, unless it is cached or shared */
 			if (primitive.material == NULL) {
-				mesh->diffuse = SOIL_load_OGL_texture(
-					"img/err.bmp",
-					SOIL_LOAD_RGB,
-					SOIL_CREATE_NEW_ID,
-					SOIL_FLAG_MIPMAPS
-				);
+				if (stage_texture(staged, mesh_index, path_key(CACHE_TEXTURE, ERROR_TEXTURE)))
+					load_image(ERROR_TEXTURE, &staged_mesh->image);
+				cgltf_sampler_modes(NULL, staged_mesh);
 				mesh->culling = 0;
+				mesh->alpha_mode = ALPHA_OPAQUE;
 			}
 			else {
 				cgltf_material *material = primitive.material;
 				cgltf_texture *tex = material->pbr_metallic_roughness.base_color_texture.texture;
 
-				mesh->diffuse = cgltf_load_texture(tex, path);
+				cgltf_load_image(tex, path, staged, mesh_index);
+				cgltf_sampler_modes(tex ? tex->sampler : NULL, staged_mesh);
 				mesh->culling = !material->double_sided;
+				mesh->alpha_mode = material->alpha_mode == cgltf_alpha_mode_opaque ?
+					ALPHA_OPAQUE : ALPHA_MASK;
 			}
 			mesh_index++;
 		}
 	}
 
-	glBindVertexArray(0);
 	cgltf_free(data);
-	return model;
+	unmap_file(file, file_size);
+	PROFILE_END(stage_model);
+	staged->model = model;
+	staged->n_uploaded = 0;
+	staged->map = NULL;
+	staged->map_size = 0;
 }
 
-void
-render_model(const struct model model, const GLuint shader_program, mat4 model_matrix)
+/*
+ * copies data into a range of the buffer bound to target through a mapping,
+ * the range is invalidated so the driver doesn't keep what was there.
+ */
+static void
+write_mapped(GLenum target, size_t offset, size_t size, const void *data)
 {
-	mat4 normal_matrix4;
-	mat3 normal_matrix;
-	glm_mat4_inv(model_matrix, normal_matrix4);
-	glm_mat4_pick3t(normal_matrix4, normal_matrix);
-
-	mat4 transformation_matrix;
-	glm_mat4_mul(game.cam.view,       model_matrix, transformation_matrix);
-	glm_mat4_mul(game.cam.projection, transformation_matrix, transformation_matrix);
-
-	float material_shininess = 128.0f;
-
-	GLuint u_model          = glGetUniformLocation(shader_program, "u_model");
-	GLuint u_normal         = glGetUniformLocation(shader_program, "u_normal");
-	GLuint u_transformation = glGetUniformLocation(shader_program, "u_transformation");
-
-	GLuint u_material_diffuse   = glGetUniformLocation(shader_program, "u_material.diffuse");
-	GLuint u_material_specular  = glGetUniformLocation(shader_program, "u_material.specular");
-	GLuint u_material_shininess = glGetUniformLocation(shader_program, "u_material.shininess");
-
-	GLuint u_dir_light_direction = glGetUniformLocation(shader_program, "u_dir_light.direction");
-	GLuint u_dir_light_ambient   = glGetUniformLocation(shader_program, "u_dir_light.ambient");
-	GLuint u_dir_light_diffuse   = glGetUniformLocation(shader_program, "u_dir_light.diffuse");
-	GLuint u_dir_light_specular  = glGetUniformLocation(shader_program, "u_dir_light.specular");
-
-	GLuint u_pos_light_position  = glGetUniformLocation(shader_program, "u_pos_lights[0].position");
-	GLuint u_pos_light_ambient   = glGetUniformLocation(shader_program, "u_pos_lights[0].ambient");
-	GLuint u_pos_light_diffuse   = glGetUniformLocation(shader_program, "u_pos_lights[0].diffuse");
-	GLuint u_pos_light_specular  = glGetUniformLocation(shader_program, "u_pos_lights[0].specular");
-	GLuint u_pos_light_linear    = glGetUniformLocation(shader_program, "u_pos_lights[0].linear");
-	GLuint u_pos_light_quadratic = glGetUniformLocation(shader_program, "u_pos_lights[0].quadratic");
-
-	GLuint u_camera_position = glGetUniformLocation(shader_program, "u_camera_position");
-
-	glUseProgram(shader_program);
-
-	glUniformMatrix4fv(u_model,          1, GL_FALSE, *model_matrix);
-	glUniformMatrix3fv(u_normal,         1, GL_FALSE, *normal_matrix);
-	glUniformMatrix4fv(u_transformation, 1, GL_FALSE, *transformation_matrix);
-
-	glUniform1i(u_material_diffuse, 0);
-	glUniform1i(u_material_specular, 1);
-	glUniform1f(u_material_shininess, material_shininess);
-
-	glUniform3fv(u_dir_light_direction, 1, dir_light.dir);
-	glUniform3fv(u_dir_light_ambient,   1, dir_light.ambient);
-	glUniform3fv(u_dir_light_diffuse,   1, dir_light.diffuse);
-	glUniform3fv(u_dir_light_specular,  1, dir_light.specular);
-
-	glUniform3fv(u_pos_light_position, 1, pos_lights[0].pos);
-	glUniform3fv(u_pos_light_ambient,  1, pos_lights[0].ambient);
-	glUniform3fv(u_pos_light_diffuse,  1, pos_lights[0].diffuse);
-	glUniform3fv(u_pos_light_specular, 1, pos_lights[0].specular);
-	glUniform1f(u_pos_light_linear,       pos_lights[0].linear);
-	glUniform1f(u_pos_light_quadratic,    pos_lights[0].quadratic);
-
-	glUniform3fv(u_camera_position, 1, game.cam.pos);
-
-	for (int i = 0; i < model.n_meshes; i++) {
-		glBindVertexArray(model.meshes[i].VAO);
-
-		glActiveTexture(GL_TEXTURE0);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-		glBindTexture(GL_TEXTURE_2D, model.meshes[i].diffuse);
-
-		/*
-		glActiveTexture(GL_TEXTURE1);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-		glBindTexture(GL_TEXTURE_2D, model.meshes[i].specular);
-		*/
-	
-		if (model.meshes[i].culling) {
-			glEnable(GL_CULL_FACE);
+	/* mapping nothing is an error */
+	if (size == 0)
+		return;
+
+	void *dst = glMapBufferRange(target, offset, size,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	if (dst == NULL) {
+		errlog("couldn't map the mesh buffer.");
+		exit(1);
+	}
+
+	memcpy(dst, data, size);
+
+	if (glUnmapBuffer(target) == GL_FALSE) {
+		errlog("the mesh buffer was corrupted while writing to it.");
+		exit(1);
+	}
+}
+
+/*
+ * copies the next staged mesh of a model to the shared buffers and creates
+ * its texture, releasing its staging memory. returns how many meshes are
+ * left, the model is ready when none are.
+ */
+size_t
+upload_staged_mesh(struct staged_model *staged)
+{
+	if (staged->n_uploaded < staged->model.n_meshes) {
+		PROFILE_BEGIN(upload_mesh);
+		struct mesh *mesh = &staged->model.meshes[staged->n_uploaded];
+		struct staged_mesh *staged_mesh = &staged->meshes[staged->n_uploaded];
+		struct geometry *g = &geometry[mesh->format];
+		size_t vertex_size = vertex_sizes[mesh->format];
+		size_t index_size = index_sizes[mesh->index_type];
+
+		geometry_alloc(mesh->format, mesh->index_type, mesh->n_vertices, mesh->n_indices,
+			&mesh->base_vertex, &mesh->first_index);
+
+		size_t vertex_bytes = mesh->n_vertices * vertex_size;
+		size_t index_bytes = mesh->n_indices * index_size;
+		if (staged_mesh->in_staging) {
+			/* the loader thread wrote them to the ring, the GPU copies them over */
+			glBindBuffer(GL_COPY_READ_BUFFER, staging.buffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, g->VBO);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+				staged_mesh->staging_offset, mesh->base_vertex * vertex_size, vertex_bytes);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, g->EBO[mesh->index_type]);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+				staged_mesh->staging_offset + vertex_bytes, mesh->first_index * index_size,
+				index_bytes);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+			staging_copied(staged_mesh->staging_offset);
 		}
 		else {
-			glDisable(GL_CULL_FACE);
+			glBindBuffer(GL_ARRAY_BUFFER, g->VBO);
+			write_mapped(GL_ARRAY_BUFFER, mesh->base_vertex * vertex_size,
+				vertex_bytes, staged_mesh->vertices);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			glBindBuffer(GL_COPY_WRITE_BUFFER, g->EBO[mesh->index_type]);
+			write_mapped(GL_COPY_WRITE_BUFFER, mesh->first_index * index_size,
+				index_bytes, staged_mesh->indices);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 		}
 
-		glDrawElements(GL_TRIANGLES, model.meshes[i].n_indices, model.meshes[i].index_type, 0);
+		mesh->sampler = load_sampler(staged_mesh);
+		mesh->diffuse = upload_staged_texture(staged, staged_mesh);
+		mesh->diffuse_key = mesh->diffuse ? staged_mesh->texture_key : 0;
+
+		/* cooked meshes point into the pack */
+		if (staged->map == NULL && !staged_mesh->in_staging) {
+			free(staged_mesh->vertices);
+			free(staged_mesh->indices);
+		}
+		staged->n_uploaded++;
+		PROFILE_END(upload_mesh);
 	}
 
-	glBindVertexArray(0);
+	if (staged->n_uploaded == staged->model.n_meshes) {
+		if (staged->map != NULL)
+			unmap_pack(staged);
+		free(staged->meshes);
+		staged->meshes = NULL;
+		staged->model.ready = 1;
+	}
+	return staged->model.n_meshes - staged->n_uploaded;
+}
+
+uint64_t
+model_key(const char *path, int flags)
+{
+	return hash_bytes(path_key(CACHE_MODEL, path), &flags, sizeof(flags));
+}
+
+/* loads a model on the calling thread, or shares the cached one */
+struct model
+load_model(const char *path, int flags)
+{
+	uint64_t key = model_key(path, flags);
+	struct staged_model staged;
+
+	if (acquire_model(key, &staged.model))
+		return staged.model;
+
+	PROFILE_BEGIN(load_model);
+	stage_model(&staged, path, flags);
+	while (upload_staged_mesh(&staged) > 0)
+		;
+	cache_model(key, &staged.model);
+	PROFILE_END(load_model);
+	return staged.model;
 }
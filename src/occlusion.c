@@ -0,0 +1,178 @@
+/* See LICENSE for license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "models.h"
+#include "culling.h"
+#include "bvh.h"
+#include "render.h"
+#include "occlusion.h"
+
+/* work group sizes of shaders/hiz.cs.glsl and shaders/occlusion.cs.glsl */
+#define PYRAMID_GROUP 8
+#define CULL_GROUP 64
+
+void
+create_occlusion(struct occlusion *occlusion)
+{
+	memset(occlusion, 0, sizeof(struct occlusion));
+
+	occlusion->first_level = load_compute_program("shaders/hiz.cs.glsl", "#define FIRST_LEVEL\n");
+	occlusion->reduce = load_compute_program("shaders/hiz.cs.glsl", NULL);
+	occlusion->cull = load_compute_program("shaders/occlusion.cs.glsl", NULL);
+}
+
+/* (re)creates the depth copy and the pyramid for a viewport size */
+static void
+create_pyramid(struct occlusion *occlusion, int width, int height)
+{
+	if (occlusion->depth != 0) {
+		glDeleteTextures(1, &occlusion->depth);
+		glDeleteTextures(1, &occlusion->pyramid);
+	}
+
+	occlusion->width = width;
+	occlusion->height = height;
+	occlusion->levels = 1;
+	while (mip_size(width, occlusion->levels - 1) > 1 || mip_size(height, occlusion->levels - 1) > 1)
+		occlusion->levels++;
+
+	glGenTextures(1, &occlusion->depth);
+	glBindTexture(GL_TEXTURE_2D, occlusion->depth);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, width, height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glGenTextures(1, &occlusion->pyramid);
+	glBindTexture(GL_TEXTURE_2D, occlusion->pyramid);
+	glTexStorage2D(GL_TEXTURE_2D, occlusion->levels, GL_R32F, width, height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/*
+ * copies the depth buffer of the frame just drawn and reduces it level by
+ * level, for the next frame to cull against.
+ */
+void
+build_depth_pyramid(struct occlusion *occlusion)
+{
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	if (viewport[2] != occlusion->width || viewport[3] != occlusion->height)
+		create_pyramid(occlusion, viewport[2], viewport[3]);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, occlusion->depth);
+	glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1],
+		viewport[2], viewport[3]);
+
+	finish_program(&occlusion->first_level);
+	finish_program(&occlusion->reduce);
+	glUseProgram(occlusion->first_level.ID);
+	glBindImageTexture(1, occlusion->pyramid, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+	glDispatchCompute((occlusion->width + PYRAMID_GROUP - 1) / PYRAMID_GROUP,
+		(occlusion->height + PYRAMID_GROUP - 1) / PYRAMID_GROUP, 1);
+
+	glUseProgram(occlusion->reduce.ID);
+	for (int level = 1; level < occlusion->levels; level++) {
+		int width = mip_size(occlusion->width, level);
+		int height = mip_size(occlusion->height, level);
+
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		glBindImageTexture(0, occlusion->pyramid, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+		glBindImageTexture(1, occlusion->pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute((width + PYRAMID_GROUP - 1) / PYRAMID_GROUP,
+			(height + PYRAMID_GROUP - 1) / PYRAMID_GROUP, 1);
+	}
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glUseProgram(0);
+
+	glm_mat4_mul(game.cam.projection, game.cam.view, occlusion->view_projection);
+	occlusion->ready = 1;
+}
+
+/*
+ * tests the n visible instances in the instances buffer against the
+ * pyramid. the commands drawing them are uploaded with no instances, and
+ * the shader adds back the ones that may be visible, so both can be drawn
+ * from with the batches built for the unculled commands.
+ */
+void
+cull_occluded(struct occlusion *occlusion, GLuint instances,
+		const struct occlusion_box *boxes, size_t n_instances,
+		struct draw_command *commands, size_t n_commands)
+{
+	static const GLuint zero = 0;
+
+	for (size_t i = 0; i < n_commands; i++)
+		commands[i].instance_count = 0;
+
+	stream_buffer(GL_SHADER_STORAGE_BUFFER, &occlusion->boxes, &occlusion->boxes_size,
+		boxes, n_instances * sizeof(struct occlusion_box));
+	stream_buffer(GL_SHADER_STORAGE_BUFFER, &occlusion->commands, &occlusion->commands_size,
+		commands, n_commands * sizeof(struct draw_command));
+	stream_buffer(GL_SHADER_STORAGE_BUFFER, &occlusion->counters, &occlusion->counters_size,
+		&zero, sizeof(zero));
+
+	size_t size = n_instances * sizeof(struct instance);
+	if (occlusion->instances == 0)
+		glGenBuffers(1, &occlusion->instances);
+	if (size > occlusion->instances_size) {
+		if (occlusion->instances_size == 0)
+			occlusion->instances_size = 64 * sizeof(struct instance);
+		while (occlusion->instances_size < size)
+			occlusion->instances_size *= 2;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion->instances);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, occlusion->instances_size, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_BOXES_BUFFER, occlusion->boxes);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCES_BUFFER, instances);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLED_INSTANCES_BUFFER, occlusion->instances);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLED_COMMANDS_BUFFER, occlusion->commands);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_COUNTERS_BUFFER, occlusion->counters);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, occlusion->pyramid);
+
+	finish_program(&occlusion->cull);
+	glUseProgram(occlusion->cull.ID);
+	glUniformMatrix4fv(occlusion->cull.uniforms[U_VIEW_PROJECTION], 1, GL_FALSE,
+		(float *) occlusion->view_projection);
+	glUniform1ui(occlusion->cull.uniforms[U_COUNT], n_instances);
+	glDispatchCompute((n_instances + CULL_GROUP - 1) / CULL_GROUP, 1, 1);
+
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+		GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glUseProgram(0);
+}
+
+/* how many instances the last cull_occluded rejected, waiting for the GPU to get there */
+unsigned int
+read_occluded(const struct occlusion *occlusion)
+{
+	GLuint occluded = 0;
+	if (occlusion->counters == 0)
+		return 0;
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion->counters);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(occluded), &occluded);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return occluded;
+}
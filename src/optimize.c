@@ -0,0 +1,355 @@
+/* See LICENSE for license details. */
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "optimize.h"
+
+/* Forsyth's scoring, for an LRU cache of OPTIMIZED_CACHE entries */
+#define OPTIMIZED_CACHE 32
+#define CACHE_DECAY 1.5f
+#define LAST_TRIANGLE_SCORE 0.75f
+#define VALENCE_SCALE 2.0f
+#define VALENCE_POWER 0.5f
+/* valences up to this get their score from a table */
+#define MAX_VALENCE 32
+/* the overdraw order is only kept while it misses at most this much more than the cache order */
+#define OVERDRAW_MAX_MISSES 1.05
+
+#define NO_TRIANGLE ((size_t) -1)
+#define UNUSED ((GLuint) -1)
+
+/* a cluster of triangles, sorted outward facing first */
+struct cluster {
+	float key;
+	size_t first, last;
+};
+
+static void *
+alloc(size_t n, size_t size)
+{
+	void *array = calloc(n ? n : 1, size);
+	if (array == NULL) {
+		errlog("couldn't optimize a %zu element mesh.", n);
+		exit(1);
+	}
+	return array;
+}
+
+/*
+ * simulates a FIFO cache of MEASURED_CACHE entries: a vertex stays cached
+ * until that many misses happened after its own. stamps start zeroed and
+ * time at MEASURED_CACHE + 1, so nothing is cached. returns whether v missed.
+ */
+static int
+cache_miss(GLuint *stamps, GLuint *time, GLuint v)
+{
+	if (*time - stamps[v] <= MEASURED_CACHE)
+		return 0;
+	stamps[v] = (*time)++;
+	return 1;
+}
+
+/*
+ * how many vertices a triangle list transforms, with a FIFO cache like
+ * the ones of current GPUs. over the triangles it is the ACMR, over the
+ * vertices used the ATVR, 1 at best.
+ */
+size_t
+cache_misses(const GLuint *indices, size_t n_indices, size_t n_vertices)
+{
+	GLuint *stamps = alloc(n_vertices, sizeof(GLuint));
+	GLuint time = MEASURED_CACHE + 1;
+	size_t misses = 0;
+
+	for (size_t i = 0; i < n_indices; i++)
+		misses += cache_miss(stamps, &time, indices[i]);
+
+	free(stamps);
+	return misses;
+}
+
+static float
+vertex_score(const float *cache_scores, const float *valence_scores,
+		int position, unsigned int live)
+{
+	if (live == 0)
+		return -1.0f;
+
+	float score = position >= 0 ? cache_scores[position] : 0.0f;
+	return score + (live <= MAX_VALENCE ? valence_scores[live] :
+		VALENCE_SCALE * powf(live, -VALENCE_POWER));
+}
+
+/*
+ * reorders triangles for the post-transform vertex cache (Forsyth, "Linear-
+ * Speed Vertex Cache Optimisation"). the next triangle is the best scoring
+ * one around the simulated LRU cache, vertices scoring higher the more
+ * recently they were used and the fewer triangles they have left, so
+ * lone ones get finished off instead of being reloaded later.
+ */
+void
+optimize_vertex_cache(GLuint *indices, size_t n_indices, size_t n_vertices)
+{
+	size_t n_triangles = n_indices / 3;
+	float cache_scores[OPTIMIZED_CACHE], valence_scores[MAX_VALENCE + 1];
+
+	for (int i = 0; i < OPTIMIZED_CACHE; i++) {
+		/* the last triangle's vertices score the same, whatever order they came in */
+		cache_scores[i] = i < 3 ? LAST_TRIANGLE_SCORE :
+			powf(1.0f - (float) (i - 3) / (OPTIMIZED_CACHE - 3), CACHE_DECAY);
+	}
+	for (int i = 1; i <= MAX_VALENCE; i++)
+		valence_scores[i] = VALENCE_SCALE * powf(i, -VALENCE_POWER);
+
+	unsigned int *live = alloc(n_vertices, sizeof(unsigned int));
+	size_t *offsets = alloc(n_vertices + 1, sizeof(size_t));
+	size_t *triangles = alloc(n_indices, sizeof(size_t));
+	int *positions = alloc(n_vertices, sizeof(int));
+	float *scores = alloc(n_vertices, sizeof(float));
+	unsigned char *emitted = alloc(n_triangles, 1);
+	GLuint *output = alloc(n_indices, sizeof(GLuint));
+
+	/* the triangles around every vertex, the first live[v] of them aren't emitted yet */
+	for (size_t i = 0; i < n_indices; i++)
+		live[indices[i]]++;
+	for (size_t v = 0; v < n_vertices; v++)
+		offsets[v + 1] = offsets[v] + live[v];
+	memset(live, 0, n_vertices * sizeof(unsigned int));
+	for (size_t i = 0; i < n_indices; i++) {
+		GLuint v = indices[i];
+		triangles[offsets[v] + live[v]++] = i / 3;
+	}
+
+	for (size_t v = 0; v < n_vertices; v++) {
+		positions[v] = -1;
+		scores[v] = vertex_score(cache_scores, valence_scores, -1, live[v]);
+	}
+
+	size_t best = NO_TRIANGLE;
+	float best_score = -1.0f;
+	for (size_t t = 0; t < n_triangles; t++) {
+		const GLuint *triangle = &indices[t * 3];
+		float score = scores[triangle[0]] + scores[triangle[1]] + scores[triangle[2]];
+		if (score > best_score) {
+			best = t;
+			best_score = score;
+		}
+	}
+
+	GLuint cache[OPTIMIZED_CACHE + 3];
+	size_t cache_size = 0, cursor = 0;
+
+	for (size_t n = 0; n < n_triangles; n++) {
+		/* nothing left around the cache, go on with the first triangle left */
+		if (best == NO_TRIANGLE) {
+			while (emitted[cursor])
+				cursor++;
+			best = cursor;
+		}
+
+		const GLuint *triangle = &indices[best * 3];
+		memcpy(&output[n * 3], triangle, 3 * sizeof(GLuint));
+		emitted[best] = 1;
+
+		for (int k = 0; k < 3; k++) {
+			GLuint v = triangle[k];
+			size_t *list = &triangles[offsets[v]];
+			for (unsigned int i = 0; i < live[v]; i++) {
+				if (list[i] == best) {
+					list[i] = list[--live[v]];
+					break;
+				}
+			}
+		}
+
+		/* the triangle's vertices move to the front, pushing the rest back */
+		GLuint next[OPTIMIZED_CACHE + 3];
+		size_t next_size = 0;
+		for (int k = 0; k < 3; k++) {
+			if (k == 0 || (triangle[k] != triangle[0] && (k == 1 || triangle[k] != triangle[1])))
+				next[next_size++] = triangle[k];
+		}
+		for (size_t i = 0; i < cache_size; i++) {
+			GLuint v = cache[i];
+			if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+				next[next_size++] = v;
+		}
+
+		/* the ones pushed out of the cache are rescored too */
+		for (size_t i = 0; i < next_size; i++) {
+			GLuint v = next[i];
+			positions[v] = i < OPTIMIZED_CACHE ? (int) i : -1;
+			scores[v] = vertex_score(cache_scores, valence_scores, positions[v], live[v]);
+		}
+
+		best = NO_TRIANGLE;
+		best_score = -1.0f;
+		cache_size = next_size < OPTIMIZED_CACHE ? next_size : OPTIMIZED_CACHE;
+		for (size_t i = 0; i < cache_size; i++) {
+			GLuint v = next[i];
+			cache[i] = v;
+			for (unsigned int j = 0; j < live[v]; j++) {
+				size_t t = triangles[offsets[v] + j];
+				const GLuint *around = &indices[t * 3];
+				float score = scores[around[0]] + scores[around[1]] + scores[around[2]];
+				if (score > best_score) {
+					best = t;
+					best_score = score;
+				}
+			}
+		}
+	}
+
+	memcpy(indices, output, n_triangles * 3 * sizeof(GLuint));
+
+	free(live);
+	free(offsets);
+	free(triangles);
+	free(positions);
+	free(scores);
+	free(emitted);
+	free(output);
+}
+
+static int
+compare_clusters(const void *a, const void *b)
+{
+	const struct cluster *ca = a, *cb = b;
+	if (ca->key != cb->key)
+		return ca->key > cb->key ? -1 : 1;
+	return (ca->first > cb->first) - (ca->first < cb->first);
+}
+
+/*
+ * reorders the clusters of a cache optimized triangle list so the ones
+ * facing outwards, likely to occlude the rest, are drawn first (Sander,
+ * Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and
+ * Reduced Overdraw"). clusters start where the cache simulation misses
+ * all three vertices of a triangle, but the triangles after the first in
+ * a cluster may have hit vertices of the cluster that came before it, so
+ * the ACMR can still rise. past OVERDRAW_MAX_MISSES the cache order stays.
+ */
+void
+optimize_overdraw(GLuint *indices, size_t n_indices,
+		const void *positions, size_t stride, size_t n_vertices)
+{
+	size_t n_triangles = n_indices / 3;
+	if (n_triangles == 0)
+		return;
+
+	GLuint *stamps = alloc(n_vertices, sizeof(GLuint));
+	struct cluster *clusters = alloc(n_triangles, sizeof(struct cluster));
+	vec3 *centroids = alloc(n_triangles, sizeof(vec3));
+	vec3 *normals = alloc(n_triangles, sizeof(vec3));
+	float *areas = alloc(n_triangles, sizeof(float));
+	GLuint *output = alloc(n_indices, sizeof(GLuint));
+
+	GLuint time = MEASURED_CACHE + 1;
+	size_t n_clusters = 0;
+	for (size_t t = 0; t < n_triangles; t++) {
+		int misses = 0;
+		for (int k = 0; k < 3; k++)
+			misses += cache_miss(stamps, &time, indices[t * 3 + k]);
+		if (t == 0 || misses == 3)
+			clusters[n_clusters++].first = t;
+		clusters[n_clusters - 1].last = t + 1;
+	}
+
+	/* area weighted centroid and normal of every cluster and of the mesh */
+	vec3 center = { 0.0f, 0.0f, 0.0f };
+	float area = 0.0f;
+	for (size_t c = 0; c < n_clusters; c++) {
+		glm_vec3_zero(centroids[c]);
+		glm_vec3_zero(normals[c]);
+		areas[c] = 0.0f;
+
+		for (size_t t = clusters[c].first; t < clusters[c].last; t++) {
+			vec3 p[3], u, v, normal;
+			for (int k = 0; k < 3; k++)
+				memcpy(p[k], (const char *) positions + indices[t * 3 + k] * stride, sizeof(vec3));
+
+			glm_vec3_sub(p[1], p[0], u);
+			glm_vec3_sub(p[2], p[0], v);
+			glm_vec3_cross(u, v, normal);
+			float twice_area = glm_vec3_norm(normal);
+
+			for (int k = 0; k < 3; k++)
+				glm_vec3_muladds(p[k], twice_area / 3.0f, centroids[c]);
+			glm_vec3_add(normals[c], normal, normals[c]);
+			areas[c] += twice_area;
+		}
+
+		glm_vec3_add(center, centroids[c], center);
+		area += areas[c];
+		if (areas[c] > 0.0f)
+			glm_vec3_scale(centroids[c], 1.0f / areas[c], centroids[c]);
+	}
+	if (area > 0.0f)
+		glm_vec3_scale(center, 1.0f / area, center);
+
+	for (size_t c = 0; c < n_clusters; c++) {
+		vec3 offset;
+		glm_vec3_sub(centroids[c], center, offset);
+		glm_vec3_normalize(normals[c]);
+		clusters[c].key = glm_vec3_dot(offset, normals[c]);
+	}
+	qsort(clusters, n_clusters, sizeof(struct cluster), compare_clusters);
+
+	size_t n = 0;
+	for (size_t c = 0; c < n_clusters; c++) {
+		size_t size = (clusters[c].last - clusters[c].first) * 3;
+		memcpy(&output[n], &indices[clusters[c].first * 3], size * sizeof(GLuint));
+		n += size;
+	}
+	if (cache_misses(output, n, n_vertices) <=
+	    cache_misses(indices, n_indices, n_vertices) * OVERDRAW_MAX_MISSES)
+		memcpy(indices, output, n * sizeof(GLuint));
+
+	free(stamps);
+	free(clusters);
+	free(centroids);
+	free(normals);
+	free(areas);
+	free(output);
+}
+
+/*
+ * numbers the vertices in the order the indices first use them, so they
+ * are fetched front to back, and rewrites the indices to match. unused
+ * vertices get UNUSED in remap. returns how many vertices are used.
+ */
+size_t
+optimize_vertex_fetch(GLuint *remap, GLuint *indices, size_t n_indices, size_t n_vertices)
+{
+	for (size_t v = 0; v < n_vertices; v++)
+		remap[v] = UNUSED;
+
+	GLuint n = 0;
+	for (size_t i = 0; i < n_indices; i++) {
+		if (remap[indices[i]] == UNUSED)
+			remap[indices[i]] = n++;
+		indices[i] = remap[indices[i]];
+	}
+	return n;
+}
+
+/* moves every used vertex of src to where remap puts it in dst */
+void
+remap_vertices(void *dst, const void *src, size_t n_vertices, size_t vertex_size,
+		const GLuint *remap)
+{
+	for (size_t v = 0; v < n_vertices; v++) {
+		if (remap[v] != UNUSED)
+			memcpy((char *) dst + remap[v] * vertex_size, (const char *) src + v * vertex_size,
+				vertex_size);
+	}
+}
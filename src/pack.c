@@ -0,0 +1,208 @@
+/* See LICENSE for license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "models.h"
+#include "pack.h"
+#include "cache.h"
+
+int
+is_pack(const char *path)
+{
+	size_t length = strlen(path);
+	size_t extension = strlen(PACK_EXTENSION);
+
+	return length > extension && strcmp(path + length - extension, PACK_EXTENSION) == 0;
+}
+
+/* whether [offset, offset + size) is inside the file */
+static int
+in_pack(const struct pack_header *header, uint64_t offset, uint64_t size)
+{
+	return offset <= header->size && size <= header->size - offset;
+}
+
+static void
+invalid_pack(const char *path, const char *reason)
+{
+	errlog("invalid %s pack: %s.", path, reason);
+	exit(1);
+}
+
+/* bytes in a 4x4 block of the compressed formats the cooker writes, 0 for any other */
+static size_t
+block_size(uint32_t format)
+{
+	switch (format) {
+	case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+		return 8;
+	case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+/* levels in the full chain of a width x height texture */
+static int
+max_levels(int32_t width, int32_t height)
+{
+	int32_t size = width > height ? width : height;
+	int levels = 1;
+
+	while (size >>= 1)
+		levels++;
+	return levels;
+}
+
+/*
+ * maps a pack and points the staged meshes straight into it, so uploading
+ * them is a plain copy. the mapping stays until the model is uploaded.
+ */
+void
+stage_pack(struct staged_model *staged, const char *path)
+{
+	size_t map_size;
+	const unsigned char *map = map_file(path, &map_size);
+	if (map == NULL) {
+		errlog("failed to map the %s pack.", path);
+		exit(1);
+	}
+	if (map_size < sizeof(struct pack_header))
+		invalid_pack(path, "too small");
+
+	const struct pack_header *header = (const struct pack_header *) map;
+	if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0)
+		invalid_pack(path, "not a pack");
+	if (header->version != PACK_VERSION)
+		invalid_pack(path, "cooked by another version, recook it");
+	if (header->size != (uint64_t) map_size)
+		invalid_pack(path, "truncated");
+	if (!in_pack(header, header->meshes, header->n_meshes * (uint64_t) sizeof(struct pack_mesh)) ||
+	    !in_pack(header, header->textures, header->n_textures * (uint64_t) sizeof(struct pack_texture)))
+		invalid_pack(path, "tables out of bounds");
+
+	const struct pack_mesh *pack_meshes = (const struct pack_mesh *) (map + header->meshes);
+	const struct pack_texture *pack_textures = (const struct pack_texture *) (map + header->textures);
+
+	uint64_t pack_key = path_key(CACHE_TEXTURE, path);
+
+	struct model model = { 0 };
+	model.n_meshes = header->n_meshes;
+	model.meshes = calloc(model.n_meshes, sizeof(struct mesh));
+	staged->meshes = calloc(model.n_meshes, sizeof(struct staged_mesh));
+	if (model.meshes == NULL || staged->meshes == NULL) {
+		errlog("failed to load the %s pack.", path);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < model.n_meshes; i++) {
+		const struct pack_mesh *pack_mesh = &pack_meshes[i];
+		struct mesh *mesh = &model.meshes[i];
+		struct staged_mesh *staged_mesh = &staged->meshes[i];
+
+		if (pack_mesh->format < 0 || pack_mesh->format >= VERTEX_FORMATS)
+			invalid_pack(path, "unknown vertex format");
+		if (pack_mesh->index_type < 0 || pack_mesh->index_type >= INDEX_TYPES)
+			invalid_pack(path, "unknown index type");
+		if (pack_mesh->alpha_mode != ALPHA_OPAQUE && pack_mesh->alpha_mode != ALPHA_MASK)
+			invalid_pack(path, "unknown alpha mode");
+		if (!in_pack(header, pack_mesh->vertices,
+		             pack_mesh->n_vertices * (uint64_t) vertex_sizes[pack_mesh->format]) ||
+		    !in_pack(header, pack_mesh->indices,
+		             pack_mesh->n_indices * (uint64_t) index_sizes[pack_mesh->index_type]))
+			invalid_pack(path, "geometry out of bounds");
+		if (pack_mesh->n_lods < 1 || pack_mesh->n_lods > MAX_LODS)
+			invalid_pack(path, "bad level of detail count");
+
+		mesh->n_vertices = pack_mesh->n_vertices;
+		mesh->n_indices = pack_mesh->n_indices;
+		mesh->format = pack_mesh->format;
+		mesh->index_type = pack_mesh->index_type;
+		mesh->culling = pack_mesh->culling;
+		mesh->alpha_mode = pack_mesh->alpha_mode;
+		memcpy(mesh->min, pack_mesh->min, sizeof(vec3));
+		memcpy(mesh->max, pack_mesh->max, sizeof(vec3));
+		memcpy(mesh->center, pack_mesh->center, sizeof(vec3));
+		mesh->radius = pack_mesh->radius;
+		mesh->n_lods = pack_mesh->n_lods;
+		for (int l = 0; l < mesh->n_lods; l++) {
+			if (pack_mesh->lod_offsets[l] > pack_mesh->n_indices ||
+			    pack_mesh->lod_indices[l] > pack_mesh->n_indices - pack_mesh->lod_offsets[l])
+				invalid_pack(path, "level of detail out of bounds");
+			mesh->lods[l].offset = pack_mesh->lod_offsets[l];
+			mesh->lods[l].n_indices = pack_mesh->lod_indices[l];
+			mesh->lods[l].error = pack_mesh->lod_errors[l];
+		}
+
+		staged_mesh->vertices = (void *) (map + pack_mesh->vertices);
+		staged_mesh->indices = (void *) (map + pack_mesh->indices);
+		staged_mesh->min_filter = pack_mesh->min_filter;
+		staged_mesh->mag_filter = pack_mesh->mag_filter;
+		staged_mesh->wrap_s = pack_mesh->wrap_s;
+		staged_mesh->wrap_t = pack_mesh->wrap_t;
+
+		if (pack_mesh->texture < 0)
+			continue;
+		if ((uint32_t) pack_mesh->texture >= header->n_textures)
+			invalid_pack(path, "texture out of bounds");
+
+		/* textures are shared through the cache, by their index in the pack */
+		uint32_t texture = pack_mesh->texture;
+		if (!stage_texture(staged, i, hash_bytes(pack_key, &texture, sizeof(texture))))
+			continue;
+
+		const struct pack_texture *pack_texture = &pack_textures[texture];
+		size_t block = block_size(pack_texture->format);
+		if (block == 0)
+			invalid_pack(path, "unknown texture format");
+		if (pack_texture->width <= 0 || pack_texture->height <= 0)
+			invalid_pack(path, "bad texture size");
+		if (pack_texture->levels < 1 || pack_texture->levels > MAX_MIPS ||
+		    pack_texture->levels > max_levels(pack_texture->width, pack_texture->height))
+			invalid_pack(path, "bad mip count");
+		if (!in_pack(header, pack_texture->data, pack_texture->size))
+			invalid_pack(path, "texture data out of bounds");
+
+		struct image *image = &staged_mesh->image;
+		image->pixels = (unsigned char *) (map + pack_texture->data);
+		image->format = pack_texture->format;
+		image->width = pack_texture->width;
+		image->height = pack_texture->height;
+		image->levels = pack_texture->levels;
+		image->size = pack_texture->size;
+		/* every level holds exactly the blocks its size needs, as the upload hands them to GL */
+		for (int level = 0; level < image->levels; level++) {
+			uint64_t start = pack_texture->offsets[level];
+			uint64_t end = level + 1 < image->levels ?
+				pack_texture->offsets[level + 1] : pack_texture->size;
+			uint64_t blocks_x = (mip_size(pack_texture->width, level) + 3) / 4;
+			uint64_t blocks_y = (mip_size(pack_texture->height, level) + 3) / 4;
+			if (start > end || end > pack_texture->size ||
+			    end - start != blocks_x * blocks_y * block)
+				invalid_pack(path, "bad mip offsets");
+			image->offsets[level] = start;
+		}
+	}
+
+	staged->model = model;
+	staged->n_uploaded = 0;
+	staged->map = (void *) map;
+	staged->map_size = map_size;
+}
+
+void
+unmap_pack(struct staged_model *staged)
+{
+	unmap_file(staged->map, staged->map_size);
+	staged->map = NULL;
+	staged->map_size = 0;
+}
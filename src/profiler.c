@@ -0,0 +1,234 @@
+/* See LICENSE for license details. */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "profiler.h"
+
+/* without PROFILE nothing calls the profiler, so none of it is built */
+#ifdef PROFILE
+
+/* trace rows, threads follow the GPU in the order they first record */
+enum {
+	TRACK_GPU,
+	TRACK_THREADS,
+};
+
+struct profile_event {
+	const char *name;
+	double start, duration;	/* in seconds */
+	int track;
+};
+
+/* the last PROFILE_SAMPLES durations of a scope, in milliseconds */
+struct profile_scope {
+	const char *name;
+	int gpu;
+	float samples[PROFILE_SAMPLES];
+	size_t n;		/* ever recorded */
+};
+
+struct gpu_scope {
+	const char *name;
+	double start;		/* when it was issued on the CPU */
+	GLuint query;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct profile_event events[PROFILE_EVENTS];
+	size_t n_events;	/* ever recorded, the ring keeps the last ones */
+	struct profile_scope scopes[PROFILE_SCOPES];
+	size_t n_scopes;
+	pthread_t threads[PROFILE_THREADS];
+	size_t n_threads;
+	/* queries of the last PROFILE_LATENCY frames, by frame modulo */
+	struct gpu_scope gpu[PROFILE_LATENCY][PROFILE_GPU_SCOPES];
+	size_t n_gpu[PROFILE_LATENCY];
+	int gpu_running;
+	size_t frame;
+	double frame_start;
+} profiler = { PTHREAD_MUTEX_INITIALIZER };
+
+double
+profile_time(void)
+{
+	return glfwGetTime();
+}
+
+/* the trace row of the calling thread, the lock is held */
+static int
+thread_track(void)
+{
+	pthread_t self = pthread_self();
+	for (size_t i = 0; i < profiler.n_threads; i++) {
+		if (pthread_equal(profiler.threads[i], self))
+			return TRACK_THREADS + i;
+	}
+	/* past PROFILE_THREADS, threads share the last row */
+	if (profiler.n_threads == PROFILE_THREADS)
+		return TRACK_THREADS + PROFILE_THREADS - 1;
+	profiler.threads[profiler.n_threads] = self;
+	return TRACK_THREADS + profiler.n_threads++;
+}
+
+static void
+record(const char *name, double start, double duration, int gpu)
+{
+	pthread_mutex_lock(&profiler.lock);
+
+	struct profile_event *event = &profiler.events[profiler.n_events++ % PROFILE_EVENTS];
+	event->name = name;
+	event->start = start;
+	event->duration = duration;
+	event->track = gpu ? TRACK_GPU : thread_track();
+
+	struct profile_scope *scope = NULL;
+	for (size_t i = 0; i < profiler.n_scopes; i++) {
+		if (profiler.scopes[i].gpu == gpu && strcmp(profiler.scopes[i].name, name) == 0) {
+			scope = &profiler.scopes[i];
+			break;
+		}
+	}
+	if (scope == NULL && profiler.n_scopes < PROFILE_SCOPES) {
+		scope = &profiler.scopes[profiler.n_scopes++];
+		scope->name = name;
+		scope->gpu = gpu;
+		scope->n = 0;
+	}
+	if (scope != NULL)
+		scope->samples[scope->n++ % PROFILE_SAMPLES] = duration * 1000.0;
+
+	pthread_mutex_unlock(&profiler.lock);
+}
+
+/* ends the CPU scope started at start, name has to outlive the profiler */
+void
+profile_cpu(const char *name, double start)
+{
+	record(name, start, profile_time() - start, 0);
+}
+
+void
+gpu_profile_begin(const char *name)
+{
+	size_t slot = profiler.frame % PROFILE_LATENCY;
+	if (profiler.gpu_running || profiler.n_gpu[slot] == PROFILE_GPU_SCOPES)
+		return;
+
+	struct gpu_scope *scope = &profiler.gpu[slot][profiler.n_gpu[slot]++];
+	if (scope->query == 0)
+		glGenQueries(1, &scope->query);
+	scope->name = name;
+	scope->start = profile_time();
+	glBeginQuery(GL_TIME_ELAPSED, scope->query);
+	profiler.gpu_running = 1;
+}
+
+void
+gpu_profile_end(void)
+{
+	if (!profiler.gpu_running)
+		return;
+	glEndQuery(GL_TIME_ELAPSED);
+	profiler.gpu_running = 0;
+}
+
+/*
+ * ends a frame: records its duration, and the GPU scopes of the frame
+ * PROFILE_LATENCY frames ago, whose queries are reused. results that
+ * still aren't available are dropped rather than waited on.
+ */
+void
+profile_frame(void)
+{
+	double now = profile_time();
+	if (profiler.frame_start > 0.0)
+		record("frame", profiler.frame_start, now - profiler.frame_start, 0);
+	profiler.frame_start = now;
+
+	size_t slot = ++profiler.frame % PROFILE_LATENCY;
+	for (size_t i = 0; i < profiler.n_gpu[slot]; i++) {
+		struct gpu_scope *scope = &profiler.gpu[slot][i];
+		GLint available = 0;
+		glGetQueryObjectiv(scope->query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			continue;
+
+		GLuint64 elapsed;
+		glGetQueryObjectui64v(scope->query, GL_QUERY_RESULT, &elapsed);
+		record(scope->name, scope->start, elapsed * 1e-9, 1);
+	}
+	profiler.n_gpu[slot] = 0;
+}
+
+static int
+compare_samples(const void *a, const void *b)
+{
+	float fa = *(const float *) a, fb = *(const float *) b;
+	return (fa > fb) - (fa < fb);
+}
+
+/* percentiles of every scope over its last PROFILE_SAMPLES runs */
+void
+print_profile(void)
+{
+	float samples[PROFILE_SAMPLES];
+
+	pthread_mutex_lock(&profiler.lock);
+	for (size_t i = 0; i < profiler.n_scopes; i++) {
+		const struct profile_scope *scope = &profiler.scopes[i];
+		size_t n = scope->n < PROFILE_SAMPLES ? scope->n : PROFILE_SAMPLES;
+		memcpy(samples, scope->samples, n * sizeof(float));
+		qsort(samples, n, sizeof(float), compare_samples);
+
+		printf("%s %-20s p50 %7.3f ms, p95 %7.3f ms, p99 %7.3f ms over %zu\n",
+			scope->gpu ? "gpu" : "cpu", scope->name,
+			samples[n * 50 / 100], samples[n * 95 / 100], samples[n * 99 / 100], n);
+	}
+	pthread_mutex_unlock(&profiler.lock);
+}
+
+/* writes the events in the ring as a Chrome trace, for chrome://tracing or Perfetto */
+void
+export_trace(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		errlog("couldn't write the %s trace.", path);
+		return;
+	}
+
+	pthread_mutex_lock(&profiler.lock);
+	fprintf(file, "{\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"name\":\"GPU\"}}", TRACK_GPU);
+	for (size_t i = 0; i < profiler.n_threads; i++) {
+		fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+			"\"args\":{\"name\":\"%s %zu\"}}", TRACK_THREADS + i,
+			i == 0 ? "main" : "thread", i);
+	}
+
+	size_t first = profiler.n_events > PROFILE_EVENTS ? profiler.n_events - PROFILE_EVENTS : 0;
+	for (size_t i = first; i < profiler.n_events; i++) {
+		const struct profile_event *event = &profiler.events[i % PROFILE_EVENTS];
+		fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f}", event->name, event->track,
+			event->start * 1e6, event->duration * 1e6);
+	}
+	fprintf(file, "\n]}\n");
+	pthread_mutex_unlock(&profiler.lock);
+
+	if (fclose(file) != 0)
+		errlog("couldn't write the %s trace.", path);
+}
+
+#endif
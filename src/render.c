@@ -0,0 +1,718 @@
+/* See LICENSE for license details. */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "models.h"
+#include "culling.h"
+#include "bvh.h"
+#include "render.h"
+#include "occlusion.h"
+#include "profiler.h"
+
+/* projected error, in pixels, a level of detail may have */
+#define LOD_THRESHOLD 1.0f
+/* a coarser level is only switched to once its error is this far under the threshold */
+#define LOD_HYSTERESIS 0.75f
+
+/* the passes flush_render_queue draws the batches in */
+enum {
+	PASS_DEPTH,		/* depth only, no color writes */
+	PASS_SHADE,		/* shading with the usual GL_LESS depth test */
+	PASS_SHADE_EQUAL,	/* shading only what the depth pass left visible */
+};
+
+/*
+ * draws are sorted by a key packing the state they need, most expensive
+ * to change first, so equal state ends up adjacent. opaque meshes go
+ * before alpha tested ones, which can't use early depth testing. the first
+ * index in the shared index buffer of its vertex format and index type
+ * identifies the mesh and its level of detail:
+ *
+ *   63    62      56 55    54   53  52       36 35     29   28   27          0
+ *   | alpha | program | format | index | texture | sampler | cull | first index |
+ */
+static uint64_t
+draw_key(const struct program *program, const struct mesh *mesh, int lod)
+{
+	GLuint first_index = mesh->first_index + mesh->lods[lod].offset;
+	return (uint64_t) (mesh->alpha_mode == ALPHA_MASK) << 63 |
+		(uint64_t) (program->ID & 0x7f) << 56 |
+		(uint64_t) (mesh->format & 0x3) << 54 |
+		(uint64_t) (mesh->index_type & 0x1) << 53 |
+		(uint64_t) (mesh->diffuse & 0x1ffff) << 36 |
+		(uint64_t) (mesh->sampler & 0x7f) << 29 |
+		(uint64_t) (mesh->culling != 0) << 28 |
+		(uint64_t) (first_index & 0xfffffff);
+}
+
+static int
+same_state(const struct draw *a, const struct draw *b)
+{
+	return a->program == b->program &&
+		a->mesh->format == b->mesh->format &&
+		a->mesh->index_type == b->mesh->index_type &&
+		a->mesh->diffuse == b->mesh->diffuse &&
+		a->mesh->sampler == b->mesh->sampler &&
+		a->mesh->culling == b->mesh->culling &&
+		a->mesh->alpha_mode == b->mesh->alpha_mode;
+}
+
+static int
+compare_draws(const void *a, const void *b)
+{
+	uint64_t ka = ((const struct draw *) a)->key;
+	uint64_t kb = ((const struct draw *) b)->key;
+	return (ka > kb) - (ka < kb);
+}
+
+static void *
+grow(void *array, size_t *capacity, size_t needed, size_t size)
+{
+	if (needed <= *capacity)
+		return array;
+
+	size_t n = *capacity ? *capacity : 64;
+	while (n < needed)
+		n *= 2;
+
+	array = realloc(array, n * size);
+	if (array == NULL) {
+		errlog("couldn't grow the render queue to %zu elements.", n);
+		exit(1);
+	}
+	*capacity = n;
+	return array;
+}
+
+/* declares the per-instance attributes on the currently bound VAO */
+void
+setup_instance_attributes(void)
+{
+	for (int i = 0; i < 4; i++) {
+		glVertexAttribFormat(INSTANCE_MODEL + i, 4, GL_FLOAT, GL_FALSE,
+			offsetof(struct instance, model) + i * sizeof(vec4));
+		glVertexAttribBinding(INSTANCE_MODEL + i, INSTANCE_BINDING);
+		glEnableVertexAttribArray(INSTANCE_MODEL + i);
+	}
+	for (int i = 0; i < 3; i++) {
+		glVertexAttribFormat(INSTANCE_NORMAL + i, 3, GL_FLOAT, GL_FALSE,
+			offsetof(struct instance, normal) + i * sizeof(vec4));
+		glVertexAttribBinding(INSTANCE_NORMAL + i, INSTANCE_BINDING);
+		glEnableVertexAttribArray(INSTANCE_NORMAL + i);
+	}
+	glVertexBindingDivisor(INSTANCE_BINDING, 1);
+}
+
+void
+queue_model(struct render_queue *queue, const struct model *model,
+		const struct program *program, mat4 model_matrix, unsigned char *lods)
+{
+	queue_model_instances(queue, model, program, (mat4 *) model_matrix, lods, 1);
+}
+
+/*
+ * appends n instances to the queue, computing their normal matrices once
+ * for every mesh that uses them, and returns the index of the first one.
+ */
+static size_t
+push_instances(struct render_queue *queue, mat4 *model_matrices, size_t n)
+{
+	queue->instances = grow(queue->instances, &queue->instances_capacity,
+		queue->n_instances + n, sizeof(struct instance));
+
+	size_t first = queue->n_instances;
+	for (size_t i = 0; i < n; i++) {
+		struct instance *instance = &queue->instances[queue->n_instances++];
+		mat4 inverse;
+		glm_mat4_copy(model_matrices[i], instance->model);
+		glm_mat4_inv(model_matrices[i], inverse);
+		glm_mat4_transpose(inverse);
+		glm_vec4_copy(inverse[0], instance->normal[0]);
+		glm_vec4_copy(inverse[1], instance->normal[1]);
+		glm_vec4_copy(inverse[2], instance->normal[2]);
+	}
+
+	return first;
+}
+
+static void
+push_draw(struct render_queue *queue, const struct mesh *mesh, int lod,
+		const struct program *program, size_t instance, size_t n, int in_frustum)
+{
+	queue->draws = grow(queue->draws, &queue->capacity,
+		queue->n_draws + 1, sizeof(struct draw));
+
+	struct draw *draw = &queue->draws[queue->n_draws++];
+	draw->program = program;
+	draw->mesh = mesh;
+	draw->lod = lod;
+	draw->key = draw_key(program, mesh, lod);
+	draw->instance = instance;
+	draw->n_instances = n;
+	draw->in_frustum = in_frustum;
+}
+
+/*
+ * pixels a world unit covers at a distance of one in front of the camera,
+ * from the viewport height the engine set rather than asking GL for it.
+ */
+static float
+pixels_per_unit(void)
+{
+	return game.viewport_height * 0.5f * game.cam.projection[1][1];
+}
+
+/*
+ * the coarsest level of detail of a mesh whose error, projected from the
+ * nearest point of its bounding sphere, stays under LOD_THRESHOLD pixels.
+ * given the level it was drawn at before, a coarser one is only picked
+ * past the hysteresis band, so it doesn't pop back and forth.
+ */
+static int
+select_lod(const struct mesh *mesh, mat4 model, float pixels, int previous)
+{
+	if (mesh->n_lods == 1)
+		return 0;
+
+	vec3 center;
+	glm_mat4_mulv3(model, (float *) mesh->center, 1.0f, center);
+	float scale = glm_vec3_norm(model[0]);
+	scale = fmaxf(scale, glm_vec3_norm(model[1]));
+	scale = fmaxf(scale, glm_vec3_norm(model[2]));
+
+	float distance = glm_vec3_distance(center, game.cam.pos) - mesh->radius * scale;
+	if (distance < NEAR_PLANE)
+		distance = NEAR_PLANE;
+	pixels *= scale / distance;
+
+	int lod = 0;
+	while (lod + 1 < mesh->n_lods && mesh->lods[lod + 1].error * pixels <= LOD_THRESHOLD)
+		lod++;
+	while (previous >= 0 && lod > previous &&
+	       mesh->lods[lod].error * pixels > LOD_THRESHOLD * LOD_HYSTERESIS)
+		lod--;
+	return lod;
+}
+
+/*
+ * instances are drawn at the level of detail they need. lods holds the
+ * level every mesh of every instance was last drawn at, n per mesh, mesh
+ * after mesh, zeroed before the first frame, for the hysteresis. the runs
+ * of instances needing the same level share a draw.
+ */
+void
+queue_model_instances(struct render_queue *queue, const struct model *model,
+		const struct program *program, mat4 *model_matrices, unsigned char *lods, size_t n)
+{
+	/* models still being loaded aren't drawn */
+	if (n == 0 || !model->ready)
+		return;
+
+	float pixels = pixels_per_unit();
+	size_t first = push_instances(queue, model_matrices, n);
+	for (size_t i = 0; i < model->n_meshes; i++) {
+		const struct mesh *mesh = &model->meshes[i];
+		unsigned char *mesh_lods = lods + i * n;
+		for (size_t j = 0; j < n; j++)
+			mesh_lods[j] = select_lod(mesh, model_matrices[j], pixels, mesh_lods[j]);
+
+		int lod = mesh_lods[0];
+		size_t run = 0;
+		for (size_t j = 1; j <= n; j++) {
+			int next = j < n ? mesh_lods[j] : -1;
+			if (next != lod) {
+				push_draw(queue, mesh, lod, program, first + run, j - run, 0);
+				lod = next;
+				run = j;
+			}
+		}
+	}
+}
+
+/*
+ * queues the static meshes whose box is in the camera frustum, at the
+ * level of detail they need, remembering it for the hysteresis.
+ */
+void
+queue_scene(struct render_queue *queue, const struct scene *scene)
+{
+	mat4 view_projection;
+	struct frustum frustum;
+	glm_mat4_mul(game.cam.projection, game.cam.view, view_projection);
+	extract_frustum(view_projection, &frustum);
+
+	float pixels = pixels_per_unit();
+	size_t n = cull_bvh(&scene->bvh, &frustum, scene->visible);
+	for (size_t i = 0; i < n; i++) {
+		const struct scene_object *object = &scene->objects[scene->visible[i]];
+		int lod = select_lod(object->mesh, (vec4 *) object->model_matrix, pixels,
+			scene->lods[scene->visible[i]]);
+		scene->lods[scene->visible[i]] = lod;
+
+		size_t instance = push_instances(queue, (mat4 *) object->model_matrix, 1);
+		push_draw(queue, object->mesh, lod, object->program, instance, 1, 1);
+	}
+	queue->scene_culled += scene->n_objects - n;
+}
+
+/* uploads size bytes to a stream buffer, growing it as needed */
+void
+stream_buffer(GLenum target, GLuint *buffer, size_t *buffer_size, const void *data, size_t size)
+{
+	if (*buffer == 0)
+		glGenBuffers(1, buffer);
+	glBindBuffer(target, *buffer);
+
+	if (size > *buffer_size) {
+		if (*buffer_size == 0)
+			*buffer_size = 4096;
+		while (*buffer_size < size)
+			*buffer_size *= 2;
+	}
+	/* orphan the previous contents so the driver doesn't have to wait on them */
+	glBufferData(target, *buffer_size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(target, 0, size, data);
+}
+
+/*
+ * tests the box of every mesh instance against the camera frustum, in the
+ * order the draws are sorted in, and returns how many are visible. the
+ * instances of the scene passed the BVH already, only their boxes are kept
+ * for occlusion culling.
+ */
+static size_t
+cull_instances(struct render_queue *queue)
+{
+	mat4 view_projection;
+	struct frustum frustum;
+	glm_mat4_mul(game.cam.projection, game.cam.view, view_projection);
+	extract_frustum(view_projection, &frustum);
+
+	queue->boxes.n = 0;
+	for (size_t i = 0; i < queue->n_draws; i++) {
+		const struct draw *draw = &queue->draws[i];
+		const struct mesh *mesh = draw->mesh;
+		for (size_t j = 0; j < draw->n_instances; j++) {
+			push_box(&queue->boxes, queue->instances[draw->instance + j].model,
+				(float *) mesh->min, (float *) mesh->max);
+		}
+	}
+
+	queue->visible = grow(queue->visible, &queue->visible_capacity,
+		queue->boxes.n, sizeof(unsigned char));
+
+	size_t n = 0, box = 0;
+	for (size_t i = 0; i < queue->n_draws; i++) {
+		const struct draw *draw = &queue->draws[i];
+		if (draw->in_frustum) {
+			memset(queue->visible + box, 1, draw->n_instances);
+			n += draw->n_instances;
+		}
+		else {
+			/* the boxes of the draw on their own */
+			const struct boxes boxes = {
+				queue->boxes.cx + box, queue->boxes.cy + box, queue->boxes.cz + box,
+				queue->boxes.ex + box, queue->boxes.ey + box, queue->boxes.ez + box,
+				draw->n_instances, draw->n_instances
+			};
+			n += cull_boxes(&frustum, &boxes, queue->visible + box);
+		}
+		box += draw->n_instances;
+	}
+	return n;
+}
+
+/*
+ * packed positions are unorm within the mesh bounds, so the model matrix
+ * of their instances gets the bounds folded in: model * T(min) * S(extent).
+ */
+static void
+dequantize_model(mat4 model, const struct mesh *mesh, mat4 dest)
+{
+	vec3 extent;
+	glm_vec3_sub((float *) mesh->max, (float *) mesh->min, extent);
+
+	for (int i = 0; i < 3; i++)
+		glm_vec4_scale(model[i], extent[i], dest[i]);
+	glm_mat4_mulv(model, (vec4) { mesh->min[0], mesh->min[1], mesh->min[2], 1.0f }, dest[3]);
+}
+
+/*
+ * writes the visible instances of every draw to the instance buffer in
+ * sorted order, so draws of the same mesh end up with consecutive ranges.
+ */
+static void
+upload_instances(struct render_queue *queue, size_t n_instances)
+{
+	queue->uploads = grow(queue->uploads, &queue->uploads_capacity,
+		n_instances, sizeof(struct instance));
+	struct instance *instances = queue->uploads;
+
+	GLuint n = 0;
+	const unsigned char *visible = queue->visible;
+	for (size_t i = 0; i < queue->n_draws; i++) {
+		struct draw *draw = &queue->draws[i];
+		draw->base_instance = n;
+		draw->n_visible = 0;
+		for (size_t j = 0; j < draw->n_instances; j++) {
+			if (*visible++) {
+				const struct instance *instance = &queue->instances[draw->instance + j];
+				instances[n] = *instance;
+				if (draw->mesh->format != VERTEX_FLOAT)
+					dequantize_model((vec4 *) instance->model, draw->mesh, instances[n].model);
+				n++;
+				draw->n_visible++;
+			}
+		}
+	}
+
+	stream_buffer(GL_ARRAY_BUFFER, &queue->instance_buffer, &queue->instance_buffer_size,
+		instances, n * sizeof(struct instance));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*
+ * turns the sorted draws into indirect commands, merging the draws of the
+ * same mesh and level of detail into one instanced command, and groups the
+ * commands sharing the same state into batches. returns the number of
+ * batches.
+ */
+static size_t
+build_commands(struct render_queue *queue, struct render_stats *stats)
+{
+	size_t n_commands = 0, n_batches = 0;
+
+	queue->commands = grow(queue->commands, &queue->commands_capacity,
+		queue->n_draws, sizeof(struct draw_command));
+	queue->batches = grow(queue->batches, &queue->batches_capacity,
+		queue->n_draws, sizeof(struct batch));
+
+	for (size_t i = 0; i < queue->n_draws; ) {
+		const struct draw *draw = &queue->draws[i];
+		const struct mesh *mesh = draw->mesh;
+		const struct lod *lod = &mesh->lods[draw->lod];
+
+		struct draw_command *command = &queue->commands[n_commands];
+		command->count = lod->n_indices;
+		command->instance_count = draw->n_visible;
+		command->first_index = mesh->first_index + lod->offset;
+		command->base_vertex = mesh->base_vertex;
+		command->base_instance = draw->base_instance;
+
+		queue->draws[i].command = n_commands;
+		for (i++; i < queue->n_draws &&
+		     queue->draws[i].mesh == mesh &&
+		     queue->draws[i].lod == draw->lod &&
+		     queue->draws[i].program == draw->program; i++) {
+			command->instance_count += queue->draws[i].n_visible;
+			queue->draws[i].command = n_commands;
+		}
+
+		stats->triangles += command->instance_count * (lod->n_indices / 3);
+		stats->full_triangles += command->instance_count * (mesh->lods[0].n_indices / 3);
+
+		/* every instance of the mesh was culled */
+		if (command->instance_count == 0)
+			continue;
+
+		if (n_batches == 0 || !same_state(queue->batches[n_batches - 1].draw, draw)) {
+			queue->batches[n_batches].draw = draw;
+			queue->batches[n_batches].first_command = n_commands;
+			queue->batches[n_batches].n_commands = 0;
+			n_batches++;
+		}
+		queue->batches[n_batches - 1].n_commands++;
+		n_commands++;
+	}
+
+	stream_buffer(GL_DRAW_INDIRECT_BUFFER, &queue->command_buffer,
+		&queue->command_buffer_size, queue->commands,
+		n_commands * sizeof(struct draw_command));
+
+	return n_batches;
+}
+
+/*
+ * gives every visible instance, in instance buffer order, its box and the
+ * command drawing it, for the occlusion test.
+ */
+static void
+build_occlusion_boxes(struct render_queue *queue, size_t n_instances)
+{
+	queue->occlusion_boxes = grow(queue->occlusion_boxes, &queue->occlusion_boxes_capacity,
+		n_instances, sizeof(struct occlusion_box));
+
+	size_t box = 0, n = 0;
+	for (size_t i = 0; i < queue->n_draws; i++) {
+		const struct draw *draw = &queue->draws[i];
+		for (size_t j = 0; j < draw->n_instances; j++, box++) {
+			if (!queue->visible[box])
+				continue;
+
+			struct occlusion_box *occlusion_box = &queue->occlusion_boxes[n++];
+			occlusion_box->center[0] = queue->boxes.cx[box];
+			occlusion_box->center[1] = queue->boxes.cy[box];
+			occlusion_box->center[2] = queue->boxes.cz[box];
+			occlusion_box->extent[0] = queue->boxes.ex[box];
+			occlusion_box->extent[1] = queue->boxes.ey[box];
+			occlusion_box->extent[2] = queue->boxes.ez[box];
+			occlusion_box->command = draw->command;
+			occlusion_box->pad = 0.0f;
+		}
+	}
+}
+
+/* the program drawing a batch in a pass, the alpha tested variant only where something has to be discarded */
+static const struct program *
+batch_program(const struct render_queue *queue, const struct draw *draw, int pass)
+{
+	const struct program *program = pass == PASS_DEPTH ? queue->depth_program : draw->program;
+
+	/* GL_EQUAL already rejects whatever the depth pass discarded */
+	if (draw->mesh->alpha_mode == ALPHA_MASK && pass != PASS_SHADE_EQUAL &&
+	    program->alpha_tested != NULL)
+		program = program->alpha_tested;
+	return program;
+}
+
+static void
+draw_batches(struct render_queue *queue, size_t n_batches, GLuint instances,
+		int pass, struct render_stats *stats)
+{
+	const struct program *program = NULL;
+	GLuint texture = -1, sampler = -1;
+	int culling = -1, format = -1, index_type = -1;
+
+	glActiveTexture(GL_TEXTURE0);
+
+	for (size_t i = 0; i < n_batches; i++) {
+		const struct batch *batch = &queue->batches[i];
+		const struct mesh *mesh = batch->draw->mesh;
+		const struct program *next_program = batch_program(queue, batch->draw, pass);
+		/* depth only draws don't sample anything, unless they are alpha tested */
+		int textured = pass != PASS_DEPTH || next_program != queue->depth_program;
+
+		if (mesh->format != format || mesh->index_type != index_type) {
+			format = mesh->format;
+			index_type = mesh->index_type;
+			glBindVertexArray(geometry[format].VAO[index_type]);
+			glBindVertexBuffer(INSTANCE_BINDING, instances, 0, sizeof(struct instance));
+			stats->format_switches++;
+		}
+
+		if (next_program != program) {
+			program = next_program;
+			glUseProgram(program->ID);
+			glUniform1i(program->uniforms[U_MATERIAL_DIFFUSE], 0);
+			glUniform1i(program->uniforms[U_MATERIAL_SPECULAR], 1);
+			glUniform1f(program->uniforms[U_MATERIAL_SHININESS], 128.0f);
+			stats->program_switches++;
+		}
+
+		if (textured && mesh->diffuse != texture) {
+			texture = mesh->diffuse;
+			glBindTexture(GL_TEXTURE_2D, texture);
+			stats->texture_switches++;
+		}
+
+		if (textured && mesh->sampler != sampler) {
+			sampler = mesh->sampler;
+			glBindSampler(0, sampler);
+			stats->sampler_switches++;
+		}
+
+		if (mesh->culling != culling) {
+			culling = mesh->culling;
+			if (culling) {
+				glEnable(GL_CULL_FACE);
+			}
+			else {
+				glDisable(GL_CULL_FACE);
+			}
+			stats->cull_switches++;
+		}
+
+		glMultiDrawElementsIndirect(GL_TRIANGLES, index_gl_types[index_type],
+			(void *) (batch->first_command * sizeof(struct draw_command)),
+			batch->n_commands, 0);
+		if (pass == PASS_DEPTH) {
+			stats->depth_draws++;
+		}
+		else {
+			stats->draws++;
+			stats->commands += batch->n_commands;
+		}
+	}
+}
+
+/*
+ * with game.depth_prepass on, every batch is first drawn depth only, then
+ * shaded with GL_EQUAL and depth writes off, so each pixel is shaded once.
+ * with game.occlusion_culling on, what passed the frustum test is tested
+ * again against the depth pyramid of the last frame, and what survives is
+ * drawn from the buffers the compute shader wrote.
+ */
+void
+flush_render_queue(struct render_queue *queue)
+{
+	struct render_stats stats = { 0 };
+
+	PROFILE_BEGIN(cull);
+	qsort(queue->draws, queue->n_draws, sizeof(struct draw), compare_draws);
+
+	/* every mesh of a model gets its own copy of the model's visible instances */
+	size_t n_instances = cull_instances(queue);
+	stats.instances = queue->boxes.n + queue->scene_culled;
+	stats.visible = n_instances;
+	stats.culled = stats.instances - n_instances;
+	queue->scene_culled = 0;
+	PROFILE_END(cull);
+
+	if (n_instances == 0) {
+		if (queue->occlusion != NULL)
+			queue->occlusion->ready = 0;
+		queue->n_draws = 0;
+		queue->n_instances = 0;
+		queue->stats = stats;
+		return;
+	}
+
+	PROFILE_BEGIN(upload);
+	upload_instances(queue, n_instances);
+	size_t n_batches = build_commands(queue, &stats);
+	PROFILE_END(upload);
+	GLuint instances = queue->instance_buffer;
+
+	int occlusion = game.occlusion_culling && queue->occlusion != NULL;
+	if (occlusion && queue->occlusion->ready) {
+		const struct batch *last = &queue->batches[n_batches - 1];
+		build_occlusion_boxes(queue, n_instances);
+		GPU_PROFILE_BEGIN(occlusion);
+		cull_occluded(queue->occlusion, queue->instance_buffer, queue->occlusion_boxes,
+			n_instances, queue->commands, last->first_command + last->n_commands);
+		GPU_PROFILE_END(occlusion);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, queue->occlusion->commands);
+		instances = queue->occlusion->instances;
+		if (game.print_stats)
+			stats.occluded = read_occluded(queue->occlusion);
+	}
+
+	if (game.depth_prepass && queue->depth_program != NULL) {
+		GPU_PROFILE_BEGIN(depth_pass);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		draw_batches(queue, n_batches, instances, PASS_DEPTH, &stats);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		GPU_PROFILE_END(depth_pass);
+
+		GPU_PROFILE_BEGIN(shading);
+		glDepthFunc(GL_EQUAL);
+		glDepthMask(GL_FALSE);
+		draw_batches(queue, n_batches, instances, PASS_SHADE_EQUAL, &stats);
+		glDepthMask(GL_TRUE);
+		glDepthFunc(GL_LESS);
+		GPU_PROFILE_END(shading);
+	}
+	else {
+		GPU_PROFILE_BEGIN(shading);
+		draw_batches(queue, n_batches, instances, PASS_SHADE, &stats);
+		GPU_PROFILE_END(shading);
+	}
+
+	if (occlusion) {
+		GPU_PROFILE_BEGIN(depth_pyramid);
+		build_depth_pyramid(queue->occlusion);
+		GPU_PROFILE_END(depth_pyramid);
+	}
+	else if (queue->occlusion != NULL) {
+		queue->occlusion->ready = 0;
+	}
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindSampler(0, 0);
+
+	queue->n_draws = 0;
+	queue->n_instances = 0;
+	queue->stats = stats;
+}
+
+void
+print_render_stats(const struct render_stats stats)
+{
+	printf("%u draws of %u commands after %u depth only draws, ",
+		stats.draws, stats.commands, stats.depth_draws);
+	printf("%u of %u instances visible (%u culled, %u occluded), ",
+		stats.visible, stats.instances, stats.culled, stats.occluded);
+	printf("%u triangles (%u at full detail), ", stats.triangles, stats.full_triangles);
+	printf("%u format, %u program, %u texture, %u sampler and %u cull switches\n",
+		stats.format_switches, stats.program_switches, stats.texture_switches,
+		stats.sampler_switches, stats.cull_switches);
+}
+
+void
+add_static_model(struct scene *scene, const struct model *model,
+		const struct program *program, mat4 model_matrix)
+{
+	if (scene->n_objects + model->n_meshes > scene->capacity) {
+		size_t capacity = scene->capacity ? scene->capacity : 64;
+		while (capacity < scene->n_objects + model->n_meshes)
+			capacity *= 2;
+
+		struct scene_object *objects = realloc(scene->objects,
+			capacity * sizeof(struct scene_object));
+		if (objects == NULL) {
+			errlog("couldn't grow the scene to %zu meshes.", capacity);
+			exit(1);
+		}
+		scene->objects = objects;
+		scene->capacity = capacity;
+	}
+
+	for (size_t i = 0; i < model->n_meshes; i++) {
+		struct scene_object *object = &scene->objects[scene->n_objects++];
+		object->mesh = &model->meshes[i];
+		object->program = program;
+		glm_mat4_copy(model_matrix, object->model_matrix);
+	}
+}
+
+/* (re)builds the BVH over the world space boxes of the scene's meshes */
+void
+build_scene(struct scene *scene)
+{
+	size_t n = scene->n_objects;
+	vec3 *mins = malloc(n * sizeof(vec3));
+	vec3 *maxs = malloc(n * sizeof(vec3));
+	unsigned int *visible = realloc(scene->visible, n * sizeof(unsigned int));
+	unsigned char *lods = realloc(scene->lods, n);
+	if (n > 0 && (mins == NULL || maxs == NULL || visible == NULL || lods == NULL)) {
+		errlog("couldn't build the BVH of a %zu mesh scene.", n);
+		exit(1);
+	}
+	scene->visible = visible;
+	scene->lods = lods;
+	/* everything starts at full detail */
+	memset(scene->lods, 0, n);
+
+	for (size_t i = 0; i < n; i++) {
+		const struct scene_object *object = &scene->objects[i];
+		transform_box((vec4 *) object->model_matrix, (float *) object->mesh->min,
+			(float *) object->mesh->max, mins[i], maxs[i]);
+	}
+
+	free_bvh(&scene->bvh);
+	build_bvh(&scene->bvh, mins, maxs, n);
+
+	free(mins);
+	free(maxs);
+}
@@ -0,0 +1,553 @@
+/* See LICENSE for license details. */
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "cache.h"
+#include "lights.h"
+
+/*
+ * names of the uniforms looked up right after linking, a program that
+ * doesn't use some of them just gets -1, which glUniform* ignores.
+ */
+static const char *uniform_names[UNIFORMS] = {
+	[U_MATERIAL_DIFFUSE]   = "u_material.diffuse",
+	[U_MATERIAL_SPECULAR]  = "u_material.specular",
+	[U_MATERIAL_SHININESS] = "u_material.shininess",
+	[U_VIEW_PROJECTION]    = "u_view_projection",
+	[U_COUNT]              = "u_count",
+};
+
+/* what starts a program binary file, before the binary itself */
+struct binary_header {
+	uint32_t magic;
+	uint32_t format;	/* GLenum the driver gave */
+	uint64_t key;
+	uint64_t size;
+};
+
+/* a program linking in the background, until finish_program checks it */
+struct build {
+	GLuint program;
+	GLuint shaders[MAX_STAGES];
+	char paths[MAX_STAGES][256];	/* for the errors */
+	int n_shaders;
+	uint64_t key;		/* of its binary, 0 to not store it */
+};
+
+static struct {
+	struct build *builds;
+	size_t n, capacity;
+} pending;
+
+/* shader source being put together from a file and the ones it includes */
+struct text {
+	GLchar *data;
+	size_t n, capacity;
+};
+
+static void
+append(struct text *text, const char *data, size_t n)
+{
+	if (text->n + n + 1 > text->capacity) {
+		size_t capacity = text->capacity ? text->capacity : 4096;
+		while (capacity < text->n + n + 1)
+			capacity *= 2;
+
+		text->data = realloc(text->data, capacity);
+		if (text->data == NULL) {
+			errlog("couldn't grow a shader source to %zu bytes.", capacity);
+			exit(1);
+		}
+		text->capacity = capacity;
+	}
+	memcpy(text->data + text->n, data, n);
+	text->n += n;
+	text->data[text->n] = '\0';
+}
+
+/* the file name of an #include "name" line, which ends at end */
+static int
+include_name(const char *line, const char *end, char *name, size_t size)
+{
+	while (line < end && (*line == ' ' || *line == '\t'))
+		line++;
+	if (end - line < 8 || strncmp(line, "#include", 8) != 0)
+		return 0;
+	line += 8;
+	while (line < end && (*line == ' ' || *line == '\t'))
+		line++;
+	if (line == end || *line != '"')
+		return 0;
+
+	const char *close = memchr(line + 1, '"', end - line - 1);
+	if (close == NULL || (size_t) (close - line - 1) >= size)
+		return 0;
+	memcpy(name, line + 1, close - line - 1);
+	name[close - line - 1] = '\0';
+	return 1;
+}
+
+/*
+ * appends a shader file, with its #include "name" lines replaced by those
+ * files, looked up next to it. #line directives keep the line numbers of
+ * compile errors right within each file.
+ */
+static void
+expand_shader(struct text *text, const char *path, int depth)
+{
+	if (depth > INCLUDE_DEPTH) {
+		errlog("the includes of the %s shader nest too deep.", path);
+		exit(1);
+	}
+
+	GLchar *src = read_file(path);
+	if (src == NULL) {
+		errlog("couldn't read the %s file.", path);
+		glfwTerminate();
+		exit(1);
+	}
+
+	const char *slash = strrchr(path, '/');
+	int dir_length = slash ? slash - path + 1 : 0;
+
+	const char *line = src;
+	for (int number = 1; *line != '\0'; number++) {
+		const char *end = strchr(line, '\n');
+		end = end ? end + 1 : line + strlen(line);
+
+		char name[256], included[512], directive[32];
+		if (include_name(line, end, name, sizeof(name))) {
+			snprintf(included, sizeof(included), "%.*s%s", dir_length, path, name);
+			append(text, "#line 1\n", 8);
+			expand_shader(text, included, depth + 1);
+			/* the included file may not end its last line */
+			int n = snprintf(directive, sizeof(directive), "%s#line %d\n",
+				text->data[text->n - 1] == '\n' ? "" : "\n", number + 1);
+			append(text, directive, n);
+		}
+		else {
+			append(text, line, end - line);
+		}
+		line = end;
+	}
+	free(src);
+}
+
+static GLchar *
+read_shader(const char *path)
+{
+	struct text text = { 0 };
+	expand_shader(&text, path, 0);
+	return text.data;
+}
+
+/*
+ * starts compiling a shader without waiting for it, defines, like
+ * "#define ALPHA_TEST\n", go right after the #version line.
+ */
+static GLuint
+compile_shader(const GLchar *src, const GLenum type, const char *defines)
+{
+	const GLchar *body = strchr(src, '\n');
+	body = body ? body + 1 : src + strlen(src);
+	const GLchar *sources[] = { src, defines ? defines : "", body };
+	const GLint lengths[] = { body - src, -1, -1 };
+
+	const GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 3, sources, lengths);
+	glCompileShader(shader);
+	return shader;
+}
+
+/* waits for a shader to compile, printing its errors if it didn't */
+static int
+check_shader(GLuint shader, const char *path)
+{
+	int success;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+	if (!success) {
+		char info_log[512];
+		glGetShaderInfoLog(shader, sizeof(info_log), NULL, info_log);
+		fprintf(stderr, "%s", info_log);
+		errlog("couldn't compile the %s shader.", path);
+	}
+	return success;
+}
+
+const GLuint
+create_shader(const char *path, const GLenum type, const char *defines)
+{
+	GLchar *src = read_shader(path);
+	const GLuint shader = compile_shader(src, type, defines);
+	free(src);
+
+	if (!check_shader(shader, path)) {
+		glfwTerminate();
+		exit(1);
+	}
+	return shader;
+}
+
+/* a program is finished once it is known to link and its uniforms are looked up */
+static void
+find_uniforms(struct program *program)
+{
+	for (int i = 0; i < UNIFORMS; i++) {
+		program->uniforms[i] = glGetUniformLocation(program->ID, uniform_names[i]);
+	}
+	program->finished = 1;
+}
+
+/* links the shaders attached to the program and looks its uniforms up */
+static void
+link_program(struct program *program)
+{
+	glLinkProgram(program->ID);
+
+	int success;
+	glGetProgramiv(program->ID, GL_LINK_STATUS, &success);
+	if (!success) {
+		char info_log[512];
+		glGetProgramInfoLog(program->ID, sizeof(info_log), NULL, info_log);
+		glfwTerminate();
+		fprintf(stderr, "%s", info_log);
+		errlog("couldn't link the shaders.");
+		exit(1);
+	}
+
+	find_uniforms(program);
+}
+
+struct program
+create_shader_program(const GLuint vs, const GLuint fs)
+{
+	struct program program = { 0 };
+	program.ID = glCreateProgram();
+	glAttachShader(program.ID, vs);
+	glAttachShader(program.ID, fs);
+	link_program(&program);
+
+	return program;
+}
+
+/*
+ * key of a program binary: its sources and defines, and the driver, whose
+ * binaries no other driver or version has to accept.
+ */
+static uint64_t
+binary_key(GLchar *const *sources, int n, const char *defines)
+{
+	const char *driver[] = {
+		(const char *) glGetString(GL_VENDOR),
+		(const char *) glGetString(GL_RENDERER),
+		(const char *) glGetString(GL_VERSION),
+		defines ? defines : "",
+	};
+
+	uint64_t key = content_key(CACHE_PROGRAM, NULL, 0);
+	/* with their terminators, so no two lists of strings hash the same */
+	for (int i = 0; i < n; i++)
+		key = hash_bytes(key, sources[i], strlen(sources[i]) + 1);
+	for (int i = 0; i < 4; i++) {
+		if (driver[i] != NULL)
+			key = hash_bytes(key, driver[i], strlen(driver[i]) + 1);
+	}
+	return key;
+}
+
+static void
+binary_path(char *path, size_t size, uint64_t key)
+{
+	snprintf(path, size, PROGRAM_CACHE "/%016llx.bin", (unsigned long long) key);
+}
+
+/* links the program from its cached binary, unless it's missing, stale or rejected */
+static int
+load_binary(struct program *program, uint64_t key)
+{
+	char path[256];
+	binary_path(path, sizeof(path), key);
+
+	size_t size;
+	const unsigned char *file = map_file(path, &size);
+	if (file == NULL)
+		return 0;
+
+	struct binary_header header;
+	int valid = size >= sizeof(header);
+	if (valid) {
+		memcpy(&header, file, sizeof(header));
+		valid = header.magic == PROGRAM_MAGIC && header.key == key &&
+			header.size == size - sizeof(header);
+	}
+
+	GLint success = 0;
+	if (valid) {
+		program->ID = glCreateProgram();
+		glProgramBinary(program->ID, header.format, file + sizeof(header), header.size);
+		glGetProgramiv(program->ID, GL_LINK_STATUS, &success);
+		if (!success) {
+			glDeleteProgram(program->ID);
+			program->ID = 0;
+		}
+	}
+	unmap_file(file, size);
+
+	return success;
+}
+
+/*
+ * writes the binary of a linked program, to a temporary file renamed in
+ * place, so nobody ever reads half of one. failing is harmless, the next
+ * start just compiles again.
+ */
+static void
+store_binary(const struct program *program, uint64_t key)
+{
+	GLint size = 0;
+	glGetProgramiv(program->ID, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0)
+		return;
+
+	unsigned char *binary = malloc(size);
+	if (binary == NULL)
+		return;
+
+	GLenum format;
+	glGetProgramBinary(program->ID, size, &size, &format, binary);
+	struct binary_header header = { PROGRAM_MAGIC, format, key, size };
+
+	char path[256], tmp[264];
+	binary_path(path, sizeof(path), key);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	mkdir(PROGRAM_CACHE, 0755);
+
+	FILE *file = fopen(tmp, "wb");
+	int written = file != NULL &&
+		fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(binary, size, 1, file) == 1;
+	if (file != NULL && fclose(file) != 0)
+		written = 0;
+	if (!written || rename(tmp, path) != 0) {
+		errlog("couldn't cache the program binary in %s.", path);
+		remove(tmp);
+	}
+	free(binary);
+}
+
+/* asks drivers that can for all the threads they want to compile on */
+static void
+parallel_compile(void)
+{
+	static int asked;
+	if (asked)
+		return;
+	asked = 1;
+
+	if (GLEW_KHR_parallel_shader_compile)
+		glMaxShaderCompilerThreadsKHR(0xffffffff);
+	else if (GLEW_ARB_parallel_shader_compile)
+		glMaxShaderCompilerThreadsARB(0xffffffff);
+}
+
+/*
+ * starts building the program of n shader files with the same defines,
+ * which may be NULL. a binary from the cache is taken right away when the
+ * driver accepts it, otherwise the shaders are compiled and linked
+ * without waiting, so the driver can work on several programs at once.
+ */
+static struct program
+build_program(const char *const *paths, const GLenum *types, int n, const char *defines)
+{
+	struct program program = { 0 };
+	GLchar *sources[MAX_STAGES];
+	GLint formats = 0;
+
+	parallel_compile();
+	for (int i = 0; i < n; i++)
+		sources[i] = read_shader(paths[i]);
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	uint64_t key = binary_key(sources, n, defines);
+	if (formats == 0 || !load_binary(&program, key)) {
+		if (pending.n == pending.capacity) {
+			pending.capacity = pending.capacity ? pending.capacity * 2 : 16;
+			pending.builds = realloc(pending.builds, pending.capacity * sizeof(struct build));
+			if (pending.builds == NULL) {
+				errlog("couldn't grow the pending programs to %zu.", pending.capacity);
+				exit(1);
+			}
+		}
+
+		struct build *build = &pending.builds[pending.n++];
+		program.ID = glCreateProgram();
+		build->program = program.ID;
+		build->n_shaders = n;
+		build->key = formats > 0 ? key : 0;
+		for (int i = 0; i < n; i++) {
+			build->shaders[i] = compile_shader(sources[i], types[i], defines);
+			snprintf(build->paths[i], sizeof(build->paths[i]), "%s", paths[i]);
+			glAttachShader(program.ID, build->shaders[i]);
+		}
+		if (formats > 0)
+			glProgramParameteri(program.ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(program.ID);
+	}
+
+	for (int i = 0; i < n; i++)
+		free(sources[i]);
+	return program;
+}
+
+/* waits for a program to link, exits with the errors of its shaders or its own when it didn't */
+static void
+check_build(const struct build *build)
+{
+	int success;
+	glGetProgramiv(build->program, GL_LINK_STATUS, &success);
+	if (!success) {
+		int compiled = 1;
+		for (int i = 0; i < build->n_shaders; i++)
+			compiled &= check_shader(build->shaders[i], build->paths[i]);
+
+		if (compiled) {
+			char info_log[512];
+			glGetProgramInfoLog(build->program, sizeof(info_log), NULL, info_log);
+			fprintf(stderr, "%s", info_log);
+			errlog("couldn't link the program of the %s shader.", build->paths[0]);
+		}
+		glfwTerminate();
+		exit(1);
+	}
+
+	for (int i = 0; i < build->n_shaders; i++)
+		glDeleteShader(build->shaders[i]);
+}
+
+/*
+ * waits for the build of a program from load_program or
+ * load_compute_program and looks its uniforms up. every copy of the
+ * program has to be finished before it is used, which is only slow for
+ * the first one, while the driver is still at it.
+ */
+void
+finish_program(struct program *program)
+{
+	if (program->finished)
+		return;
+
+	for (size_t i = 0; i < pending.n; i++) {
+		struct build *build = &pending.builds[i];
+		if (build->program != program->ID)
+			continue;
+
+		check_build(build);
+		if (build->key != 0)
+			store_binary(program, build->key);
+		*build = pending.builds[--pending.n];
+		break;
+	}
+	find_uniforms(program);
+}
+
+/*
+ * the program of two shader files with the same defines, which may be
+ * NULL, or the cached one. it's built in the background until finished.
+ */
+struct program
+load_program(const char *vs_path, const char *fs_path, const char *defines)
+{
+	struct program program;
+	uint64_t fs_key = path_key(CACHE_PROGRAM, fs_path);
+	uint64_t key = hash_bytes(path_key(CACHE_PROGRAM, vs_path), &fs_key, sizeof(fs_key));
+	if (defines != NULL)
+		key = hash_bytes(key, defines, strlen(defines));
+
+	if (acquire_program(key, &program))
+		return program;
+
+	const char *paths[] = { vs_path, fs_path };
+	const GLenum types[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	program = build_program(paths, types, 2, defines);
+	program.key = key;
+
+	cache_program(key, &program);
+	return program;
+}
+
+struct program
+load_compute_program(const char *path, const char *defines)
+{
+	struct program program = { 0 };
+	uint64_t key = path_key(CACHE_PROGRAM, path);
+	if (defines != NULL)
+		key = hash_bytes(key, defines, strlen(defines));
+
+	if (acquire_program(key, &program))
+		return program;
+
+	const GLenum type = GL_COMPUTE_SHADER;
+	program = build_program(&path, &type, 1, defines);
+	program.key = key;
+
+	cache_program(key, &program);
+	return program;
+}
+
+struct uniform_buffers
+create_uniform_buffers(void)
+{
+	struct uniform_buffers ubos;
+
+	glGenBuffers(1, &ubos.camera);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubos.camera);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(struct camera_block), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BLOCK, ubos.camera);
+
+	glGenBuffers(1, &ubos.lights);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubos.lights);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(struct lights_block), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, LIGHTS_BLOCK, ubos.lights);
+
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	return ubos;
+}
+
+void
+update_uniform_buffers(const struct uniform_buffers ubos)
+{
+	struct camera_block camera;
+	glm_mat4_copy(game.cam.view, camera.view);
+	glm_mat4_copy(game.cam.projection, camera.projection);
+	glm_vec4(game.cam.pos, 1.0f, camera.pos);
+
+	struct lights_block lights = { 0 };
+	glm_vec4(dir_light.dir,      0.0f, lights.dir_light.dir);
+	glm_vec4(dir_light.ambient,  0.0f, lights.dir_light.ambient);
+	glm_vec4(dir_light.diffuse,  0.0f, lights.dir_light.diffuse);
+	glm_vec4(dir_light.specular, 0.0f, lights.dir_light.specular);
+
+	/* slice = log(depth / near) / log(far / near) * CLUSTERS_Z */
+	float slices_per_log = CLUSTERS_Z / logf(FAR_PLANE / NEAR_PLANE);
+	lights.cluster_depth[0] = slices_per_log;
+	lights.cluster_depth[1] = -logf(NEAR_PLANE) * slices_per_log;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, ubos.camera);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(camera), &camera);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubos.lights);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(lights), &lights);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
@@ -0,0 +1,208 @@
+/* See LICENSE for license details. */
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "sim.h"
+
+struct sim sim = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+camera_front(float yaw, float pitch, vec3 front)
+{
+	double cos_pitch = cos(pitch);
+	front[0] = cos(yaw) * cos_pitch;
+	front[1] = sin(pitch);
+	front[2] = sin(yaw) * cos_pitch;
+	glm_normalize(front);
+}
+
+/* turns the camera by the mouse movement and moves it a step along the held keys */
+static void
+step_camera(struct camera_state *state, int keys, float look_x, float look_y)
+{
+	state->yaw += look_x * sim.sensitivity;
+	state->pitch += look_y * sim.sensitivity;
+	if (state->pitch > PI / 2 - 0.01) {
+		state->pitch = PI / 2 - 0.01;
+	}
+	else if (state->pitch < -PI / 2 + 0.01) {
+		state->pitch = -PI / 2 + 0.01;
+	}
+
+	float speed = sim.speed * SIM_STEP;
+	if (keys & DUCK) {
+		speed /= 4;
+	}
+	else if (keys & SPRINT) {
+		speed *= 4;
+	}
+
+	vec3 front, scaled_front, right;
+	camera_front(state->yaw, state->pitch, front);
+	glm_vec3_scale(front, speed, scaled_front);
+	if (keys & BACKWARD)
+		glm_vec3_sub(state->pos, scaled_front, state->pos);
+	if (keys & FORWARD)
+		glm_vec3_add(state->pos, scaled_front, state->pos);
+
+	glm_cross(front, sim.up, right);
+	glm_normalize(right);
+	glm_vec3_scale(right, speed, right);
+	if (keys & LEFT)
+		glm_vec3_sub(state->pos, right, state->pos);
+	if (keys & RIGHT)
+		glm_vec3_add(state->pos, right, state->pos);
+}
+
+static void
+sleep_until(double time)
+{
+	double wait = time - glfwGetTime();
+	if (wait <= 0.0)
+		return;
+
+	struct timespec ts = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+	nanosleep(&ts, NULL);
+}
+
+static void *
+run(void *arg)
+{
+	double next = glfwGetTime();
+
+	for (;;) {
+		next += SIM_STEP;
+		if (glfwGetTime() - next > SIM_MAX_LAG)
+			next = glfwGetTime();
+		sleep_until(next);
+
+		pthread_mutex_lock(&sim.lock);
+		if (sim.stop) {
+			pthread_mutex_unlock(&sim.lock);
+			break;
+		}
+		int keys = sim.keys;
+		float look_x = sim.look_x, look_y = sim.look_y;
+		sim.look_x = sim.look_y = 0.0f;
+		pthread_mutex_unlock(&sim.lock);
+
+		/* only this thread touches the back snapshot */
+		struct snapshot *snapshot = &sim.snapshots[sim.back];
+		snapshot->previous = sim.state;
+		step_camera(&sim.state, keys, look_x, look_y);
+		snapshot->current = sim.state;
+		snapshot->time = next;
+
+		pthread_mutex_lock(&sim.lock);
+		int back = sim.back;
+		sim.back = sim.middle;
+		sim.middle = back;
+		sim.fresh = 1;
+		pthread_mutex_unlock(&sim.lock);
+	}
+
+	return NULL;
+}
+
+/* starts simulating from the camera, which rendering keeps showing until the first tick */
+void
+start_sim(const struct camera *cam)
+{
+	glm_vec3_copy((float *) cam->pos, sim.state.pos);
+	sim.state.yaw = cam->yaw;
+	sim.state.pitch = cam->pitch;
+	sim.speed = cam->speed;
+	sim.sensitivity = cam->sensitivity;
+	glm_vec3_copy((float *) cam->up, sim.up);
+
+	sim.back = 0;
+	sim.middle = 1;
+	sim.front = 2;
+	sim.stop = 0;
+
+	if (pthread_create(&sim.thread, NULL, run, NULL) != 0) {
+		errlog("couldn't start the simulation thread.");
+		exit(1);
+	}
+}
+
+/* sets or clears held keys until the callbacks say otherwise */
+void
+press_keys(int keys, int down)
+{
+	pthread_mutex_lock(&sim.lock);
+	if (down)
+		sim.keys |= keys;
+	else
+		sim.keys &= ~keys;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+/* adds mouse movement, in pixels, for the next tick to turn by */
+void
+look(float x, float y)
+{
+	pthread_mutex_lock(&sim.lock);
+	sim.look_x += x;
+	sim.look_y += y;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+/*
+ * places the camera where the simulation had it a tick before time,
+ * between the last two ticks, so motion stays smooth whatever the frame
+ * rate. frames the simulation lags behind show its latest tick.
+ */
+void
+interpolate_camera(struct camera *cam, double time)
+{
+	pthread_mutex_lock(&sim.lock);
+	if (sim.fresh) {
+		int front = sim.front;
+		sim.front = sim.middle;
+		sim.middle = front;
+		sim.fresh = 0;
+	}
+	pthread_mutex_unlock(&sim.lock);
+
+	const struct snapshot *snapshot = &sim.snapshots[sim.front];
+	if (snapshot->time == 0.0)
+		return;
+
+	float t = (time - snapshot->time) / SIM_STEP;
+	t = t < 0.0f ? 0.0f : t > 1.0f ? 1.0f : t;
+
+	const struct camera_state *a = &snapshot->previous, *b = &snapshot->current;
+	glm_vec3_lerp((float *) a->pos, (float *) b->pos, t, cam->pos);
+	cam->yaw = a->yaw + (b->yaw - a->yaw) * t;
+	cam->pitch = a->pitch + (b->pitch - a->pitch) * t;
+	camera_front(cam->yaw, cam->pitch, cam->front);
+	glm_vec3_add(cam->pos, cam->front, cam->target);
+
+	glm_lookat(
+		cam->pos,
+		cam->target,
+		cam->up,
+		cam->view
+	);
+}
+
+void
+stop_sim(void)
+{
+	pthread_mutex_lock(&sim.lock);
+	sim.stop = 1;
+	pthread_mutex_unlock(&sim.lock);
+
+	pthread_join(sim.thread, NULL);
+}
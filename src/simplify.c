@@ -0,0 +1,359 @@
+/* See LICENSE for license details. */
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "simplify.h"
+
+/*
+ * a collapse is rejected when it turns a triangle around by more than
+ * this, as the cosine between its normals before and after.
+ */
+#define FLIP_COSINE 0.25f
+
+/*
+ * sum of the squared distances to the planes of a vertex's triangles,
+ * weighted by their areas, as the symmetric matrix of a plane equation
+ * (a, b, c, d). w is the total weight.
+ */
+struct quadric {
+	float a2, b2, c2, d2;
+	float ab, ac, ad;
+	float bc, bd, cd;
+	float w;
+};
+
+/* collapses the from vertex onto the to vertex, which doesn't move */
+struct collapse {
+	float cost;
+	GLuint from, to;
+};
+
+/* a vertex position with its index, sorted to find the ones sharing it */
+struct welded {
+	float pos[3];
+	GLuint vertex;
+};
+
+static void *
+alloc(size_t n, size_t size)
+{
+	void *array = malloc(n * size);
+	if (array == NULL && n > 0) {
+		errlog("couldn't simplify a %zu element mesh.", n);
+		exit(1);
+	}
+	return array;
+}
+
+static void
+add_plane(struct quadric *q, const float n[3], float d, float w)
+{
+	q->a2 += w * n[0] * n[0];
+	q->b2 += w * n[1] * n[1];
+	q->c2 += w * n[2] * n[2];
+	q->d2 += w * d * d;
+	q->ab += w * n[0] * n[1];
+	q->ac += w * n[0] * n[2];
+	q->ad += w * n[0] * d;
+	q->bc += w * n[1] * n[2];
+	q->bd += w * n[1] * d;
+	q->cd += w * n[2] * d;
+	q->w += w;
+}
+
+static void
+add_quadric(struct quadric *q, const struct quadric *r)
+{
+	q->a2 += r->a2; q->b2 += r->b2; q->c2 += r->c2; q->d2 += r->d2;
+	q->ab += r->ab; q->ac += r->ac; q->ad += r->ad;
+	q->bc += r->bc; q->bd += r->bd; q->cd += r->cd;
+	q->w += r->w;
+}
+
+/* mean squared distance of p to the planes of q */
+static float
+quadric_error(const struct quadric *q, const float p[3])
+{
+	if (q->w <= 0.0f)
+		return 0.0f;
+
+	float x = p[0], y = p[1], z = p[2];
+	float rx = q->a2 * x + q->ab * y + q->ac * z + q->ad;
+	float ry = q->ab * x + q->b2 * y + q->bc * z + q->bd;
+	float rz = q->ac * x + q->bc * y + q->c2 * z + q->cd;
+	float r = rx * x + ry * y + rz * z + q->ad * x + q->bd * y + q->cd * z + q->d2;
+	return fabsf(r) / q->w;
+}
+
+static void
+triangle_normal(const float a[3], const float b[3], const float c[3], float n[3])
+{
+	float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+	float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+	n[0] = u[1] * v[2] - u[2] * v[1];
+	n[1] = u[2] * v[0] - u[0] * v[2];
+	n[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+static int
+compare_welded(const void *a, const void *b)
+{
+	const float *pa = ((const struct welded *) a)->pos;
+	const float *pb = ((const struct welded *) b)->pos;
+	for (int i = 0; i < 3; i++) {
+		if (pa[i] != pb[i])
+			return pa[i] < pb[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+static int
+compare_edges(const void *a, const void *b)
+{
+	uint64_t ea = *(const uint64_t *) a, eb = *(const uint64_t *) b;
+	return (ea > eb) - (ea < eb);
+}
+
+static int
+compare_collapses(const void *a, const void *b)
+{
+	float ca = ((const struct collapse *) a)->cost;
+	float cb = ((const struct collapse *) b)->cost;
+	return (ca > cb) - (ca < cb);
+}
+
+/*
+ * vertices that must stay where they are: those sharing their position
+ * with another vertex (uv or normal seams), and those on an edge that
+ * isn't shared by exactly two triangles (borders, non-manifold edges).
+ */
+static void
+lock_vertices(const float (*pos)[3], size_t n_vertices, const GLuint *indices,
+		size_t n_indices, unsigned char *locked)
+{
+	struct welded *welded = alloc(n_vertices, sizeof(struct welded));
+	GLuint *weld = alloc(n_vertices, sizeof(GLuint));
+	uint64_t *edges = alloc(n_indices, sizeof(uint64_t));
+
+	for (size_t i = 0; i < n_vertices; i++) {
+		memcpy(welded[i].pos, pos[i], sizeof(welded[i].pos));
+		welded[i].vertex = i;
+	}
+	qsort(welded, n_vertices, sizeof(struct welded), compare_welded);
+
+	memset(locked, 0, n_vertices);
+	for (size_t i = 0, j; i < n_vertices; i = j) {
+		for (j = i + 1; j < n_vertices && compare_welded(&welded[i], &welded[j]) == 0; j++)
+			;
+		for (size_t k = i; k < j; k++) {
+			weld[welded[k].vertex] = welded[i].vertex;
+			locked[welded[k].vertex] = j - i > 1;
+		}
+	}
+
+	/* edges between welded positions, so seams don't count as borders */
+	for (size_t i = 0; i < n_indices; i += 3) {
+		for (int e = 0; e < 3; e++) {
+			uint64_t a = weld[indices[i + e]], b = weld[indices[i + (e + 1) % 3]];
+			edges[i + e] = a < b ? a << 32 | b : b << 32 | a;
+		}
+	}
+	qsort(edges, n_indices, sizeof(uint64_t), compare_edges);
+
+	for (size_t i = 0, j; i < n_indices; i = j) {
+		for (j = i + 1; j < n_indices && edges[j] == edges[i]; j++)
+			;
+		if (j - i != 2) {
+			locked[edges[i] >> 32] = 1;
+			locked[edges[i] & 0xffffffff] = 1;
+		}
+	}
+	free(welded);
+	free(weld);
+	free(edges);
+}
+
+/*
+ * whether moving the from vertex onto the to vertex keeps every triangle
+ * around it facing the same way. the ones with both vertices disappear.
+ */
+static int
+keeps_orientation(const float (*pos)[3], const GLuint *indices,
+		const GLuint *triangles, size_t first, size_t last, GLuint from, GLuint to)
+{
+	for (size_t t = first; t < last; t++) {
+		const GLuint *triangle = &indices[triangles[t] * 3];
+		if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+			continue;
+
+		const float *moved[3];
+		for (int k = 0; k < 3; k++)
+			moved[k] = triangle[k] == from ? pos[to] : pos[triangle[k]];
+
+		float before[3], after[3];
+		triangle_normal(pos[triangle[0]], pos[triangle[1]], pos[triangle[2]], before);
+		triangle_normal(moved[0], moved[1], moved[2], after);
+
+		float before2 = before[0] * before[0] + before[1] * before[1] + before[2] * before[2];
+		float after2 = after[0] * after[0] + after[1] * after[1] + after[2] * after[2];
+		float dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+		/* slivers had no orientation to keep */
+		if (before2 > 0.0f && dot <= FLIP_COSINE * sqrtf(before2 * after2))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * simplifies a triangle list towards target indices by collapsing edges,
+ * cheapest first by their quadric error (Garland and Heckbert). vertices
+ * only ever collapse onto one another, so the result indexes the same
+ * vertices and no new ones are needed. every pass collapses a batch of
+ * independent edges, until the target is reached or nothing can collapse
+ * any more.
+ *
+ * positions are read as 3 floats every stride bytes. dst has room for
+ * n_indices and doesn't overlap indices. returns the number of indices
+ * written and stores the largest distance a vertex moved from its
+ * surface, in model units, to error.
+ */
+size_t
+simplify(GLuint *dst, const GLuint *indices, size_t n_indices,
+		const void *positions, size_t stride, size_t n_vertices,
+		size_t target, float *error)
+{
+	float (*pos)[3] = alloc(n_vertices, sizeof(*pos));
+	struct quadric *quadrics = calloc(n_vertices, sizeof(struct quadric));
+	unsigned char *locked = alloc(n_vertices, 1);
+	unsigned char *touched = alloc(n_vertices, 1);
+	GLuint *remap = alloc(n_vertices, sizeof(GLuint));
+	size_t *offsets = alloc(n_vertices + 1, sizeof(size_t));
+	GLuint *triangles = alloc(n_indices, sizeof(GLuint));
+	struct collapse *collapses = alloc(n_indices, sizeof(struct collapse));
+	if (quadrics == NULL && n_vertices > 0) {
+		errlog("couldn't simplify a %zu vertex mesh.", n_vertices);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < n_vertices; i++)
+		memcpy(pos[i], (const char *) positions + i * stride, sizeof(pos[i]));
+
+	memcpy(dst, indices, n_indices * sizeof(GLuint));
+	lock_vertices((const float (*)[3]) pos, n_vertices, dst, n_indices, locked);
+
+	for (size_t i = 0; i < n_indices; i += 3) {
+		float n[3];
+		triangle_normal(pos[dst[i]], pos[dst[i + 1]], pos[dst[i + 2]], n);
+		float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (length == 0.0f)
+			continue;
+
+		n[0] /= length;
+		n[1] /= length;
+		n[2] /= length;
+		float d = -(n[0] * pos[dst[i]][0] + n[1] * pos[dst[i]][1] + n[2] * pos[dst[i]][2]);
+		for (int k = 0; k < 3; k++)
+			add_plane(&quadrics[dst[i + k]], n, d, length * 0.5f);
+	}
+
+	float max_cost = 0.0f;
+	while (n_indices > target) {
+		/* the triangles around every vertex */
+		memset(offsets, 0, (n_vertices + 1) * sizeof(size_t));
+		for (size_t i = 0; i < n_indices; i++)
+			offsets[dst[i] + 1]++;
+		for (size_t i = 0; i < n_vertices; i++)
+			offsets[i + 1] += offsets[i];
+		for (size_t i = 0; i < n_indices; i++)
+			triangles[offsets[dst[i]]++] = i / 3;
+		for (size_t i = n_vertices; i > 0; i--)
+			offsets[i] = offsets[i - 1];
+		offsets[0] = 0;
+
+		/* every edge once, from the triangle where it goes up */
+		size_t n_collapses = 0;
+		for (size_t i = 0; i < n_indices; i += 3) {
+			for (int e = 0; e < 3; e++) {
+				GLuint a = dst[i + e], b = dst[i + (e + 1) % 3];
+				if (a >= b)
+					continue;
+
+				float ab = locked[a] ? INFINITY : quadric_error(&quadrics[a], pos[b]);
+				float ba = locked[b] ? INFINITY : quadric_error(&quadrics[b], pos[a]);
+				if (ab == INFINITY && ba == INFINITY)
+					continue;
+
+				struct collapse *collapse = &collapses[n_collapses++];
+				collapse->cost = ab <= ba ? ab : ba;
+				collapse->from = ab <= ba ? a : b;
+				collapse->to = ab <= ba ? b : a;
+			}
+		}
+		qsort(collapses, n_collapses, sizeof(struct collapse), compare_collapses);
+
+		/* most collapses take two triangles with them */
+		size_t needed = (n_indices - target) / 3;
+		size_t removed = 0;
+		memset(touched, 0, n_vertices);
+		for (size_t i = 0; i < n_vertices; i++)
+			remap[i] = i;
+
+		for (size_t c = 0; c < n_collapses && removed < needed; c++) {
+			const struct collapse *collapse = &collapses[c];
+			GLuint from = collapse->from, to = collapse->to;
+			if (touched[from] || touched[to])
+				continue;
+			if (!keeps_orientation((const float (*)[3]) pos, dst, triangles,
+			                       offsets[from], offsets[from + 1], from, to))
+				continue;
+
+			/* the triangles around it change, so do their other collapses */
+			for (size_t t = offsets[from]; t < offsets[from + 1]; t++) {
+				const GLuint *triangle = &dst[triangles[t] * 3];
+				touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+				if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+					removed++;
+			}
+
+			remap[from] = to;
+			add_quadric(&quadrics[to], &quadrics[from]);
+			if (collapse->cost > max_cost)
+				max_cost = collapse->cost;
+		}
+
+		if (removed == 0)
+			break;
+
+		size_t n = 0;
+		for (size_t i = 0; i < n_indices; i += 3) {
+			GLuint a = remap[dst[i]], b = remap[dst[i + 1]], c = remap[dst[i + 2]];
+			if (a == b || b == c || c == a)
+				continue;
+			dst[n++] = a;
+			dst[n++] = b;
+			dst[n++] = c;
+		}
+		n_indices = n;
+	}
+
+	free(pos);
+	free(quadrics);
+	free(locked);
+	free(touched);
+	free(remap);
+	free(offsets);
+	free(triangles);
+	free(collapses);
+
+	*error = sqrtf(max_cost);
+	return n_indices;
+}
@@ -0,0 +1,104 @@
+/* See LICENSE for license details. */
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "staging.h"
+
+struct staging staging = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* maps the ring, from the GL thread before any loader thread stages into it */
+void
+create_staging(void)
+{
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	glGenBuffers(1, &staging.buffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, staging.buffer);
+	glBufferStorage(GL_COPY_READ_BUFFER, STAGING_SIZE, NULL, flags);
+	staging.mapped = glMapBufferRange(GL_COPY_READ_BUFFER, 0, STAGING_SIZE, flags);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	if (staging.mapped == NULL) {
+		errlog("couldn't map the mesh staging buffer.");
+		exit(1);
+	}
+}
+
+/*
+ * takes size contiguous bytes of the ring, from any thread, and stores
+ * where they start in offset. returns NULL rather than waiting when the
+ * ring is full or there is none, as in the cooker; the caller stages in
+ * its own memory then.
+ */
+void *
+staging_alloc(size_t size, size_t *offset)
+{
+	unsigned char *p = NULL;
+
+	size = (size + STAGING_ALIGN - 1) & ~(size_t) (STAGING_ALIGN - 1);
+	if (staging.mapped == NULL || size == 0 || size > STAGING_SIZE)
+		return NULL;
+
+	pthread_mutex_lock(&staging.lock);
+	size_t start = staging.head % STAGING_SIZE;
+	/* a chunk doesn't wrap around, the end of the ring is skipped instead */
+	size_t padding = start + size > STAGING_SIZE ? STAGING_SIZE - start : 0;
+	if (staging.head + padding + size - staging.tail <= STAGING_SIZE &&
+	    staging.n_chunks < STAGING_CHUNKS) {
+		struct staging_chunk *chunk =
+			&staging.chunks[(staging.first + staging.n_chunks++) % STAGING_CHUNKS];
+		chunk->offset = (start + padding) % STAGING_SIZE;
+		chunk->size = padding + size;
+		chunk->fence = NULL;
+		chunk->copied = 0;
+		staging.head += padding + size;
+
+		*offset = chunk->offset;
+		p = staging.mapped + chunk->offset;
+	}
+	pthread_mutex_unlock(&staging.lock);
+	return p;
+}
+
+/* the copies out of the chunk at offset were issued, it's freed once they complete */
+void
+staging_copied(size_t offset)
+{
+	GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	pthread_mutex_lock(&staging.lock);
+	for (size_t i = 0; i < staging.n_chunks; i++) {
+		struct staging_chunk *chunk = &staging.chunks[(staging.first + i) % STAGING_CHUNKS];
+		if (chunk->offset == offset && !chunk->copied) {
+			chunk->fence = fence;
+			chunk->copied = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&staging.lock);
+}
+
+/* frees the oldest chunks the GPU is done copying, on the GL thread */
+void
+reclaim_staging(void)
+{
+	pthread_mutex_lock(&staging.lock);
+	while (staging.n_chunks > 0) {
+		struct staging_chunk *chunk = &staging.chunks[staging.first];
+		if (!chunk->copied || glClientWaitSync(chunk->fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+			break;
+
+		glDeleteSync(chunk->fence);
+		staging.tail += chunk->size;
+		staging.first = (staging.first + 1) % STAGING_CHUNKS;
+		staging.n_chunks--;
+	}
+	pthread_mutex_unlock(&staging.lock);
+}
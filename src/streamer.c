@@ -0,0 +1,229 @@
+/* See LICENSE for license details. */
+#include <stdlib.h>
+#include <string.h>
+
+#include <cglm/cglm.h>
+/* glew must be included first, then glfw */
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "shaders.h"
+#include "utils.h"
+#include "streamer.h"
+
+struct streamer streamer;
+
+static void
+create_streamer(void)
+{
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	GLsizeiptr size = STREAM_SEGMENTS * STREAM_SEGMENT_SIZE;
+
+	glGenBuffers(1, &streamer.buffer);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.buffer);
+	glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+	streamer.mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (streamer.mapped == NULL) {
+		errlog("couldn't map the texture streaming buffer.");
+		exit(1);
+	}
+}
+
+static size_t
+level_bytes(const struct image *image, int level)
+{
+	return (size_t) mip_size(image->width, level) * mip_size(image->height, level) * 4;
+}
+
+/*
+ * creates the texture with storage for every level and uploads the small
+ * ones right away, so it is usable at once. the rest is streamed by
+ * update_streamer, which takes ownership of the image.
+ */
+GLuint
+stream_texture(struct image *image)
+{
+	if (streamer.buffer == 0)
+		create_streamer();
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexStorage2D(GL_TEXTURE_2D, image->levels, GL_RGBA8, image->width, image->height);
+
+	/* always at least the smallest level */
+	int level = image->levels - 1;
+	while (level >= 0 && (level == image->levels - 1 || level_bytes(image, level) <= STREAM_IMMEDIATE)) {
+		glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0,
+			mip_size(image->width, level), mip_size(image->height, level),
+			GL_RGBA, GL_UNSIGNED_BYTE, image->pixels + image->offsets[level]);
+		level--;
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level + 1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	if (level < 0) {
+		free(image->pixels);
+		return texture;
+	}
+
+	if (streamer.n_streams == streamer.capacity) {
+		size_t capacity = streamer.capacity ? streamer.capacity * 2 : 16;
+		struct texture_stream *streams = realloc(streamer.streams,
+			capacity * sizeof(struct texture_stream));
+		if (streams == NULL) {
+			errlog("couldn't stream %zu textures.", capacity);
+			exit(1);
+		}
+		streamer.streams = streams;
+		streamer.capacity = capacity;
+	}
+
+	struct texture_stream *stream = &streamer.streams[streamer.n_streams++];
+	stream->texture = texture;
+	stream->image = *image;
+	stream->level = level;
+	stream->row = 0;
+
+	return texture;
+}
+
+/*
+ * creates a texture and uploads every level of the image at once, for
+ * images that are already compressed or that the caller keeps.
+ */
+GLuint
+upload_texture(const struct image *image)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexStorage2D(GL_TEXTURE_2D, image->levels, image->format, image->width, image->height);
+
+	for (int level = 0; level < image->levels; level++) {
+		int width = mip_size(image->width, level);
+		int height = mip_size(image->height, level);
+		const unsigned char *pixels = image->pixels + image->offsets[level];
+
+		if (image->format == GL_RGBA8) {
+			glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height,
+				GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+		}
+		else {
+			size_t end = level + 1 < image->levels ? image->offsets[level + 1] : image->size;
+			glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height,
+				image->format, end - image->offsets[level], pixels);
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
+
+/* stops streaming a texture that is about to be deleted */
+void
+cancel_stream(GLuint texture)
+{
+	for (size_t i = 0; i < streamer.n_streams; i++) {
+		if (streamer.streams[i].texture == texture) {
+			free(streamer.streams[i].image.pixels);
+			streamer.streams[i] = streamer.streams[--streamer.n_streams];
+			return;
+		}
+	}
+}
+
+/* the stream with the smallest level left, so every texture gets sharper evenly */
+static struct texture_stream *
+next_stream(void)
+{
+	struct texture_stream *next = NULL;
+	size_t next_bytes = 0;
+
+	for (size_t i = 0; i < streamer.n_streams; i++) {
+		struct texture_stream *stream = &streamer.streams[i];
+		size_t bytes = level_bytes(&stream->image, stream->level);
+		if (next == NULL || bytes < next_bytes) {
+			next = stream;
+			next_bytes = bytes;
+		}
+	}
+	return next;
+}
+
+/*
+ * copies up to budget bytes of pending levels into the next segment of the
+ * ring and uploads them from there, a level's rows at a time. a level is
+ * sampled once all of it is in. skips the frame when the GPU is still
+ * reading the segment, and returns the bytes uploaded.
+ */
+size_t
+update_streamer(size_t budget)
+{
+	if (streamer.n_streams == 0)
+		return 0;
+	if (budget > STREAM_SEGMENT_SIZE)
+		budget = STREAM_SEGMENT_SIZE;
+
+	GLsync *fence = &streamer.fences[streamer.segment];
+	if (*fence != NULL) {
+		if (glClientWaitSync(*fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+			return 0;
+		glDeleteSync(*fence);
+		*fence = NULL;
+	}
+
+	size_t base = streamer.segment * STREAM_SEGMENT_SIZE;
+	size_t used = 0;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.buffer);
+
+	struct texture_stream *stream;
+	while (used < budget && (stream = next_stream()) != NULL) {
+		const struct image *image = &stream->image;
+		int width = mip_size(image->width, stream->level);
+		int height = mip_size(image->height, stream->level);
+		size_t row_bytes = (size_t) width * 4;
+
+		int rows = (budget - used) / row_bytes;
+		if (rows == 0) {
+			/* a row bigger than the budget still goes, alone */
+			if (used > 0)
+				break;
+			rows = 1;
+		}
+		if (rows > height - stream->row)
+			rows = height - stream->row;
+
+		size_t bytes = rows * row_bytes;
+		memcpy(streamer.mapped + base + used,
+			image->pixels + image->offsets[stream->level] + stream->row * row_bytes, bytes);
+
+		glBindTexture(GL_TEXTURE_2D, stream->texture);
+		glTexSubImage2D(GL_TEXTURE_2D, stream->level, 0, stream->row, width, rows,
+			GL_RGBA, GL_UNSIGNED_BYTE, (void *) (base + used));
+		used += bytes;
+		stream->row += rows;
+
+		if (stream->row < height)
+			continue;
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, stream->level);
+		stream->row = 0;
+		if (stream->level-- == 0) {
+			free(stream->image.pixels);
+			*stream = streamer.streams[--streamer.n_streams];
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (used > 0) {
+		*fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		streamer.segment = (streamer.segment + 1) % STREAM_SEGMENTS;
+	}
+	return used;
+}
@@ -1,8 +1,15 @@
 /* See LICENSE for license details. */
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <cglm/cglm.h>
 /* glew must be included first, then glfw */
@@ -10,7 +17,10 @@
 #include <GLFW/glfw3.h>
 #include <SOIL2/SOIL2.h>
 
+#include "shaders.h"
 #include "utils.h"
+#include "streamer.h"
+#include "sim.h"
 
 struct dir_light dir_light = {
 	{ 1.0f,-1.0f, 0.0f }, /* dir */
@@ -19,17 +29,6 @@ struct dir_light dir_light = {
 	{ 1.0f, 1.0f, 1.0f }  /* specular */
 };
 
-struct pos_light pos_lights[] = {
-	{
-		{ 0.0f, 0.0f, 0.0f }, /* pos */
-		{ 0.2f, 0.2f, 0.2f }, /* ambient */
-		{ 1.0f, 1.0f, 1.0f }, /* diffuse */
-		{ 1.0f, 1.0f, 1.0f }, /* specular */
-		0.09f, /* linear */
-		0.032f /* quadratic */
-	},
-};
-
 struct state game = {
 	{	/* cam */
 		{ 0.0f, 0.0f, 3.0f },	/* pos */
@@ -37,19 +36,30 @@ struct state game = {
 		{ 0.0f, 0.0f, 2.0f },	/* target */
 		{ 0.0f, 1.0f, 0.0f },	/* up */
 		2.0f,			/* speed */
-		0.1f,			/* sensitivity */
+		0.002f,			/* sensitivity, radians a pixel */
 		-PI / 2, 0.0f,	/* yaw and pitch */
 		{ { 0 } }, { { 0 } }	/* view and projection matrices */
 	},
-	0,		/* input */
-	0.0f, 0.0f,	/* delta_time and last_frame */
+	0,		/* print_stats */
+	1,		/* depth_prepass */
+	1,		/* occlusion_culling */
+	HEIGHT,		/* viewport_height */
 };
 
+/*
+ * creates the window and its context. a headless one is never shown, and
+ * with GLFW 3.4 it needs no display either: the null platform creates a
+ * surfaceless EGL context, which has no default framebuffer to draw to.
+ */
 GLFWwindow *
-initialize(void)
+initialize(int headless)
 {
 	glfwSetErrorCallback(error_callback);
 
+#ifdef GLFW_PLATFORM_NULL
+	if (headless)
+		glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
 	if (!glfwInit()) {
 		glfwTerminate();
 		errlog("couldn't initialize GLFW.");
@@ -59,6 +69,10 @@ initialize(void)
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (headless) {
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+	}
 
 	GLFWwindow *window = glfwCreateWindow(WIDTH, HEIGHT, FULLNAME, NULL, NULL);
 	if (!window) {
@@ -68,14 +82,17 @@ initialize(void)
 	}
 	glfwMakeContextCurrent(window);
 
+	/* a GLX build of GLEW loads GL fine, but finds no GLX display under EGL */
 	GLenum err = glewInit();
-	if (err != GLEW_OK) {
+	if (err != GLEW_OK && !(headless && err == GLEW_ERROR_NO_GLX_DISPLAY)) {
 		glfwDestroyWindow(window);
 		glfwTerminate();
 		errlog("couldn't initialize GLEW.");
 		exit(1);
 	}
-	glfwSwapInterval(1);
+	/* headless frames are never swapped, so never wait for vsync either */
+	if (!headless)
+		glfwSwapInterval(1);
 	glfwSetCursorPosCallback(window, mouse_callback);
 	glfwSetKeyCallback(window, key_callback);
 	glfwSetFramebufferSizeCallback(window, frame_buffer_size_callback);
@@ -89,7 +106,7 @@ initialize(void)
 		game.cam.view
 	);
 
-	glm_perspective(PI / 4, (float) WIDTH / HEIGHT, 0.05f, 128.0f, game.cam.projection);
+	glm_perspective(PI / 4, (float) WIDTH / HEIGHT, NEAR_PLANE, FAR_PLANE, game.cam.projection);
 
 	glEnable(GL_DEPTH_TEST);
 
@@ -100,114 +117,179 @@ GLchar *
 read_file(const char *path)
 {
 	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+		return NULL;
 
 	fseek(fp, 0L, SEEK_END);
 	long size = ftell(fp);
 	fseek(fp, 0L, SEEK_SET);
 
-	GLchar *src = malloc((size + 1) * sizeof(GLchar));
-	if (src == NULL)
+	GLchar *src = size < 0 ? NULL : malloc((size + 1) * sizeof(GLchar));
+	if (src != NULL && fread(src, 1, size, fp) != (size_t) size) {
+		free(src);
+		src = NULL;
+	}
+	fclose(fp);
+	if (src != NULL)
+		src[size] = '\0';
+
+	return src;
+}
+
+/*
+ * maps a whole file read-only, so it can be parsed in place and its pages
+ * dropped by the kernel instead of swapped. returns NULL on failure.
+ */
+const void *
+map_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
 		return NULL;
+	}
 
-	for (long i = 0; i < size; i++)
-		src[i] = getc(fp);
-	src[size] = '\0';
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
 
-	return src;
+	/* callers read all of it soon, start reading it in */
+	posix_madvise(map, st.st_size, POSIX_MADV_WILLNEED);
+	*size = st.st_size;
+	return map;
 }
 
-const GLuint
-create_shader(const char *path, const GLenum type)
+void
+unmap_file(const void *map, size_t size)
 {
-	GLchar *src = read_file(path);
-	if (src == NULL) {
-		errlog("couldn't read the %s file.", path);
-		glfwTerminate();
-		exit(1);
+	munmap((void *) map, size);
+}
+
+/*
+ * takes decoded RGBA pixels and builds their whole mip chain with a box
+ * filter into a single allocation. odd sizes drop the last row or column.
+ */
+static int
+build_mipmaps(struct image *image, unsigned char *pixels, int width, int height)
+{
+	if (pixels == NULL)
+		return 0;
+
+	image->format = GL_RGBA8;
+	image->width = width;
+	image->height = height;
+
+	size_t size = 0;
+	for (int level = 0; level < MAX_MIPS; level++) {
+		image->offsets[level] = size;
+		image->levels = level + 1;
+		size += (size_t) mip_size(width, level) * mip_size(height, level) * 4;
+		if (mip_size(width, level) == 1 && mip_size(height, level) == 1)
+			break;
 	}
+
 	/*
-	 * creating a const pointer so it can be passed as OpenGL expects it,
-	 * but preserving the original to free it afterwards.
+	 * SOIL allocates with malloc, so the chain grows the decoded image in
+	 * place rather than holding the base level twice.
 	 */
-	const GLchar *source = src;
-
-	const GLuint shader = glCreateShader(type);
-	glShaderSource(shader, 1, &source, NULL);
-	glCompileShader(shader);
-	free(src);
-
-	int success;
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-	if (!success) {
-		char info_log[512];
-		glGetShaderInfoLog(shader, sizeof(info_log), NULL, info_log);
-		fprintf(stderr, info_log);
-		errlog("couldn't compile the %s shader.", path);
-		glfwTerminate();
+	image->size = size;
+	image->pixels = realloc(pixels, size);
+	if (image->pixels == NULL) {
+		errlog("couldn't allocate the mip chain of a %dx%d image.", width, height);
 		exit(1);
 	}
 
-	return shader;
+	for (int level = 1; level < image->levels; level++) {
+		int sw = mip_size(width, level - 1), sh = mip_size(height, level - 1);
+		int dw = mip_size(width, level), dh = mip_size(height, level);
+		const unsigned char *src = image->pixels + image->offsets[level - 1];
+		unsigned char *dst = image->pixels + image->offsets[level];
+
+		for (int y = 0; y < dh; y++) {
+			int y0 = sh > 1 ? 2 * y : 0, y1 = sh > 1 ? 2 * y + 1 : 0;
+			for (int x = 0; x < dw; x++) {
+				int x0 = sw > 1 ? 2 * x : 0, x1 = sw > 1 ? 2 * x + 1 : 0;
+				for (int c = 0; c < 4; c++) {
+					dst[(y * dw + x) * 4 + c] = (
+						src[(y0 * sw + x0) * 4 + c] +
+						src[(y0 * sw + x1) * 4 + c] +
+						src[(y1 * sw + x0) * 4 + c] +
+						src[(y1 * sw + x1) * 4 + c] + 2
+					) / 4;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+/* decodes an image file to RGBA with its mip chain, safe off the GL thread */
+int
+load_image(const char *path, struct image *image)
+{
+	int width, height;
+	unsigned char *pixels = SOIL_load_image(path, &width, &height, NULL, SOIL_LOAD_RGBA);
+	return build_mipmaps(image, pixels, width, height);
+}
+
+int
+load_image_from_memory(const unsigned char *buffer, size_t size, struct image *image)
+{
+	int width, height;
+	unsigned char *pixels = SOIL_load_image_from_memory(buffer, size, &width, &height,
+		NULL, SOIL_LOAD_RGBA);
+	return build_mipmaps(image, pixels, width, height);
 }
 
+/* the lowest mips show up right away, the rest streams in over the next frames */
 const GLuint
-create_shader_program(const GLuint vs, const GLuint fs)
+create_texture(const char *path)
 {
-	const GLuint program = glCreateProgram();
-	glAttachShader(program, vs);
-	glAttachShader(program, fs);
-	glLinkProgram(program);
-
-	int success;
-	glGetProgramiv(program, GL_LINK_STATUS, &success);
-	if (!success) {
-		char info_log[512];
-		glGetProgramInfoLog(program, sizeof(info_log), NULL, info_log);
-		glfwTerminate();
-		fprintf(stderr, info_log);
-		errlog("couldn't link the shaders.");
-		exit(1);
+	struct image image;
+	if (!load_image(path, &image)) {
+		errlog("couldn't load the %s texture: %s", path, SOIL_last_result());
+		return 0;
 	}
-	return program;
+	return stream_texture(&image);
 }
 
 const GLuint
-create_texture(const char *path)
+create_texture_from_memory(const unsigned char *buffer, size_t size)
 {
-	/*
-	int width, height;
-	unsigned char *img = SOIL_load_image(path, &width, &height, 0, SOIL_LOAD_RGBA);
-	if (!img) return 0;
+	struct image image;
+	if (!load_image_from_memory(buffer, size, &image)) {
+		errlog("couldn't load a texture: %s", SOIL_last_result());
+		return 0;
+	}
+	return stream_texture(&image);
+}
 
-	GLuint tex;
-	glGenTextures(1, &tex);
-	glBindTexture(GL_TEXTURE_2D, tex);
+const GLuint
+create_sampler(GLint min_filter, GLint mag_filter, GLint wrap_s, GLint wrap_t)
+{
+	static GLfloat max_anisotropy = -1.0f;
+	if (max_anisotropy < 0.0f) {
+		max_anisotropy = 1.0f;
+		if (GLEW_ARB_texture_filter_anisotropic || GLEW_EXT_texture_filter_anisotropic)
+			glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY, &max_anisotropy);
+	}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, img);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	GLuint sampler;
+	glGenSamplers(1, &sampler);
+	glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, min_filter);
+	glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, mag_filter);
+	glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, wrap_s);
+	glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, wrap_t);
 
-	SOIL_free_image_data(img);
+	/* anisotropy only makes sense when sampling between mip levels */
+	if (min_filter != GL_NEAREST && min_filter != GL_LINEAR)
+		glSamplerParameterf(sampler, GL_TEXTURE_MAX_ANISOTROPY, max_anisotropy);
 
-	return tex;
-	*/
-	return SOIL_load_OGL_texture(
-		path,
-		SOIL_LOAD_AUTO,
-		SOIL_CREATE_NEW_ID,
-		SOIL_FLAG_MIPMAPS |
-		SOIL_FLAG_COMPRESS_TO_DXT
-	);
-}
-const GLuint
-create_texture_from_memory(const unsigned char *buffer, size_t size)
-{
-	return SOIL_load_OGL_texture_from_memory(
-		buffer,
-		size,
-		SOIL_LOAD_RGBA,
-		SOIL_CREATE_NEW_ID,
-		SOIL_FLAG_MIPMAPS
-	);
+	return sampler;
 }
 
 const GLuint
@@ -231,50 +313,6 @@ create_cubemap(const char *paths[6])
 	return cubemap;
 }
 
-void
-move_camera(void)
-{
-	float speed = game.cam.speed * game.delta_time;
-	if (game.input & DUCK) {
-		speed /= 4;
-	}
-	else if (game.input & SPRINT) {
-		speed *= 4;
-	}
-
-	vec3 scaled_front;
-	if (game.input & BACKWARD) {
-		glm_vec3_scale(game.cam.front, speed, scaled_front);
-		glm_vec3_sub(game.cam.pos, scaled_front, game.cam.pos);
-	}
-	if (game.input & FORWARD) {
-		glm_vec3_scale(game.cam.front, speed, scaled_front);
-		glm_vec3_add(game.cam.pos, scaled_front, game.cam.pos);
-	}
-	vec3 cam_right;
-	if (game.input & LEFT) {
-		glm_cross(game.cam.front, game.cam.up, cam_right);
-		glm_normalize(cam_right);
-		glm_vec3_scale(cam_right, speed, cam_right);
-		glm_vec3_sub(game.cam.pos, cam_right, game.cam.pos);
-	}
-	if (game.input & RIGHT) {
-		glm_cross(game.cam.front, game.cam.up, cam_right);
-		glm_normalize(cam_right);
-		glm_vec3_scale(cam_right, speed, cam_right);
-		glm_vec3_add(game.cam.pos, cam_right, game.cam.pos);
-	}
-
-	glm_vec3_add(game.cam.pos, game.cam.front, game.cam.target);
-
-	glm_lookat(
-		game.cam.pos,
-		game.cam.target,
-		game.cam.up,
-		game.cam.view
-	);
-}
-
 void
 errlog(const char *format, ...)
 {
@@ -297,9 +335,9 @@ void
 press(const int i, const int action)
 {
 	if (action == GLFW_PRESS)
-		game.input |= i;
+		press_keys(i, 1);
 	else if (action == GLFW_RELEASE)
-		game.input &= ~i;
+		press_keys(i, 0);
 }
 
 void
@@ -325,33 +363,7 @@ mouse_callback(GLFWwindow *window, double xpos, double ypos)
 	last_x = xpos;
 	last_y = ypos;
 
-	float sensitivity = game.cam.sensitivity * game.delta_time;
-	xoffset *= sensitivity;
-	yoffset *= sensitivity;
-
-	game.cam.yaw += xoffset;
-	game.cam.pitch += yoffset;
-	if (game.cam.pitch > PI / 2 - 0.01) {
-		game.cam.pitch = PI / 2 - 0.01;
-	}
-	else if (game.cam.pitch < -PI / 2 + 0.01) {
-		game.cam.pitch = -PI / 2 + 0.01;
-	}
-
-	double cos_pitch = cos(game.cam.pitch);
-	game.cam.front[0] = cos(game.cam.yaw) * cos_pitch;
-	game.cam.front[1] = sin(game.cam.pitch);
-	game.cam.front[2] = sin(game.cam.yaw) * cos_pitch;
-	glm_normalize(game.cam.front);
-
-	glm_vec3_add(game.cam.pos, game.cam.front, game.cam.target);
-
-	glm_lookat(
-		game.cam.pos,
-		game.cam.target,
-		game.cam.up,
-		game.cam.view
-	);
+	look(xoffset, yoffset);
 }
 
 void
@@ -376,6 +388,22 @@ key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
 	case GLFW_KEY_LEFT_CONTROL:
 		press(SPRINT, action);
 		break;
+	case GLFW_KEY_P:
+		if (action == GLFW_PRESS)
+			game.print_stats = 1;
+		break;
+	case GLFW_KEY_Z:
+		if (action == GLFW_PRESS) {
+			game.depth_prepass = !game.depth_prepass;
+			printf("depth pre-pass %s\n", game.depth_prepass ? "on" : "off");
+		}
+		break;
+	case GLFW_KEY_O:
+		if (action == GLFW_PRESS) {
+			game.occlusion_culling = !game.occlusion_culling;
+			printf("occlusion culling %s\n", game.occlusion_culling ? "on" : "off");
+		}
+		break;
 	case GLFW_KEY_Q:
 		glfwSetWindowShouldClose(window, GLFW_TRUE);
 		break;
@@ -391,6 +419,7 @@ frame_buffer_size_callback(GLFWwindow *window, int width, int height)
 	int viewport_y = 0;
 
 	glViewport(viewport_x, viewport_y, viewport_width, viewport_height);
+	game.viewport_height = viewport_height;
 }
 
 struct skybox
@@ -433,22 +462,10 @@ create_skybox(const char *paths[6])
 }
 
 void
-render_skybox(const struct skybox skybox, const GLuint shader_program)
+render_skybox(const struct skybox skybox, const struct program program)
 {
 	glDepthFunc(GL_LEQUAL);
-	glUseProgram(shader_program);
-
-	mat4 rotation_matrix;
-	glm_mat4_identity(rotation_matrix);
-	mat3 rotation_matrix3;
-	glm_mat4_pick3(game.cam.view, rotation_matrix3);
-	glm_mat4_ins3(rotation_matrix3, rotation_matrix);
-
-	mat4 transformation_matrix;
-	glm_mat4_mul(game.cam.projection, rotation_matrix, transformation_matrix);
-
-	GLuint u_transformation = glGetUniformLocation(shader_program, "u_transformation");
-	glUniformMatrix4fv(u_transformation, 1, GL_FALSE, *transformation_matrix);
+	glUseProgram(program.ID);
 
 	glBindVertexArray(skybox.VAO);
 
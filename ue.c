@@ -1,5 +1,10 @@
 /* See LICENSE for license details. */
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <cglm/cglm.h>
 /* glew must be included first, then glfw */
@@ -7,13 +12,163 @@
 #include <GLFW/glfw3.h>
 #include <SOIL2/SOIL2.h>
 
+#include "shaders.h"
 #include "utils.h"
+#include "streamer.h"
+#include "sim.h"
 #include "models.h"
+#include "cache.h"
+#include "loader.h"
+#include "lights.h"
+#include "culling.h"
+#include "bvh.h"
+#include "render.h"
+#include "occlusion.h"
+#include "profiler.h"
 
+/* small lights hovering over the map, on a FIELD_LIGHTS by FIELD_LIGHTS grid */
+#define FIELD_LIGHTS 16
+#define FIELD_SPACING 0.5f
+#define FIELD_MARKER 0.02f	/* scale of the spheres showing them */
+
+/* benchmarks run untimed warmup frames, then step this much time a frame */
+#define BENCH_WARMUP 60
+#define BENCH_STEP (1.0f / 60.0f)
+
+/* per frame totals of a benchmark run, frame times in milliseconds */
+struct bench {
+	size_t n_frames;
+	double *frame_times;
+	double draws, depth_draws, commands, instances, visible, triangles;
+};
+
+static void
+usage(void)
+{
+	errlog("usage: %s [-b frames]", BIN);
+	exit(1);
+}
+
+/* headless contexts have no default framebuffer, benchmarks draw here */
+static void
+bind_offscreen_target(void)
+{
+	GLuint fbo, renderbuffers[2];
+
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WIDTH, HEIGHT);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, WIDTH, HEIGHT);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+		GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+		GL_RENDERBUFFER, renderbuffers[1]);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		errlog("couldn't create the offscreen framebuffer.");
+		exit(1);
+	}
+	glViewport(0, 0, WIDTH, HEIGHT);
+	game.viewport_height = HEIGHT;
+}
+
+/* one orbit around the scene over the timed frames, bobbing up and down */
+static void
+bench_camera(size_t frame, size_t n_frames)
+{
+	float angle = 2.0f * PI * frame / n_frames;
+
+	glm_vec3_copy((vec3) {
+		2.5f * sinf(angle),
+		0.5f + 0.3f * sinf(3.0f * angle),
+		2.5f * cosf(angle)
+	}, game.cam.pos);
+	glm_vec3_zero(game.cam.target);
+	glm_vec3_sub(game.cam.target, game.cam.pos, game.cam.front);
+	glm_normalize(game.cam.front);
+	glm_lookat(game.cam.pos, game.cam.target, game.cam.up, game.cam.view);
+}
+
+static void
+add_bench_frame(struct bench *bench, size_t frame, double time, const struct render_stats *stats)
+{
+	bench->frame_times[frame] = time * 1000.0;
+	bench->draws += stats->draws;
+	bench->depth_draws += stats->depth_draws;
+	bench->commands += stats->commands;
+	bench->instances += stats->instances;
+	bench->visible += stats->visible;
+	bench->triangles += stats->triangles;
+}
+
+static int
+compare_times(const void *a, const void *b)
+{
+	double ta = *(const double *) a, tb = *(const double *) b;
+	return (ta > tb) - (ta < tb);
+}
+
+/* prints the run as JSON, so results can be compared across commits */
+static void
+print_bench(struct bench *bench)
+{
+	size_t n = bench->n_frames;
+	double *times = bench->frame_times;
+	double total = 0.0;
+
+	for (size_t i = 0; i < n; i++)
+		total += times[i];
+	qsort(times, n, sizeof(double), compare_times);
+
+	printf("{\n");
+	printf("\t\"renderer\": \"%s\",\n", (const char *) glGetString(GL_RENDERER));
+	printf("\t\"width\": %d,\n\t\"height\": %d,\n\t\"frames\": %zu,\n", WIDTH, HEIGHT, n);
+	printf("\t\"depth_prepass\": %d,\n\t\"occlusion_culling\": %d,\n",
+		game.depth_prepass, game.occlusion_culling);
+	printf("\t\"frame_ms\": { \"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, "
+		"\"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+		total / n, times[0], times[n * 50 / 100], times[n * 95 / 100],
+		times[n * 99 / 100], times[n - 1]);
+	/* triangles of the frustum visible instances, before occlusion culling */
+	printf("\t\"per_frame\": { \"draws\": %.1f, \"depth_draws\": %.1f, \"commands\": %.1f, "
+		"\"instances\": %.1f, \"visible\": %.1f, \"triangles\": %.0f }\n",
+		bench->draws / n, bench->depth_draws / n, bench->commands / n,
+		bench->instances / n, bench->visible / n, bench->triangles / n);
+	printf("}\n");
+}
+
+/*
+ * with -b, renders frames headless along a scripted camera path once
+ * everything is loaded, with a fixed time step and each frame finished
+ * before the next, and prints their statistics instead of showing them.
+ */
 int
-main(void)
+main(int argc, char *argv[])
 {
-	GLFWwindow *window = initialize();
+	struct bench bench = { 0 };
+
+	if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+		long n = strtol(argv[2], NULL, 10);
+		if (n <= 0)
+			usage();
+		bench.n_frames = n;
+		bench.frame_times = malloc(bench.n_frames * sizeof(double));
+		if (bench.frame_times == NULL) {
+			errlog("couldn't allocate %zu frame times.", bench.n_frames);
+			exit(1);
+		}
+	}
+	else if (argc != 1) {
+		usage();
+	}
+
+	GLFWwindow *window = initialize(bench.n_frames > 0);
+	if (bench.n_frames > 0)
+		bind_offscreen_target();
 
 	const char *faces[] = {
 		"img/skybox/right.jpg",
@@ -26,29 +181,57 @@ main(void)
 
 	struct skybox skybox = create_skybox(faces);
 
-	const GLuint entity_vs = create_shader("shaders/entity.vs.glsl", GL_VERTEX_SHADER);
-	const GLuint entity_fs = create_shader("shaders/entity.fs.glsl", GL_FRAGMENT_SHADER);
-	const GLuint light_vs = create_shader("shaders/light.vs.glsl", GL_VERTEX_SHADER);
-	const GLuint light_fs = create_shader("shaders/light.fs.glsl", GL_FRAGMENT_SHADER);
-	const GLuint skybox_vs = create_shader("shaders/skybox.vs.glsl", GL_VERTEX_SHADER);
-	const GLuint skybox_fs = create_shader("shaders/skybox.fs.glsl", GL_FRAGMENT_SHADER);
+	const struct uniform_buffers ubos = create_uniform_buffers();
+	struct light_grid light_grid;
+	create_light_grid(&light_grid);
+	struct render_queue queue = { 0 };
 
-	const GLuint entity_shader_program = create_shader_program(entity_vs, entity_fs);
-	const GLuint light_shader_program = create_shader_program(light_vs, light_fs);
-	const GLuint skybox_shader_program = create_shader_program(skybox_vs, skybox_fs);
+	/* alpha tested meshes get the variants, so opaque ones keep early depth testing */
+	struct program entity_shader_program =
+		load_program("shaders/entity.vs.glsl", "shaders/entity.fs.glsl", NULL);
+	struct program entity_alpha_program =
+		load_program("shaders/entity.vs.glsl", "shaders/entity.fs.glsl", "#define ALPHA_TEST\n");
+	entity_shader_program.alpha_tested = &entity_alpha_program;
 
-	glDeleteShader(entity_vs);
-	glDeleteShader(entity_fs);
-	glDeleteShader(light_vs);
-	glDeleteShader(light_fs);
-	glDeleteShader(skybox_vs);
-	glDeleteShader(skybox_fs);
+	struct program depth_shader_program =
+		load_program("shaders/depth.vs.glsl", "shaders/depth.fs.glsl", NULL);
+	struct program depth_alpha_program =
+		load_program("shaders/depth.vs.glsl", "shaders/depth.fs.glsl", "#define ALPHA_TEST\n");
+	depth_shader_program.alpha_tested = &depth_alpha_program;
+	queue.depth_program = &depth_shader_program;
 
-	const struct model map = load_model("mod/map/map.glb");
-	const struct model marble = load_model("mod/marble/marble_bust_01_4k.gltf");
-	const struct model light = load_model("mod/sphere/sphere.glb");
+	struct occlusion occlusion;
+	create_occlusion(&occlusion);
+	queue.occlusion = &occlusion;
+
+	struct program light_shader_program =
+		load_program("shaders/light.vs.glsl", "shaders/light.fs.glsl", NULL);
+	struct program skybox_shader_program =
+		load_program("shaders/skybox.vs.glsl", "shaders/skybox.fs.glsl", NULL);
+
+	struct loader loader;
+	struct model map, marble, light;
+
+	start_loader(&loader);
+	queue_load(&loader, &light, "mod/sphere/sphere.pack", LOAD_QUANTIZE);
+	queue_load(&loader, &map, "mod/map/map.pack", LOAD_QUANTIZE);
+	queue_load(&loader, &marble, "mod/marble/marble_bust_01_4k.pack", LOAD_QUANTIZE);
+
+	/* the driver compiled the programs while the models started loading */
+	struct program *programs[] = {
+		&entity_shader_program, &entity_alpha_program,
+		&depth_shader_program, &depth_alpha_program,
+		&light_shader_program, &skybox_shader_program,
+	};
+	for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++)
+		finish_program(programs[i]);
 
 	mat4 map_model_matrix, light_model_matrix, marble_model_matrix;
+	/*
+	 * the field lights are marked by one instanced sphere, outside of
+	 * benchmarks so their workload stays comparable with earlier runs
+	 */
+	mat4 field_model_matrices[FIELD_LIGHTS * FIELD_LIGHTS];
 
 	glm_mat4_identity(map_model_matrix);
 	glm_scale(map_model_matrix, (vec3) { 1.5f, 1.5f, 1.5f });
@@ -57,36 +240,170 @@ main(void)
 	glm_mat4_identity(marble_model_matrix);
 	glm_mat4_identity(light_model_matrix);
 
-	while (!glfwWindowShouldClose(window)) {
-		float current_frame = glfwGetTime();
-		game.delta_time = current_frame - game.last_frame;
-		game.last_frame = current_frame;
+	const size_t orbiting_light = add_pos_light(&(struct pos_light) {
+		{ 0.0f, 0.0f, 0.0f },	/* pos */
+		{ 0.2f, 0.2f, 0.2f },	/* ambient */
+		{ 1.0f, 1.0f, 1.0f },	/* diffuse */
+		{ 1.0f, 1.0f, 1.0f },	/* specular */
+		0.09f,			/* linear */
+		0.032f			/* quadratic */
+	});
+
+	const size_t first_field_light = n_pos_lights;
+	for (int i = 0; i < FIELD_LIGHTS * FIELD_LIGHTS; i++) {
+		struct pos_light light = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f } };
+		/* spread the hues around so neighbours differ */
+		glm_vec3_copy((vec3) {
+			0.25f + 0.25f * sinf(i * 2.4f),
+			0.25f + 0.25f * sinf(i * 2.4f + 2.1f),
+			0.25f + 0.25f * sinf(i * 2.4f + 4.2f)
+		}, light.diffuse);
+		glm_vec3_copy(light.diffuse, light.specular);
+		light.linear = 4.0f;
+		light.quadratic = 32.0f;
+		add_pos_light(&light);
+	}
+
+	struct scene scene = { 0 };
+	int scene_built = 0;
+	/* the levels the light spheres were last drawn at, once their model is in */
+	unsigned char *light_lods = NULL, *field_lods = NULL;
+	size_t frame = 0;
+
+	/* timed frames shouldn't upload anything */
+	if (bench.n_frames > 0) {
+		while (update_loader(&loader, 0.1) > 0 || streamer.n_streams > 0) {
+			update_streamer(STREAM_SEGMENT_SIZE);
+			glFinish();
+		}
+	}
+	else {
+		start_sim(&game.cam);
+	}
+
+	while (bench.n_frames > 0 ? frame < BENCH_WARMUP + bench.n_frames :
+			!glfwWindowShouldClose(window)) {
+		double frame_start = glfwGetTime();
+		float current_frame = bench.n_frames > 0 ? frame * BENCH_STEP : frame_start;
+
+		/* spend a few milliseconds a frame on uploads until everything is in */
+		PROFILE_BEGIN(uploads);
+		update_loader(&loader, 0.004);
+		update_streamer(4 << 20);
+		PROFILE_END(uploads);
+
+		if (!scene_built && map.ready && marble.ready) {
+			add_static_model(&scene, &map, &entity_shader_program, map_model_matrix);
+			add_static_model(&scene, &marble, &entity_shader_program, marble_model_matrix);
+			build_scene(&scene);
+			scene_built = 1;
+		}
+		if (light_lods == NULL && light.ready) {
+			light_lods = calloc(light.n_meshes, 1);
+			field_lods = calloc(light.n_meshes * FIELD_LIGHTS * FIELD_LIGHTS, 1);
+			if (light_lods == NULL || field_lods == NULL) {
+				errlog("couldn't allocate the levels of detail of the lights.");
+				exit(1);
+			}
+		}
 
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		if (game.input) {
-			move_camera();
+		if (bench.n_frames > 0) {
+			bench_camera(frame < BENCH_WARMUP ? 0 : frame - BENCH_WARMUP, bench.n_frames);
+		}
+		else {
+			interpolate_camera(&game.cam, frame_start);
 		}
 
 		float radius = 1.0f;
 		float light_x = sin(current_frame) * radius;
 		float light_z = cos(current_frame) * radius;
 
-		glm_vec3_copy((vec3) { light_x, light_x * light_x, light_z }, pos_lights[0].pos);
+		glm_vec3_copy((vec3) { light_x, light_x * light_x, light_z }, pos_lights[orbiting_light].pos);
 		glm_mat4_identity(light_model_matrix);
-		glm_translate(light_model_matrix, pos_lights[0].pos);
+		glm_translate(light_model_matrix, pos_lights[orbiting_light].pos);
 		glm_scale(light_model_matrix, (vec3) { 0.1f, 0.1f, 0.1f });
 
-		render_model(map, entity_shader_program, map_model_matrix);
-		render_model(marble, entity_shader_program, marble_model_matrix);
-		render_model(light, light_shader_program, light_model_matrix);
+		for (int i = 0; i < FIELD_LIGHTS * FIELD_LIGHTS; i++) {
+			float x = (i % FIELD_LIGHTS - (FIELD_LIGHTS - 1) / 2.0f) * FIELD_SPACING;
+			float z = (i / FIELD_LIGHTS - (FIELD_LIGHTS - 1) / 2.0f) * FIELD_SPACING;
+			float y = 0.1f + 0.1f * sinf(current_frame * 2.0f + i);
+			glm_vec3_copy((vec3) { x, y, z }, pos_lights[first_field_light + i].pos);
+			glm_mat4_identity(field_model_matrices[i]);
+			glm_translate(field_model_matrices[i], (vec3) { x, y, z });
+			glm_scale(field_model_matrices[i], (vec3) { FIELD_MARKER, FIELD_MARKER, FIELD_MARKER });
+		}
+
+		PROFILE_BEGIN(lights);
+		update_uniform_buffers(ubos);
+		update_light_grid(&light_grid);
+		PROFILE_END(lights);
+
+		PROFILE_BEGIN(queue);
+		queue_scene(&queue, &scene);
+		queue_model(&queue, &light, &light_shader_program, light_model_matrix, light_lods);
+		if (bench.n_frames == 0) {
+			queue_model_instances(&queue, &light, &light_shader_program,
+				field_model_matrices, field_lods, FIELD_LIGHTS * FIELD_LIGHTS);
+		}
+		PROFILE_END(queue);
+		flush_render_queue(&queue);
+
+		if (game.print_stats) {
+			print_render_stats(queue.stats);
+			print_cache_stats();
+			print_light_stats(&light_grid);
+			PROFILE_PRINT();
+			game.print_stats = 0;
+		}
 
+		GPU_PROFILE_BEGIN(skybox);
 		render_skybox(skybox, skybox_shader_program);
+		GPU_PROFILE_END(skybox);
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		if (bench.n_frames > 0) {
+			glFinish();
+			if (frame >= BENCH_WARMUP)
+				add_bench_frame(&bench, frame - BENCH_WARMUP,
+					glfwGetTime() - frame_start, &queue.stats);
+		}
+		else {
+			/* blocks on vsync, or on the GPU when it's behind */
+			PROFILE_BEGIN(swap);
+			glfwSwapBuffers(window);
+			PROFILE_END(swap);
+			glfwPollEvents();
+		}
+		PROFILE_FRAME();
+		frame++;
 	}
 
+	if (bench.n_frames > 0) {
+		print_bench(&bench);
+		free(bench.frame_times);
+	}
+	else {
+		stop_sim();
+	}
+
+	PROFILE_EXPORT(PROFILE_TRACE);
+	stop_loader(&loader);
+
+	/* drops every reference, so the cache destroys all it holds */
+	struct model *models[] = { &map, &marble, &light };
+	for (size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+		if (models[i]->ready)
+			release_model(models[i]);
+	}
+	for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++)
+		release_program(programs[i]);
+	release_program(&occlusion.first_level);
+	release_program(&occlusion.reduce);
+	release_program(&occlusion.cull);
+	evict_cache(0);
+	free(light_lods);
+	free(field_lods);
 	glfwTerminate();
 	return 0;
 }